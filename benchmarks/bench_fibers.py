@@ -0,0 +1,669 @@
+"""
+Benchmarks for the switch path of fibers, built on pyperf.
+
+    PYTHONPATH=. python benchmarks/bench_fibers.py -o cfibers.json
+    PYTHONPATH=. pypy3 benchmarks/bench_fibers.py -o pyfibers.json
+    python -m pyperf compare_to cfibers.json pyfibers.json
+
+Use --backend to pick the implementation: 'c' (fibers._cfibers), 'py'
+(fibers._pyfibers, PyPy only) or 'auto' (whatever 'import fibers' uses).
+"""
+
+import collections
+import importlib
+import socket
+import sys
+import threading
+import time
+
+import pyperf
+
+
+BACKENDS = {
+    'auto': 'fibers',
+    'c': 'fibers._cfibers',
+    'py': 'fibers._pyfibers',
+}
+
+PY_DEPTHS = (1, 10, 100, 500)
+C_DEPTHS = (1, 10, 50, 200)
+PARENT_CHAIN_LENGTHS = (1, 10, 100)
+SEPARATE_STACK_SIZE = 1024 * 1024
+SCHEDULER_FIBERS = 100
+CHANNEL_CAPACITY = 128
+IO_CONNECTIONS = (1, 100, 1000)
+THREADS = (1, 4)
+INTERPRETERS = (1, 4)
+QUEENS = 6
+
+
+def py_nest(depth, func):
+    # Python calls don't use the C stack on CPython >= 3.11
+    if depth == 0:
+        return func()
+    return py_nest(depth - 1, func)
+
+
+def c_nest(depth, func):
+    # calling through map() makes the C stack grow on every level
+    if depth == 0:
+        return func()
+    return list(map(c_nest, [depth - 1], [func]))
+
+
+def switch_forever(fiber):
+    while True:
+        fiber.switch()
+
+
+def bench_switch(loops, fibers, nest=py_nest, depth=0, stack_size=0):
+    """A ping-pong: each loop switches into a fiber and back."""
+    main = fibers.current()
+    g = fibers.Fiber(target=nest, args=(depth, lambda: switch_forever(main)), stack_size=stack_size)
+    g.switch()
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        g.switch()
+    return pyperf.perf_counter() - t0
+
+
+def start_together(barrier):
+    """Release the threads waiting on the barrier and return the start time."""
+    while barrier.n_waiting < barrier.parties - 1:
+        time.sleep(0.001)
+    t0 = pyperf.perf_counter()
+    barrier.wait()
+    return t0
+
+
+def bench_switch_threads(loops, fibers, nthreads):
+    """The switch ping-pong on each of N threads at the same time. Without the
+    GIL (free-threaded builds) the time should stay close to that of one."""
+    barrier = threading.Barrier(nthreads + 1)
+
+    def run():
+        main = fibers.current()
+        g = fibers.Fiber(target=switch_forever, args=(main,))
+        g.switch()
+        barrier.wait()
+        for _ in range(loops):
+            g.switch()
+    threads = [threading.Thread(target=run) for _ in range(nthreads)]
+    for t in threads:
+        t.start()
+    t0 = start_together(barrier)
+    for t in threads:
+        t.join()
+    return pyperf.perf_counter() - t0
+
+
+SUBINTERPRETER_SWITCH = """
+g = fibers.Fiber(target=switch_forever, args=(fibers.current(),))
+g.switch()
+for _ in range(%d):
+    g.switch()
+"""
+
+
+def bench_switch_interpreters(loops, fibers, ninterps):
+    """The switch ping-pong on N threads, each in its own subinterpreter. Those
+    have their own GIL from 3.12 on, so the time should stay close to that of
+    one."""
+    interpreters = subinterpreters_module()
+    barrier = threading.Barrier(ninterps + 1)
+    interps = [interpreters.create() for _ in range(ninterps)]
+    setup = 'import sys; sys.path[:] = %r\nimport fibers\n' % (sys.path,)
+    setup += 'def switch_forever(fiber):\n    while True:\n        fiber.switch()\n'
+
+    def run(interp):
+        interpreters.run_string(interp, setup)
+        barrier.wait()
+        interpreters.run_string(interp, SUBINTERPRETER_SWITCH % loops)
+    threads = [threading.Thread(target=run, args=(interp,)) for interp in interps]
+    for t in threads:
+        t.start()
+    t0 = start_together(barrier)
+    for t in threads:
+        t.join()
+    dt = pyperf.perf_counter() - t0
+    for interp in interps:
+        interpreters.destroy(interp)
+    return dt
+
+
+def switch_in_call(fiber):
+    fiber.switch()
+
+
+def bench_switch_call(loops, fibers):
+    """The ping-pong, with each switch done from a new Python frame."""
+    main = fibers.current()
+
+    def run():
+        while True:
+            switch_in_call(main)
+    g = fibers.Fiber(target=run)
+    g.switch()
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        g.switch()
+    return pyperf.perf_counter() - t0
+
+
+def bench_construct(loops, fibers):
+    """Create a fiber, without running it."""
+    Fiber = fibers.Fiber
+    func = lambda: None
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        Fiber(target=func)
+    return pyperf.perf_counter() - t0
+
+
+def bench_switch_value(loops, fibers):
+    """The ping-pong, passing a value both ways."""
+    main = fibers.current()
+
+    def echo():
+        value = main.switch()
+        while True:
+            value = main.switch(value)
+    g = fibers.Fiber(target=echo)
+    g.switch()
+    switch = g.switch
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for i in range_it:
+        switch(i)
+    return pyperf.perf_counter() - t0
+
+
+def bench_create(loops, fibers):
+    """Create a fiber and run it to completion."""
+    Fiber = fibers.Fiber
+    func = lambda: None
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        Fiber(target=func).switch()
+    return pyperf.perf_counter() - t0
+
+
+class Ping(Exception):
+    pass
+
+
+def bench_throw(loops, fibers):
+    """Throw an exception into a fiber, which catches it and switches back."""
+    main = fibers.current()
+
+    def catcher():
+        while True:
+            try:
+                main.switch()
+            except Ping:
+                pass
+    g = fibers.Fiber(target=catcher)
+    g.switch()
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        g.throw(Ping)
+    return pyperf.perf_counter() - t0
+
+
+def make_orphan(fibers, length):
+    """Return a suspended fiber whose 'length' ancestors have all ended, so
+    that when it finishes the parent chain must be walked up to main."""
+    main = fibers.current()
+    chain = []
+
+    def leaf():
+        main.switch()
+
+    def link(n):
+        if n == 0:
+            child = fibers.Fiber(target=leaf)
+        else:
+            child = fibers.Fiber(target=link, args=(n - 1,))
+        chain.append(child)
+        child.switch()
+
+    chain.append(fibers.Fiber(target=link, args=(length - 1,)))
+    chain[0].switch()
+    # the leaf is suspended in main.switch(), resuming its parent ends it
+    # and then all the other ancestors in turn
+    chain[-2].switch()
+    return chain[-1]
+
+
+def bench_parent_chain(loops, fibers, length):
+    """Finish a fiber whose parents have ended, returning to main."""
+    elapsed = 0
+    while loops:
+        n = min(loops, 1000)
+        loops -= n
+        orphans = [make_orphan(fibers, length) for _ in range(n)]
+        t0 = pyperf.perf_counter()
+        for g in orphans:
+            g.switch()
+        elapsed += pyperf.perf_counter() - t0
+    return elapsed
+
+
+class PyScheduler(object):
+    """The usual scheduler loop, written in Python on top of switch()."""
+
+    def __init__(self, fibers):
+        self.fibers = fibers
+        self.ready = collections.deque()
+        self.hub = None
+
+    def spawn(self, func, *args):
+        fiber = self.fibers.Fiber(target=func, args=args)
+        self.ready.append(fiber)
+        return fiber
+
+    def yield_(self):
+        self.ready.append(self.fibers.current())
+        self.hub.switch()
+
+    def run(self):
+        self.hub = self.fibers.current()
+        ready = self.ready
+        while ready:
+            fiber = ready.popleft()
+            fiber.parent = self.hub
+            fiber.switch()
+
+
+def bench_scheduler(loops, fibers, factory):
+    """Fibers which do nothing but yield to each other, once per loop."""
+    sched = factory(fibers)
+
+    def worker(n):
+        yield_ = sched.yield_
+        for _ in range(n):
+            yield_()
+    n, extra = divmod(loops, SCHEDULER_FIBERS)
+    for i in range(SCHEDULER_FIBERS):
+        sched.spawn(worker, n + (i < extra))
+    t0 = pyperf.perf_counter()
+    sched.run()
+    return pyperf.perf_counter() - t0
+
+
+def bench_tasks(loops, fibers, pooled):
+    """Run one short task per loop, spawned or submitted to a FiberPool."""
+    sched = fibers.Scheduler()
+    submit = fibers.FiberPool(sched).submit if pooled else sched.spawn
+    func = lambda: None
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        submit(func)
+    sched.run()
+    return pyperf.perf_counter() - t0
+
+
+def bench_channel(loops, fibers, capacity=0, batched=False):
+    """A producer sends one item per loop to a consumer."""
+    sched = fibers.Scheduler()
+    ch = fibers.Channel(capacity)
+
+    def producer():
+        if batched:
+            ch.send_many(range(loops))
+        else:
+            send = ch.send
+            for i in range(loops):
+                send(i)
+        ch.close()
+
+    def consumer():
+        if batched:
+            recv_many = ch.recv_many
+            try:
+                while True:
+                    recv_many(capacity)
+            except fibers.ChannelClosed:
+                pass
+        else:
+            for _ in ch:
+                pass
+    sched.spawn(consumer)
+    sched.spawn(producer)
+    t0 = pyperf.perf_counter()
+    sched.run()
+    return pyperf.perf_counter() - t0
+
+
+def bench_channel_python(loops, fibers):
+    """The same with a deque and switch(), as done without Channel."""
+    queue = collections.deque()
+    main = fibers.current()
+
+    def consume():
+        popleft = queue.popleft
+        while True:
+            popleft()
+            main.switch()
+    consumer = fibers.Fiber(target=consume)
+    append = queue.append
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for i in range_it:
+        append(i)
+        consumer.switch()
+    return pyperf.perf_counter() - t0
+
+
+def bench_generator(loops, fibers):
+    """Iterate over a fibers.Generator which yields one item per loop."""
+    yield_ = fibers.yield_
+
+    def produce(n):
+        for i in range(n):
+            yield_(i)
+    t0 = pyperf.perf_counter()
+    for _ in fibers.Generator(produce, (loops,)):
+        pass
+    return pyperf.perf_counter() - t0
+
+
+def bench_generator_genlet(loops, fibers):
+    """The same with a Fiber subclass driven from Python, as in the tests."""
+    current = fibers.current
+
+    class genlet(fibers.Fiber):
+        def __iter__(self):
+            return self
+
+        def __next__(self):
+            self.parent = current()
+            result = self.switch()
+            if self.is_alive():
+                return result
+            raise StopIteration
+
+    def Yield(value):
+        g = current()
+        while not isinstance(g, genlet):
+            g = g.parent
+        g.parent.switch(value)
+
+    def produce(n):
+        for i in range(n):
+            Yield(i)
+    t0 = pyperf.perf_counter()
+    for _ in genlet(produce, (loops,)):
+        pass
+    return pyperf.perf_counter() - t0
+
+
+def bench_generator_python(loops, fibers):
+    """The same with a native Python generator, for reference."""
+    def produce(n):
+        for i in range(n):
+            yield i
+    t0 = pyperf.perf_counter()
+    for _ in produce(loops):
+        pass
+    return pyperf.perf_counter() - t0
+
+
+def bench_io_echo(loops, fibers, connections):
+    """Clients send a message per loop to echo servers over socket pairs."""
+    sched = fibers.Scheduler()
+    pairs = [socket.socketpair() for _ in range(connections)]
+
+    def echo(sock):
+        wait_readable = sched.wait_readable
+        recv = sock.recv
+        send = sock.send
+        while True:
+            wait_readable(sock)
+            data = recv(64)
+            if not data:
+                break
+            send(data)
+
+    def client(sock, n):
+        wait_readable = sched.wait_readable
+        recv = sock.recv
+        send = sock.send
+        for _ in range(n):
+            send(b'x')
+            wait_readable(sock)
+            recv(64)
+        sock.shutdown(socket.SHUT_WR)
+
+    n, extra = divmod(loops, connections)
+    for i, (a, b) in enumerate(pairs):
+        a.setblocking(False)
+        b.setblocking(False)
+        sched.spawn(echo, a)
+        sched.spawn(client, b, n + (i < extra))
+    t0 = pyperf.perf_counter()
+    sched.run()
+    elapsed = pyperf.perf_counter() - t0
+    for a, b in pairs:
+        a.close()
+        b.close()
+    return elapsed
+
+
+def loopback_pairs(n):
+    """Connected TCP sockets over the loopback interface."""
+    server = socket.socket()
+    server.bind(('127.0.0.1', 0))
+    server.listen(n)
+    pairs = []
+    for _ in range(n):
+        client = socket.create_connection(server.getsockname())
+        conn, _ = server.accept()
+        for sock in (client, conn):
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            sock.setblocking(False)
+        pairs.append((conn, client))
+    server.close()
+    return pairs
+
+
+def bench_io_loopback(loops, fibers, connections, io_uring):
+    """Echo over loopback TCP with Scheduler.recv() and send(), which use
+    io_uring or wait for readiness with epoll."""
+    sched = fibers.Scheduler(io_uring=io_uring)
+    pairs = loopback_pairs(connections)
+
+    def echo(sock):
+        recv = sched.recv
+        send = sched.send
+        while True:
+            data = recv(sock, 64)
+            if not data:
+                break
+            send(sock, data)
+
+    def client(sock, n):
+        recv = sched.recv
+        send = sched.send
+        for _ in range(n):
+            send(sock, b'x')
+            recv(sock, 64)
+        sock.shutdown(socket.SHUT_WR)
+
+    n, extra = divmod(loops, connections)
+    for i, (a, b) in enumerate(pairs):
+        sched.spawn(echo, a)
+        sched.spawn(client, b, n + (i < extra))
+    t0 = pyperf.perf_counter()
+    sched.run()
+    elapsed = pyperf.perf_counter() - t0
+    for a, b in pairs:
+        a.close()
+        b.close()
+    return elapsed
+
+
+def queens(n, choose):
+    """Place n queens one row at a time, asking choose() for the column."""
+    cols = ()
+    for row in range(n):
+        col = choose(n)
+        for r, c in enumerate(cols):
+            if c == col or abs(c - col) == row - r:
+                return None
+        cols += (col,)
+    return cols
+
+
+def search_clone(fibers, n):
+    """Backtrack by cloning the search at each choice point."""
+    solutions = []
+
+    def explore(fiber, options):
+        for i in range(options):
+            g = fiber.clone() if i < options - 1 else fiber
+            result = g.switch(i)
+            if g.is_alive():
+                explore(g, result)
+            elif result is not None:
+                solutions.append(result)
+    g = fibers.Fiber(target=queens, args=(n, fibers.current().switch))
+    explore(g, g.switch())
+    return solutions
+
+
+def search_replay(fibers, n):
+    """Backtrack by running the search again, replaying the choices made
+    before the one to change."""
+    main = fibers.current()
+    solutions = []
+    path = []   # [choice, options] at each choice point
+    while True:
+        g = fibers.Fiber(target=queens, args=(n, main.switch))
+        result = g.switch()
+        depth = 0
+        while g.is_alive():
+            if depth == len(path):
+                path.append([0, result])
+            result = g.switch(path[depth][0])
+            depth += 1
+        if result is not None:
+            solutions.append(result)
+        del path[depth:]
+        while path and path[-1][0] + 1 == path[-1][1]:
+            path.pop()
+        if not path:
+            return solutions
+        path[-1][0] += 1
+
+
+def bench_backtrack(loops, fibers, search):
+    """Solve the n queens problem by backtracking, once per loop."""
+    range_it = range(loops)
+    t0 = pyperf.perf_counter()
+    for _ in range_it:
+        search(fibers, QUEENS)
+    return pyperf.perf_counter() - t0
+
+
+def can_clone(fibers):
+    """Whether started fibers can be cloned."""
+    g = fibers.Fiber(target=lambda: fibers.current().parent.switch())
+    g.switch()
+    try:
+        g.clone()
+    except fibers.error:
+        return False
+    finally:
+        g.switch()
+    return True
+
+
+def subinterpreters_module():
+    for name in ('_interpreters', '_xxsubinterpreters'):
+        try:
+            return importlib.import_module(name)
+        except ImportError:
+            pass
+    return None
+
+
+def has_io_uring(fibers):
+    try:
+        return fibers.Scheduler(io_uring=True).io_uring
+    except fibers.error:
+        return False
+
+
+def add_cmdline_args(cmd, args):
+    cmd.extend(('--backend', args.backend))
+
+
+def main():
+    runner = pyperf.Runner(add_cmdline_args=add_cmdline_args)
+    runner.argparser.add_argument('--backend', choices=sorted(BACKENDS), default='auto',
+                                  help='fibers implementation to benchmark (default: auto)')
+    args = runner.parse_args()
+
+    fibers = importlib.import_module(BACKENDS[args.backend])
+    runner.metadata['fibers_backend'] = fibers.Fiber.__module__
+
+    runner.bench_time_func('switch', bench_switch, fibers)
+    runner.bench_time_func('switch_call', bench_switch_call, fibers)
+    runner.bench_time_func('switch_value', bench_switch_value, fibers)
+    runner.bench_time_func('construct', bench_construct, fibers)
+    runner.bench_time_func('create_and_switch', bench_create, fibers)
+    runner.bench_time_func('throw', bench_throw, fibers)
+    for depth in PY_DEPTHS:
+        runner.bench_time_func('switch_py_depth_%d' % depth, bench_switch, fibers, py_nest, depth)
+    for depth in C_DEPTHS:
+        runner.bench_time_func('switch_c_depth_%d' % depth, bench_switch, fibers, c_nest, depth)
+    if fibers.Fiber.__module__ == 'fibers._cfibers':
+        # separate stacks only matter where the C stack is copied
+        for depth in C_DEPTHS:
+            runner.bench_time_func('switch_c_depth_%d_separate_stack' % depth, bench_switch, fibers, c_nest, depth,
+                                   SEPARATE_STACK_SIZE)
+    for nthreads in THREADS:
+        runner.bench_time_func('switch_threads_%d' % nthreads, bench_switch_threads, fibers, nthreads)
+    if fibers.Fiber.__module__ == 'fibers._cfibers' and subinterpreters_module():
+        for ninterps in INTERPRETERS:
+            runner.bench_time_func('switch_interpreters_%d' % ninterps, bench_switch_interpreters, fibers, ninterps)
+    for length in PARENT_CHAIN_LENGTHS:
+        runner.bench_time_func('parent_chain_%d' % length, bench_parent_chain, fibers, length)
+    runner.bench_time_func('scheduler_yield_python', bench_scheduler, fibers, PyScheduler)
+    if hasattr(fibers, 'Scheduler'):
+        runner.bench_time_func('scheduler_yield', bench_scheduler, fibers, lambda fibers: fibers.Scheduler())
+        runner.bench_time_func('tasks_spawn', bench_tasks, fibers, False)
+        runner.bench_time_func('tasks_pool', bench_tasks, fibers, True)
+    runner.bench_time_func('generator_python', bench_generator_python, fibers)
+    runner.bench_time_func('generator_genlet', bench_generator_genlet, fibers)
+    if hasattr(fibers, 'Generator'):
+        runner.bench_time_func('generator', bench_generator, fibers)
+    runner.bench_time_func('channel_python', bench_channel_python, fibers)
+    if hasattr(fibers, 'Channel'):
+        runner.bench_time_func('channel_unbuffered', bench_channel, fibers)
+        runner.bench_time_func('channel_buffered_%d' % CHANNEL_CAPACITY, bench_channel, fibers, CHANNEL_CAPACITY)
+        runner.bench_time_func('channel_batched_%d' % CHANNEL_CAPACITY, bench_channel, fibers, CHANNEL_CAPACITY,
+                               True)
+    runner.bench_time_func('backtrack_replay', bench_backtrack, fibers, search_replay)
+    if can_clone(fibers):
+        runner.bench_time_func('backtrack_clone', bench_backtrack, fibers, search_clone)
+    if hasattr(fibers, 'Scheduler') and sys.platform.startswith('linux'):
+        for connections in IO_CONNECTIONS:
+            runner.bench_time_func('io_echo_%d' % connections, bench_io_echo, fibers, connections)
+        for connections in IO_CONNECTIONS:
+            runner.bench_time_func('io_loopback_epoll_%d' % connections, bench_io_loopback, fibers, connections,
+                                   False)
+            if has_io_uring(fibers):
+                runner.bench_time_func('io_loopback_uring_%d' % connections, bench_io_loopback, fibers,
+                                       connections, True)
+
+
+if __name__ == '__main__':
+    main()
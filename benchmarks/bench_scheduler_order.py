@@ -0,0 +1,67 @@
+"""
+Bytes of C stack copied per switch by a Scheduler, in FIFO and stack order.
+
+Runs fibers which yield in a loop from some depth, all on the C stack
+('shared'), or half of them on their own stack ('mixed'), with a Scheduler
+in FIFO order and one with stack_order, and reports the bytes of stack
+saved and restored per switch (when fibers has stats) and the time per
+switch.
+
+    PYTHONPATH=. python benchmarks/bench_scheduler_order.py [--fibers N] [--yields N] [--depth D]
+"""
+
+import argparse
+import time
+
+import fibers
+
+
+def nest(depth, func):
+    # call through C code, so that the C stack grows too
+    if depth == 0:
+        return func()
+    return list(map(nest, [depth - 1], [func]))
+
+
+def copied_bytes():
+    if not hasattr(fibers, 'stats'):
+        return float('nan'), 0
+    stats = fibers.stats()['thread']
+    return stats['saved_bytes'] + stats['restored_bytes'], stats['switches']
+
+
+def run(stack_order, nfibers, yields, depth, mixed):
+    sched = fibers.Scheduler(stack_order=stack_order)
+
+    def worker():
+        for _ in range(yields):
+            sched.yield_()
+    for i in range(nfibers):
+        stack_size = 256 * 1024 if mixed and i % 2 else 0
+        sched.unpark(fibers.Fiber(nest, (depth, worker), stack_size=stack_size))
+    copied, switches = copied_bytes()
+    t0 = time.perf_counter()
+    sched.run()
+    elapsed = time.perf_counter() - t0
+    after, after_switches = copied_bytes()
+    n = after_switches - switches or nfibers * yields
+    return (after - copied) / n, elapsed / n
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--fibers', type=int, default=8)
+    parser.add_argument('--yields', type=int, default=20000)
+    parser.add_argument('--depth', type=int, default=20)
+    args = parser.parse_args()
+
+    print('%-8s %-6s %20s %16s' % ('stacks', 'order', 'copied per switch', 'ns per switch'))
+    for mixed in (False, True):
+        for stack_order in (False, True):
+            copied, per_switch = run(stack_order, args.fibers, args.yields, args.depth, mixed)
+            print('%-8s %-6s %20.1f %16.1f' % ('mixed' if mixed else 'shared', 'stack' if stack_order else 'fifo',
+                                               copied, per_switch * 1e9))
+
+
+if __name__ == '__main__':
+    main()
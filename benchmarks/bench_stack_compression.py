@@ -0,0 +1,80 @@
+"""
+Memory saved by packing the stacks of idle fibers, and what it costs.
+
+Suspends many fibers at the same depth, in the same place, then reports
+the bytes of saved stacks per fiber (including the bases they are packed
+against) before and after fibers.compress_stacks(), the time it took per
+fiber, and the time to resume a fiber with its stack as it was saved and
+packed.
+
+    PYTHONPATH=. python benchmarks/bench_stack_compression.py [--fibers N] [--depth D]
+"""
+
+import argparse
+import time
+
+import fibers
+from fibers import Fiber, current
+
+
+def nest(depth, func):
+    # call through C code, so that the C stack grows too
+    if depth == 0:
+        return func()
+    return list(map(nest, [depth - 1], [func]))
+
+
+def suspend():
+    return current().parent.switch()
+
+
+def start(n, depth):
+    gs = [Fiber(nest, args=(depth, suspend)) for _ in range(n)]
+    for g in gs:
+        g.switch()
+    return gs
+
+
+def resume(gs):
+    t0 = time.perf_counter()
+    for g in gs:
+        g.switch()
+    return (time.perf_counter() - t0) / len(gs)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--fibers', type=int, default=1000)
+    parser.add_argument('--depth', type=int, default=20)
+    args = parser.parse_args()
+    n = args.fibers
+
+    # the pool would keep the freed buffers, don't count them
+    fibers.set_stack_pool_limit(0)
+
+    base = fibers.stack_pool_info()['in_use']
+    gs = start(n, args.depth)
+    saved = fibers.stack_pool_info()['in_use'] - base
+    plain = resume(gs)
+
+    # not packed on the switches which start them, only all at once below
+    fibers.set_stack_compression(60)
+    gs = start(n, args.depth)
+    fibers.set_stack_compression(0.001)
+    time.sleep(0.01)
+    t0 = time.perf_counter()
+    packed = fibers.compress_stacks()
+    pack = (time.perf_counter() - t0) / n
+    packed_saved = fibers.stack_pool_info()['in_use'] - base
+    unpack = resume(gs)
+    fibers.set_stack_compression(0)
+
+    print('%d fibers at depth %d, %d packed' % (n, args.depth, packed))
+    print('%-10s %16s %16s' % ('stacks', 'bytes per fiber', 'us to resume'))
+    print('%-10s %16d %16.2f' % ('saved', saved // n, plain * 1e6))
+    print('%-10s %16d %16.2f' % ('packed', packed_saved // n, unpack * 1e6))
+    print('packing took %.2f us per fiber' % (pack * 1e6))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,95 @@
+"""
+Saving stacks with memcpy() or with non-temporal stores, by stack size.
+
+For each depth, fibers are switched to in turn, and each one is suspended
+at two depths in turn, so that every switch away from it saves its whole
+stack.  The rest of the process reads a working set between switches.
+Reports the bytes saved per switch, the time per round trip and the time
+spent reading the working set, with stacks always copied with memcpy() and
+always with non-temporal stores: where the latter gets faster is a good
+threshold for fibers.set_stack_stream_threshold().  With one fiber, its
+stack is restored right after it was saved, which favours memcpy(); with
+many, their stacks don't all fit in the caches.
+
+    PYTHONPATH=. python benchmarks/bench_stack_copy.py [--loops N] [--fibers N] [--working-set BYTES]
+"""
+
+import argparse
+import sys
+import time
+import zlib
+
+import fibers
+from fibers import Fiber, current
+
+
+def nest(depth, func):
+    # call through C code, so that the C stack grows too
+    if depth == 0:
+        return func()
+    return list(map(nest, [depth - 1], [func]))
+
+
+def loop():
+    main = current().parent
+    while True:
+        main.switch()
+        list(map(main.switch, [None]))
+
+
+def saved_bytes():
+    if not hasattr(fibers, 'stats'):
+        return float('nan')
+    return fibers.stats()['thread']['saved_bytes']
+
+
+def run(loops, nfibers, depth, data):
+    gs = [Fiber(nest, args=(depth, loop)) for _ in range(nfibers)]
+    for g in gs:
+        g.switch()
+    saved = saved_bytes()
+    switches = work = 0.0
+    for i in range(loops):
+        g = gs[i % nfibers]
+        t0 = time.perf_counter()
+        g.switch()
+        t1 = time.perf_counter()
+        zlib.crc32(data)
+        t2 = time.perf_counter()
+        switches += t1 - t0
+        work += t2 - t1
+    saved = saved_bytes() - saved
+    return saved / loops, switches / loops, work / loops
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--loops', type=int, default=2000)
+    parser.add_argument('--fibers', type=int, default=1)
+    parser.add_argument('--working-set', type=int, default=512 * 1024)
+    args = parser.parse_args()
+
+    info = fibers.stack_copy_info()
+    if info['stream_kernel'] is None:
+        sys.exit('no kernel for non-temporal stores on this platform')
+    print('kernel: %s, default threshold: %d' % (info['stream_kernel'], info['stream_threshold']))
+    data = bytes(range(256)) * (args.working_set // 256)
+
+    print('%8s %12s %12s %12s %12s %12s' % ('depth', 'saved bytes', 'memcpy ns', 'stream ns',
+                                            'work us', 'stream work us'))
+    try:
+        for depth in (4, 16, 64, 128, 256, 512):
+            results = []
+            for threshold in (0, 1):
+                fibers.set_stack_stream_threshold(threshold)
+                run(args.loops // 10, args.fibers, depth, data)
+                results.append(run(args.loops, args.fibers, depth, data))
+            (saved, copy, work), (_, stream, stream_work) = results
+            print('%8d %12d %12.0f %12.0f %12.1f %12.1f' % (depth, saved, copy * 1e9, stream * 1e9,
+                                                            work * 1e6, stream_work * 1e6))
+    finally:
+        fibers.set_stack_stream_threshold(info['stream_threshold'])
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,72 @@
+"""
+Allocator calls removed by the pool of saved stack buffers.
+
+Runs the same ping-pong workload with the pool disabled and enabled and
+reports how many times the allocator was called per switch, the bytes of
+stack copied away per switch (when fibers has stats) and the time per
+switch.
+
+    PYTHONPATH=. python benchmarks/bench_stack_pool.py [--switches N] [--depth D]
+"""
+
+import argparse
+import time
+
+import fibers
+from fibers import Fiber, current
+
+
+def nest(depth, func):
+    # call through C code, so that the C stack grows too
+    if depth == 0:
+        return func()
+    return list(map(nest, [depth - 1], [func]))
+
+
+def loop(fiber):
+    while True:
+        fiber.switch()
+
+
+def run(switches, depth):
+    def f():
+        main = current().parent
+        nest(depth, lambda: loop(main))
+
+    g = Fiber(f)
+    g.switch()
+    before = fibers.stack_pool_info()
+    saved = saved_bytes()
+    t0 = time.perf_counter()
+    for _ in range(switches):
+        g.switch()
+    elapsed = time.perf_counter() - t0
+    after = fibers.stack_pool_info()
+    saved = saved_bytes() - saved
+    # each g.switch() is two stack switches: there and back
+    n = switches * 2
+    return (after['misses'] - before['misses']) / n, saved / n, elapsed / n
+
+
+def saved_bytes():
+    if not hasattr(fibers, 'stats'):
+        return float('nan')
+    return fibers.stats()['thread']['saved_bytes']
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--switches', type=int, default=200000)
+    parser.add_argument('--depth', type=int, default=20)
+    args = parser.parse_args()
+
+    limit = fibers.stack_pool_info()['limit']
+    print('%-10s %20s %20s %16s' % ('pool', 'allocs per switch', 'copied per switch', 'ns per switch'))
+    for name, pool_limit in (('disabled', 0), ('enabled', limit)):
+        fibers.set_stack_pool_limit(pool_limit)
+        allocs, copied, per_switch = run(args.switches, args.depth)
+        print('%-10s %20.3f %20.1f %16.1f' % (name, allocs, copied, per_switch * 1e9))
+
+
+if __name__ == '__main__':
+    main()
@@ -2,7 +2,8 @@
 import _continuation
 import threading
 
-__all__ = ['Fiber', 'error', 'current']
+__all__ = ['Fiber', 'error', 'current', 'stack_pool_info', 'set_stack_pool_limit', 'set_stack_budget',
+           'set_stack_compression', 'compress_stacks', 'set_stack_stream_threshold', 'stack_copy_info']
 
 
 _tls = threading.local()
@@ -16,6 +17,45 @@ def current():
         return fiber
 
 
+def stack_pool_info():
+    # stacks are managed by PyPy, there is no pool
+    return {'limit': 0, 'retained': 0, 'hits': 0, 'misses': 0, 'in_use': 0, 'budget': 0, 'kept': 0}
+
+
+def set_stack_pool_limit(limit):
+    if limit < 0:
+        raise ValueError('limit must be a positive number')
+
+
+def set_stack_budget(budget):
+    if budget < 0:
+        raise ValueError('budget must be a positive number')
+
+
+def set_stack_compression(idle):
+    if not idle >= 0:
+        raise ValueError('idle must be a positive number')
+
+
+def compress_stacks():
+    return 0
+
+
+_stream_threshold = 0
+
+
+def set_stack_stream_threshold(threshold):
+    global _stream_threshold
+    if threshold < 0:
+        raise ValueError('threshold must be a positive number')
+    _stream_threshold = threshold
+
+
+def stack_copy_info():
+    # stacks are copied by PyPy
+    return {'stream_kernel': None, 'stream_threshold': _stream_threshold}
+
+
 class error(Exception):
     pass
 
@@ -25,11 +65,26 @@ class Fiber(object):
     _thread_id = None
     _ended = False
 
-    def __init__(self, target=None, args=[], kwargs={}, parent=None):
+    def __init__(self, target=None, args=[], kwargs={}, parent=None, stack_size=0):
+        # continulets don't run on the C stack, so stack_size is only validated
+        if stack_size != 0 and stack_size < 64 * 1024:
+            raise ValueError('stack_size must be 0 or at least 65536')
+
+        self._set_target(target, args, kwargs)
+
+        if parent is None:
+            parent = current()
+        self._thread_id = threading.current_thread().ident
+        if self._thread_id != parent._thread_id:
+            raise error('parent cannot be on a different thread')
+        self.parent = parent
+
+    def _set_target(self, target, args, kwargs):
         def _run(c):
             _tls.current_fiber = self
             try:
-                return target(*args, **kwargs)
+                if target is not None:
+                    return target(*args, **kwargs)
             finally:
                 cont = self._cont
                 self._cont = None
@@ -37,13 +92,7 @@ class Fiber(object):
                 _continuation.permute(cont, self._get_active_parent()._cont)
 
         self._func = _run
-
-        if parent is None:
-            parent = current()
-        self._thread_id = threading.current_thread().ident
-        if self._thread_id != parent._thread_id:
-            raise error('parent cannot be on a different thread')
-        self.parent = parent
+        self._init_args = (target, args, kwargs)
 
     def _get_active_parent(self):
         parent = self.parent
@@ -105,6 +154,32 @@ class Fiber(object):
         finally:
             _tls.current_fiber = curr
 
+    def clone(self):
+        if self is current():
+            raise error('cannot clone the current Fiber')
+        if self.parent is None:
+            raise error('cannot clone a main Fiber')
+        if self._ended:
+            raise error('Fiber has ended')
+        if self._cont is not None:
+            # continulets can't be copied
+            raise error('cloning a started Fiber is not supported on this Python version')
+        target, args, kwargs = self._init_args
+        fiber = Fiber.__new__(type(self))
+        Fiber.__init__(fiber, target, args, kwargs, self.parent)
+        fiber.__dict__.update((k, v) for k, v in self.__dict__.items() if k not in fiber.__dict__)
+        return fiber
+
+    def reset(self, target=None, args=(), kwargs={}):
+        if not self._ended:
+            raise error('Fiber has not ended')
+        if threading.current_thread().ident != self._thread_id:
+            raise error('cannot reset a Fiber on a different thread')
+        if target is not None and not callable(target):
+            raise TypeError('if specified, target must be a callable')
+        self._set_target(target, args, kwargs)
+        self._ended = False
+
     def is_alive(self):
         return (self._cont is not None and self._cont.is_pending()) or \
                (self._cont is None and not self._ended)
@@ -29,8 +29,21 @@ else:
             extra_objects = ['src/switch_x64_msvc.obj']
             os.system('ml64 /nologo /c /Fo src\\switch_x64_msvc.obj src\\switch_x64_msvc.asm')
 
+    define_macros = []
+    if os.environ.get('FIBERS_NO_STATS'):
+        # remove the statistics counters entirely
+        define_macros += [('FIBERS_NO_STATS', None), ('STACKLET_NO_STATS', None)]
+    if os.environ.get('FIBERS_NO_IO_URING'):
+        # only wait for readiness with epoll, on Linux
+        define_macros += [('FIBERS_NO_IO_URING', None)]
+    if os.environ.get('FIBERS_GIL_NOT_USED'):
+        # don't enable the GIL on free-threaded builds, not the default yet
+        define_macros += [('FIBERS_GIL_NOT_USED', None)]
+
     ext_modules  = [Extension('fibers._cfibers',
-                              sources=glob.glob('src/*.c'),
+                              sources=['src/fibers.c', 'src/stacklet.c'],
+                              depends=glob.glob('src/*.[ch]'),
+                              define_macros=define_macros,
                               extra_objects=extra_objects,
                              )]
 
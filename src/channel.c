@@ -0,0 +1,766 @@
+
+/*
+ * Channel: Go style channels for Fibers run by a Scheduler. Blocked Fibers
+ * wait in a queue on the Channel, and when a value is sent to a Fiber which is
+ * waiting to receive it, it's handed over with the switch itself.
+ */
+
+static int
+channel_ring_push(ChannelRing *ring, const ChannelEntry *entry)
+{
+    ChannelEntry *entries;
+    Py_ssize_t i, size;
+
+    if (ring->len == ring->size) {
+        size = ring->size ? ring->size * 2 : 16;
+        entries = PyMem_Malloc(size * sizeof(ChannelEntry));
+        if (!entries) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < ring->len; i++) {
+            entries[i] = ring->entries[(ring->head + i) & (ring->size - 1)];
+        }
+        PyMem_Free(ring->entries);
+        ring->entries = entries;
+        ring->head = 0;
+        ring->size = size;
+    }
+    ring->entries[(ring->head + ring->len) & (ring->size - 1)] = *entry;
+    ring->len++;
+    return 0;
+}
+
+
+static Bool
+channel_ring_pop(ChannelRing *ring, ChannelEntry *entry)
+{
+    if (ring->len == 0) {
+        return False;
+    }
+    *entry = ring->entries[ring->head];
+    ring->head = (ring->head + 1) & (ring->size - 1);
+    ring->len--;
+    return True;
+}
+
+
+static void
+channel_entry_clear(ChannelEntry *entry)
+{
+    Py_XDECREF(entry->value);
+    if (entry->w) {
+        waiter_release(entry->w);
+    }
+}
+
+
+/* Remove the entries of the given waiter, when it's no longer waiting */
+static void
+channel_ring_remove(ChannelRing *ring, FiberWaiter *w)
+{
+    ChannelEntry *entry;
+    Py_ssize_t i, j, mask;
+
+    mask = ring->size - 1;
+    for (i = j = 0; i < ring->len; i++) {
+        entry = &ring->entries[(ring->head + i) & mask];
+        if (entry->w == w) {
+            /* doesn't run any code: the waiter is still referenced by the
+             * current Fiber and the value to send by the caller */
+            channel_entry_clear(entry);
+        } else {
+            if (i != j) {
+                ring->entries[(ring->head + j) & mask] = *entry;
+            }
+            j++;
+        }
+    }
+    ring->len = j;
+}
+
+
+static void
+channel_ring_clear(ChannelRing *ring)
+{
+    ChannelEntry entry;
+
+    while (channel_ring_pop(ring, &entry)) {
+        channel_entry_clear(&entry);
+    }
+}
+
+
+/* Take the first entry of a queue whose Fiber is still waiting */
+static Bool
+channel_pop_waiter(ChannelRing *queue, ChannelEntry *entry)
+{
+    while (channel_ring_pop(queue, entry)) {
+        if (entry->w->status == WAITER_WAITING) {
+            return True;
+        }
+        channel_entry_clear(entry);
+    }
+    return False;
+}
+
+
+static int
+channel_enqueue(ChannelRing *queue, FiberWaiter *w, PyObject *value, Py_ssize_t index)
+{
+    ChannelEntry entry;
+
+    entry.w = w;
+    entry.value = value;
+    entry.index = index;
+    if (channel_ring_push(queue, &entry) < 0) {
+        return -1;
+    }
+    Py_XINCREF(value);
+    w->refs++;
+    return 0;
+}
+
+
+/*
+ * A Channel is used by the Fibers of one thread, the first one to use it: the
+ * waiting Fibers are woken on the Scheduler of that thread.
+ */
+static int
+channel_check_thread(Channel *self)
+{
+    Fiber *current;
+
+    if (!(current = get_current())) {
+        return -1;
+    }
+    if (self->thread_h == NULL) {
+        self->thread_h = current->thread_h;
+    } else if (current->thread_h != self->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot use a Channel on a different thread");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * The operation of a waiting Fiber completed, make it ready to run. With
+ * 'handoff' it's switched to right away when it runs on the same Scheduler as
+ * the current Fiber, which becomes ready instead. Consumes the reference to
+ * the entry.
+ */
+static int
+channel_wake(ChannelEntry *entry, int status, Bool handoff)
+{
+    FiberWaiter *w = entry->w;
+    Fiber *current, *fiber;
+    Scheduler *sched;
+    PyObject *result;
+    int r;
+
+    w->index = entry->index;
+    fiber = w->fiber;
+    sched = fiber->scheduler;
+    if (handoff) {
+        if (!(current = get_current())) {
+            channel_entry_clear(entry);
+            return -1;
+        }
+        ASSERT(current->thread_h == fiber->thread_h);
+        if (current->scheduler == sched && current != sched->hub) {
+            w->status = status;
+            Py_INCREF(fiber);
+            channel_entry_clear(entry);
+            if (!current->ready && scheduler_push(sched, current) < 0) {
+                Py_DECREF(fiber);
+                return -1;
+            }
+            result = scheduler_switch(sched, fiber);
+            if (!result) {
+                return -1;
+            }
+            Py_DECREF(result);
+            return 0;
+        }
+    }
+
+    r = waiter_wake(w, status);
+    channel_entry_clear(entry);
+    return r;
+}
+
+
+/* Returns 1 if the value was sent, 0 if the sender would need to block */
+static int
+channel_send_nowait(Channel *self, PyObject *value)
+{
+    ChannelEntry entry;
+
+    if (channel_check_thread(self) < 0) {
+        return -1;
+    }
+    if (self->closed) {
+        PyErr_SetString(get_state()->ChannelClosed, "send on a closed channel");
+        return -1;
+    }
+
+    if (channel_pop_waiter(&self->recvq, &entry)) {
+        /* a Fiber is waiting to receive, hand the value straight to it. On
+         * buffered channels the sender keeps running, so that it can fill the
+         * buffer instead of switching on every value */
+        Py_INCREF(value);
+        entry.w->value = value;
+        return channel_wake(&entry, WAITER_DONE, self->capacity == 0) < 0 ? -1 : 1;
+    }
+
+    if (self->buffer.len < self->capacity) {
+        entry.w = NULL;
+        entry.value = value;
+        entry.index = 0;
+        if (channel_ring_push(&self->buffer, &entry) < 0) {
+            return -1;
+        }
+        Py_INCREF(value);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int
+channel_send(Channel *self, PyObject *value)
+{
+    FiberWaiter *w;
+    Fiber *current;
+    int r;
+
+    r = channel_send_nowait(self, value);
+    if (r != 0) {
+        return r < 0 ? -1 : 0;
+    }
+
+    if (!(current = scheduler_check_block())) {
+        return -1;
+    }
+    if (!(w = waiter_new(current))) {
+        return -1;
+    }
+    if (channel_enqueue(&self->sendq, w, value, 0) < 0) {
+        waiter_release(w);
+        return -1;
+    }
+
+    r = waiter_block(current, w);
+    if (r < 0) {
+        channel_ring_remove(&self->sendq, w);
+    } else if (w->status == WAITER_CLOSED) {
+        PyErr_SetString(get_state()->ChannelClosed, "send on a closed channel");
+        r = -1;
+    }
+    waiter_release(w);
+    return r;
+}
+
+
+/* Returns 1 if a value was received, 0 if the receiver would need to block */
+static int
+channel_recv_nowait(Channel *self, PyObject **value)
+{
+    ChannelEntry entry;
+
+    if (channel_check_thread(self) < 0) {
+        return -1;
+    }
+    if (channel_ring_pop(&self->buffer, &entry)) {
+        *value = entry.value;
+        /* there's room now for the value of a blocked sender */
+        if (channel_pop_waiter(&self->sendq, &entry)) {
+            ChannelEntry buffered = { NULL, entry.value, 0 };
+            /* can't fail, a slot was just freed */
+            channel_ring_push(&self->buffer, &buffered);
+            entry.value = NULL;
+            if (channel_wake(&entry, WAITER_DONE, False) < 0) {
+                Py_DECREF(*value);
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    if (channel_pop_waiter(&self->sendq, &entry)) {
+        *value = entry.value;
+        entry.value = NULL;
+        if (channel_wake(&entry, WAITER_DONE, False) < 0) {
+            Py_DECREF(*value);
+            return -1;
+        }
+        return 1;
+    }
+
+    if (self->closed) {
+        PyErr_SetString(get_state()->ChannelClosed, "receive on a closed channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static PyObject *
+channel_recv(Channel *self)
+{
+    FiberWaiter *w;
+    Fiber *current;
+    PyObject *value;
+    int r;
+
+    r = channel_recv_nowait(self, &value);
+    if (r != 0) {
+        return r < 0 ? NULL : value;
+    }
+
+    if (!(current = scheduler_check_block())) {
+        return NULL;
+    }
+    if (!(w = waiter_new(current))) {
+        return NULL;
+    }
+    if (channel_enqueue(&self->recvq, w, NULL, 0) < 0) {
+        waiter_release(w);
+        return NULL;
+    }
+
+    value = NULL;
+    if (waiter_block(current, w) < 0) {
+        channel_ring_remove(&self->recvq, w);
+    } else if (w->status == WAITER_CLOSED) {
+        PyErr_SetString(get_state()->ChannelClosed, "receive on a closed channel");
+    } else {
+        value = w->value;
+        w->value = NULL;
+    }
+    waiter_release(w);
+    return value;
+}
+
+
+static PyObject *
+Channel_func_send(Channel *self, PyObject *value)
+{
+    if (channel_send(self, value) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+Channel_func_recv(Channel *self)
+{
+    return channel_recv(self);
+}
+
+
+static PyObject *
+Channel_func_send_many(Channel *self, PyObject *iterable)
+{
+    PyObject *iter, *value;
+
+    iter = PyObject_GetIter(iterable);
+    if (!iter) {
+        return NULL;
+    }
+    while ((value = PyIter_Next(iter))) {
+        if (channel_send(self, value) < 0) {
+            Py_DECREF(value);
+            Py_DECREF(iter);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+Channel_func_recv_many(Channel *self, PyObject *args)
+{
+    PyObject *result, *value;
+    Py_ssize_t n;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "n:recv_many", &n)) {
+        return NULL;
+    }
+    if (n < 1) {
+        PyErr_SetString(PyExc_ValueError, "n must be positive");
+        return NULL;
+    }
+
+    /* block for the first value only */
+    value = channel_recv(self);
+    if (!value) {
+        return NULL;
+    }
+    result = PyList_New(1);
+    if (!result) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    PyList_SET_ITEM(result, 0, value);
+
+    while (PyList_GET_SIZE(result) < n) {
+        r = channel_recv_nowait(self, &value);
+        if (r < 0) {
+            if (!PyErr_ExceptionMatches(get_state()->ChannelClosed)) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            /* the values received so far are returned */
+            PyErr_Clear();
+            break;
+        }
+        if (r == 0) {
+            break;
+        }
+        r = PyList_Append(result, value);
+        Py_DECREF(value);
+        if (r < 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+    return result;
+}
+
+
+static PyObject *
+Channel_func_close(Channel *self)
+{
+    ChannelEntry entry;
+
+    if (channel_check_thread(self) < 0) {
+        return NULL;
+    }
+    if (self->closed) {
+        Py_RETURN_NONE;
+    }
+    self->closed = True;
+
+    /* blocked Fibers get ChannelClosed raised */
+    while (channel_pop_waiter(&self->recvq, &entry)) {
+        if (channel_wake(&entry, WAITER_CLOSED, False) < 0) {
+            return NULL;
+        }
+    }
+    while (channel_pop_waiter(&self->sendq, &entry)) {
+        if (channel_wake(&entry, WAITER_CLOSED, False) < 0) {
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * select([ops]): block until one of the operations can be done, and do it.
+ * Each one is a Channel to receive from or a (Channel, value) tuple to send
+ * to. Returns (index, value), value is None for sends.
+ */
+static PyObject *
+fibers_func_select(PyObject *obj, PyObject *arg)
+{
+    PyObject *ops, *op, *value, *result;
+    PyTypeObject *channel_type;
+    Channel **channels;
+    PyObject **values;
+    FiberWaiter *w;
+    Fiber *current;
+    Py_ssize_t i, n;
+    int r;
+
+    UNUSED_ARG(obj);
+
+    ops = PySequence_Fast(arg, "select() argument must be a sequence");
+    if (!ops) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(ops);
+    if (n == 0) {
+        PyErr_SetString(PyExc_ValueError, "select() needs at least one operation");
+        goto error;
+    }
+
+    channels = PyMem_Malloc(n * sizeof(Channel *));
+    values = PyMem_Malloc(n * sizeof(PyObject *));
+    if (!channels || !values) {
+        PyErr_NoMemory();
+        goto error_free;
+    }
+    channel_type = get_state()->ChannelType;
+    for (i = 0; i < n; i++) {
+        op = PySequence_Fast_GET_ITEM(ops, i);
+        if (PyObject_TypeCheck(op, channel_type)) {
+            channels[i] = (Channel *)op;
+            values[i] = NULL;
+        } else if (PyTuple_Check(op) && PyTuple_GET_SIZE(op) == 2 && PyObject_TypeCheck(PyTuple_GET_ITEM(op, 0), channel_type)) {
+            channels[i] = (Channel *)PyTuple_GET_ITEM(op, 0);
+            values[i] = PyTuple_GET_ITEM(op, 1);
+        } else {
+            PyErr_SetString(PyExc_TypeError, "select() operations must be a Channel or a (Channel, value) tuple");
+            goto error_free;
+        }
+    }
+
+    /* the first operation which can be done without blocking, if any */
+    for (i = 0; i < n; i++) {
+        if (values[i]) {
+            r = channel_send_nowait(channels[i], values[i]);
+            value = Py_None;
+        } else {
+            r = channel_recv_nowait(channels[i], &value);
+        }
+        if (r < 0) {
+            goto error_free;
+        }
+        if (r > 0) {
+            if (values[i]) {
+                Py_INCREF(value);
+            }
+            goto done;
+        }
+    }
+
+    /* wait on all of them */
+    if (!(current = scheduler_check_block())) {
+        goto error_free;
+    }
+    if (!(w = waiter_new(current))) {
+        goto error_free;
+    }
+    for (i = 0; i < n; i++) {
+        if (values[i]) {
+            r = channel_enqueue(&channels[i]->sendq, w, values[i], i);
+        } else {
+            r = channel_enqueue(&channels[i]->recvq, w, NULL, i);
+        }
+        if (r < 0) {
+            break;
+        }
+    }
+    if (r == 0) {
+        r = waiter_block(current, w);
+    }
+    for (i = 0; i < n; i++) {
+        channel_ring_remove(values[i] ? &channels[i]->sendq : &channels[i]->recvq, w);
+    }
+    if (r == 0 && w->status == WAITER_CLOSED) {
+        PyErr_SetString(get_state()->ChannelClosed, values[w->index] ? "send on a closed channel" : "receive on a closed channel");
+        r = -1;
+    }
+    i = w->index;
+    value = w->value ? w->value : Py_None;
+    Py_INCREF(value);
+    waiter_release(w);
+    if (r < 0) {
+        Py_DECREF(value);
+        goto error_free;
+    }
+
+done:
+    result = Py_BuildValue("(nN)", i, value);
+    PyMem_Free(channels);
+    PyMem_Free(values);
+    Py_DECREF(ops);
+    return result;
+
+error_free:
+    PyMem_Free(channels);
+    PyMem_Free(values);
+error:
+    Py_DECREF(ops);
+    return NULL;
+}
+
+
+static PyObject *
+Channel_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"capacity", NULL};
+
+    Channel *self;
+    Py_ssize_t capacity = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:Channel", kwlist, &capacity)) {
+        return NULL;
+    }
+    if (capacity < 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must not be negative");
+        return NULL;
+    }
+
+    self = (Channel *)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    self->weakreflist = NULL;
+    self->capacity = capacity;
+    self->closed = False;
+    self->thread_h = NULL;
+    memset(&self->buffer, 0, sizeof(ChannelRing));
+    memset(&self->recvq, 0, sizeof(ChannelRing));
+    memset(&self->sendq, 0, sizeof(ChannelRing));
+    return (PyObject *)self;
+}
+
+
+static PyObject *
+Channel_tp_iternext(Channel *self)
+{
+    PyObject *value;
+
+    value = channel_recv(self);
+    if (!value && PyErr_ExceptionMatches(get_state()->ChannelClosed)) {
+        /* StopIteration */
+        PyErr_Clear();
+    }
+    return value;
+}
+
+
+static Py_ssize_t
+Channel_sq_length(Channel *self)
+{
+    return self->buffer.len;
+}
+
+
+static int
+channel_ring_traverse(ChannelRing *ring, visitproc visit, void *arg)
+{
+    ChannelEntry *entry;
+    Py_ssize_t i;
+
+    for (i = 0; i < ring->len; i++) {
+        entry = &ring->entries[(ring->head + i) & (ring->size - 1)];
+        Py_VISIT(entry->value);
+    }
+    return 0;
+}
+
+
+static int
+Channel_tp_traverse(Channel *self, visitproc visit, void *arg)
+{
+    int r;
+
+    if ((r = channel_ring_traverse(&self->buffer, visit, arg)) ||
+        (r = channel_ring_traverse(&self->recvq, visit, arg)) ||
+        (r = channel_ring_traverse(&self->sendq, visit, arg))) {
+        return r;
+    }
+    MY_HEAPTYPE_VISIT(self);
+    return 0;
+}
+
+
+static int
+Channel_tp_clear(Channel *self)
+{
+    channel_ring_clear(&self->buffer);
+    channel_ring_clear(&self->recvq);
+    channel_ring_clear(&self->sendq);
+    return 0;
+}
+
+
+static void
+Channel_tp_dealloc(Channel *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject *)self);
+    }
+    Channel_tp_clear(self);
+    PyMem_Free(self->buffer.entries);
+    PyMem_Free(self->recvq.entries);
+    PyMem_Free(self->sendq.entries);
+    tp->tp_free((PyObject *)self);
+    MY_HEAPTYPE_DECREF(tp);
+}
+
+
+static PyObject *
+Channel_capacity_get(Channel *self, void *c)
+{
+    UNUSED_ARG(c);
+
+    return PyLong_FromSsize_t(self->capacity);
+}
+
+
+static PyObject *
+Channel_closed_get(Channel *self, void *c)
+{
+    UNUSED_ARG(c);
+
+    return PyBool_FromLong(self->closed);
+}
+
+
+static PyMethodDef
+Channel_tp_methods[] = {
+    { "send", (PyCFunction)Channel_func_send, METH_O, "Send a value, blocking until it's received or buffered" },
+    { "recv", (PyCFunction)Channel_func_recv, METH_NOARGS, "Receive a value, blocking until there is one" },
+    { "send_many", (PyCFunction)Channel_func_send_many, METH_O, "Send all the values of an iterable" },
+    { "recv_many", (PyCFunction)Channel_func_recv_many, METH_VARARGS, "Receive up to n values, blocking until there is at least one" },
+    { "close", (PyCFunction)Channel_func_close, METH_NOARGS, "Close the channel, no more values can be sent" },
+    { NULL }
+};
+
+
+static PyGetSetDef Channel_tp_getsets[] = {
+    {"capacity", (getter)Channel_capacity_get, NULL, "Number of values which can be buffered", NULL},
+    {"closed", (getter)Channel_closed_get, NULL, "True if the channel was closed", NULL},
+    {NULL}
+};
+
+
+static PyMemberDef Channel_tp_members[] = {
+#if PY_VERSION_HEX >= 0x03090000
+    {"__weaklistoffset__", T_PYSSIZET, offsetof(Channel, weakreflist), READONLY},
+#endif
+    {NULL}
+};
+
+
+static PyType_Slot Channel_tp_slots[] = {
+    {Py_tp_dealloc, Channel_tp_dealloc},
+    {Py_tp_traverse, Channel_tp_traverse},
+    {Py_tp_clear, Channel_tp_clear},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, Channel_tp_iternext},
+    {Py_sq_length, Channel_sq_length},
+    {Py_tp_methods, Channel_tp_methods},
+    {Py_tp_members, Channel_tp_members},
+    {Py_tp_getset, Channel_tp_getsets},
+    {Py_tp_new, Channel_tp_new},
+    {0, NULL},
+};
+
+
+static PyType_Spec Channel_tp_spec = {
+    "fibers._cfibers.Channel",
+    sizeof(Channel),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    Channel_tp_slots
+};
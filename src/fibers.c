@@ -1,18 +1,127 @@
-
 #include <stddef.h>
 #include "fibers.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#ifndef FIBERS_NO_STATS
+#include <pthread.h>
+#endif
+#endif
+
+/* Per-thread cache of the main and current Fibers, valid while 'tstate' (with
+ * the given unique id, as thread states can be reused) of 'interp' is the
+ * active thread state. Both are borrowed references: the main Fiber is owned
+ * by the thread state dictionary and the current one by the main Fiber. The
+ * module state of the interpreter is owned by the interpreter dictionary. */
 typedef struct {
-    Fiber *origin;
-    PyObject *value;
-} FiberGlobalState;
+    PyThreadState *tstate;
+    PyInterpreterState *interp;
+    uint64_t tstate_id;
+    Fiber *main;
+    Fiber *current;
+    FibersState *state;
+} FiberThreadCache;
+
+static THREAD_LOCAL FiberThreadCache _fibers_tls;
+
+#define FIBERS_TLS_VALID(tstate)                                            \
+    (_fibers_tls.tstate == (tstate) && _fibers_tls.tstate_id == (tstate)->id && \
+     _fibers_tls.interp == (tstate)->interp)
+
+/* The switch state of the current thread, the cache must be valid */
+#define FIBERS_SWITCH_STATE (&_fibers_tls.main->ts_state->switch_state)
+
+#ifdef FIBERS_NO_STATS
+#define FIBERS_STAT_INC(field)
+#else
+/* Other threads read the counters of a thread while it runs, see
+ * fibers_func_stats, so they are written and read with relaxed atomics. Only
+ * the thread itself changes them */
+#ifdef _MSC_VER
+#define FIBERS_STAT_LOAD(x)     (*(volatile size_t *)&(x))
+#define FIBERS_STAT_STORE(x, v) (*(volatile size_t *)&(x) = (v))
+#else
+#define FIBERS_STAT_LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define FIBERS_STAT_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#endif
+#define FIBERS_STAT_INC(field) do { \
+        FiberStats *_stats = &_fibers_tls.main->ts_state->stats; \
+        FIBERS_STAT_STORE(_stats->field, _stats->field + 1); \
+    } while (0)
+
+/* All threads with a main Fiber, of all interpreters, and the statistics of
+ * the finished ones. They are protected by a lock which needs no
+ * initialization, as interpreters with their own GIL may load the module at
+ * the same time */
+#ifdef _WIN32
+static SRWLOCK _fibers_threads_lock = SRWLOCK_INIT;
+#define FIBERS_THREADS_LOCK()   AcquireSRWLockExclusive(&_fibers_threads_lock)
+#define FIBERS_THREADS_UNLOCK() ReleaseSRWLockExclusive(&_fibers_threads_lock)
+#else
+static pthread_mutex_t _fibers_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FIBERS_THREADS_LOCK()   pthread_mutex_lock(&_fibers_threads_lock)
+#define FIBERS_THREADS_UNLOCK() pthread_mutex_unlock(&_fibers_threads_lock)
+#endif
+static FiberThreadState *_fibers_threads;
+static FiberStats _fibers_dead_stats;
+static struct stacklet_stats _fibers_dead_stacklet_stats;
+#endif
+
+/* Key of the module in the interpreter dictionary */
+#define FIBERS_MODULE_KEY "fibers._cfibers"
+
+#if PY_VERSION_HEX < 0x03080000
+/* there is no interpreter dictionary, only the first module is used */
+static PyObject *_fibers_module;
+#endif
+
+static void fiber_release_posted(stacklet_thread_handle thread_h);
+
+
+/*
+ * Find the module state of the current interpreter, which is that of the
+ * first module object created in it. Returns NULL if there is none yet.
+ */
+static FibersState *
+fibers_find_state(PyThreadState *tstate)
+{
+    PyObject *module;
+
+#if PY_VERSION_HEX >= 0x03080000
+    PyObject *dict = PyInterpreterState_GetDict(tstate->interp);
+    if (dict == NULL) {
+        return NULL;
+    }
+    module = PyDict_GetItemString(dict, FIBERS_MODULE_KEY);
+#else
+    UNUSED_ARG(tstate);
+    module = _fibers_module;
+#endif
+    return module ? (FibersState *)PyModule_GetState(module) : NULL;
+}
 
-static volatile FiberGlobalState _global_state;
 
-static PyObject* main_fiber_key;
-static PyObject* current_fiber_key;
+/*
+ * Get the module state of the current interpreter
+ */
+static INLINE FibersState *
+get_state(void)
+{
+    PyThreadState *tstate = PyThreadState_Get();
+    FibersState *state;
+
+    if (FIBERS_TLS_VALID(tstate)) {
+        return _fibers_tls.state;
+    }
+    state = fibers_find_state(tstate);
+    ASSERT(state != NULL);
+    return state;
+}
 
-static PyObject* PyExc_FiberError;
+/* Smallest separate stack a Fiber can ask for */
+#define FIBERS_MIN_STACK_SIZE (64 * 1024)
 
 
 /*
@@ -20,11 +129,11 @@ static PyObject* PyExc_FiberError;
  * and it's parent is always NULL.
  */
 static Fiber *
-fiber_create_main(void)
+fiber_create_main(FibersState *state)
 {
     Fiber *t_main;
     PyObject *dict = PyThreadState_GetDict();
-    PyTypeObject *cls = (PyTypeObject *)&FiberType;
+    PyTypeObject *cls = state->FiberType;
 
     ASSERT(dict != NULL);
 
@@ -33,10 +142,35 @@ fiber_create_main(void)
     if (!t_main) {
         return NULL;
     }
+    t_main->ts_state = PyMem_Malloc(sizeof(FiberThreadState));
+    if (!t_main->ts_state) {
+        Py_DECREF(t_main);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(t_main->ts_state, 0, sizeof(FiberThreadState));
+    t_main->thread_h = stacklet_newthread();
+    if (!t_main->thread_h) {
+        PyMem_Free(t_main->ts_state);
+        t_main->ts_state = NULL;
+        Py_DECREF(t_main);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    t_main->ts_state->thread_h = t_main->thread_h;
+    t_main->ts_state->idle.prev = t_main->ts_state->idle.next = &t_main->ts_state->idle;
+#ifndef FIBERS_NO_STATS
+    FIBERS_THREADS_LOCK();
+    t_main->ts_state->next = _fibers_threads;
+    if (_fibers_threads) {
+        _fibers_threads->prev = t_main->ts_state;
+    }
+    _fibers_threads = t_main->ts_state;
+    FIBERS_THREADS_UNLOCK();
+#endif
     Py_INCREF(dict);
     t_main->ts_dict = dict;
     t_main->parent = NULL;
-    t_main->thread_h = stacklet_newthread();
     t_main->stacklet_h = NULL;
     t_main->initialized = True;
     t_main->is_main = True;
@@ -44,17 +178,78 @@ fiber_create_main(void)
 }
 
 
+#ifndef FIBERS_NO_STATS
+static void
+stacklet_stats_add(struct stacklet_stats *a, const struct stacklet_stats *b)
+{
+    a->saved_bytes += b->saved_bytes;
+    a->restored_bytes += b->restored_bytes;
+    a->current_saved += b->current_saved;
+    a->peak_saved = Py_MAX(a->peak_saved, b->peak_saved);
+    a->chain_walks += b->chain_walks;
+    a->chain_steps += b->chain_steps;
+    a->max_chain_steps = Py_MAX(a->max_chain_steps, b->max_chain_steps);
+    a->mallocs += b->mallocs;
+    a->packs += b->packs;
+    a->unpacks += b->unpacks;
+    a->packed_saved += b->packed_saved;
+    a->bases += b->bases;
+    a->base_bytes += b->base_bytes;
+    a->unchanged_bytes += b->unchanged_bytes;
+    a->streamed_bytes += b->streamed_bytes;
+}
+
+
+static void
+fiber_stats_add(FiberStats *a, const FiberStats *b)
+{
+    a->created += FIBERS_STAT_LOAD(b->created);
+    a->finished += FIBERS_STAT_LOAD(b->finished);
+    a->switches += FIBERS_STAT_LOAD(b->switches);
+}
+
+
 /*
- * Get the current Fiber reference on the current thread. The first time this
- * function is called on a given (real) thread, the main Fiber is created.
+ * The thread is finished: remove it from the list of threads and keep its
+ * statistics in the process-wide totals.
+ */
+static void
+fiber_thread_state_unlink(FiberThreadState *state)
+{
+    struct stacklet_stats sstats;
+
+    stacklet_get_stats(state->thread_h, &sstats);
+
+    FIBERS_THREADS_LOCK();
+    stacklet_stats_add(&_fibers_dead_stacklet_stats, &sstats);
+    fiber_stats_add(&_fibers_dead_stats, &state->stats);
+
+    if (state->prev) {
+        state->prev->next = state->next;
+    } else {
+        _fibers_threads = state->next;
+    }
+    if (state->next) {
+        state->next->prev = state->prev;
+    }
+    FIBERS_THREADS_UNLOCK();
+}
+#endif
+
+
+/*
+ * Find the main Fiber in the thread state dictionary, creating it if needed,
+ * and fill the per-thread cache.
  */
 static Fiber *
-get_current(void)
+get_current_slow(PyThreadState *tstate)
 {
-    Fiber *current;
+    Fiber *main;
+    FibersState *state;
     PyObject *tstate_dict;
 
-    /* get current Fiber from the active thread-state */
+    state = fibers_find_state(tstate);
+    ASSERT(state != NULL);
     tstate_dict = PyThreadState_GetDict();
     if (tstate_dict == NULL) {
         if (!PyErr_Occurred()) {
@@ -62,30 +257,67 @@ get_current(void)
         }
         return NULL;
     }
-    current = (Fiber *)PyDict_GetItem(tstate_dict, current_fiber_key);
-    if (current == NULL) {
-        current = fiber_create_main();
-        if (current == NULL) {
+    main = (Fiber *)PyDict_GetItem(tstate_dict, state->main_fiber_key);
+    if (main == NULL) {
+        main = fiber_create_main(state);
+        if (main == NULL) {
             return NULL;
         }
         /* Keep a reference to the main fiber in the thread dict. The main
          * fiber is special because we don't require the user to keep a
          * reference to it. It should be deleted when the thread exits. */
-        if (PyDict_SetItem(tstate_dict, main_fiber_key, (PyObject *) current) < 0) {
-            Py_DECREF(current);
-            return NULL;
-        }
-        /* current starts out as main */
-        if (PyDict_SetItem(tstate_dict, current_fiber_key, (PyObject *) current) < 0) {
-            Py_DECREF(current);
+        if (PyDict_SetItem(tstate_dict, state->main_fiber_key, (PyObject *) main) < 0) {
+            Py_DECREF(main);
             return NULL;
         }
-        /* return a borrowed ref. refcount should be 2 after this */
-        Py_DECREF(current);
+        /* keep a borrowed ref. refcount should be 1 after this */
+        Py_DECREF(main);
     }
 
-    ASSERT(current != NULL);
-    return current;
+    _fibers_tls.tstate = tstate;
+    _fibers_tls.interp = tstate->interp;
+    _fibers_tls.tstate_id = tstate->id;
+    _fibers_tls.main = main;
+    _fibers_tls.current = main->ts_current ? main->ts_current : main;
+    _fibers_tls.state = state;
+    return _fibers_tls.current;
+}
+
+
+/*
+ * Get the current Fiber reference on the current thread. The first time this
+ * function is called on a given (real) thread, the main Fiber is created.
+ */
+static INLINE Fiber *
+get_current(void)
+{
+    PyThreadState *tstate = PyThreadState_Get();
+
+    if (FIBERS_TLS_VALID(tstate)) {
+        return _fibers_tls.current;
+    }
+    return get_current_slow(tstate);
+}
+
+
+/*
+ * Make the given Fiber the current one on the current thread. The previous
+ * current Fiber may be deallocated.
+ */
+static INLINE void
+set_current(Fiber *fiber)
+{
+    Fiber *main = _fibers_tls.main;
+    Fiber *old = main->ts_current;
+
+    if (fiber == main) {
+        main->ts_current = NULL;
+    } else {
+        Py_INCREF(fiber);
+        main->ts_current = fiber;
+    }
+    _fibers_tls.current = fiber;
+    Py_XDECREF(old);
 }
 
 
@@ -107,104 +339,976 @@ fibers_func_current(PyObject *obj)
 }
 
 
-static int
-Fiber_tp_init(Fiber *self, PyObject *args, PyObject *kwargs)
+/* Seconds from a monotonic clock */
+static double
+fibers_now(void)
 {
-    static char *kwlist[] = {"target", "args", "kwargs", "parent", NULL};
+#ifdef _WIN32
+    return GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
 
-    PyObject *target, *t_args, *t_kwargs;
-    Fiber *current, *parent;
-    target = t_args = t_kwargs = NULL;
-    parent = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
 
-    if (self->initialized) {
-        PyErr_SetString(PyExc_RuntimeError, "object was already initialized");
-        return -1;
-    }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO!:__init__", kwlist, &target, &t_args, &t_kwargs, &FiberType, &parent)) {
-        return -1;
-    }
+/*
+ * When saved stacks are packed (see set_stack_compression), the suspended
+ * Fibers of a thread are kept in a list, least recently suspended first, so
+ * that the ones which stayed suspended long enough are found without looking
+ * at the others
+ */
+#define FIBER_FROM_IDLE(link) ((Fiber *)((char *)(link) - offsetof(Fiber, idle)))
 
-    if (!(current = get_current())) {
-        return -1;
+static INLINE void
+fiber_idle_remove(Fiber *self)
+{
+    self->idle.prev->next = self->idle.next;
+    self->idle.next->prev = self->idle.prev;
+    self->idle.prev = self->idle.next = NULL;
+}
+
+
+static INLINE void
+fiber_idle_add(FiberThreadState *state, Fiber *self, double now)
+{
+    self->suspended_at = now;
+    self->idle.next = &state->idle;
+    self->idle.prev = state->idle.prev;
+    state->idle.prev->next = &self->idle;
+    state->idle.prev = &self->idle;
+}
+
+
+static void
+fiber_idle_clear(FiberThreadState *state)
+{
+    while (state->idle.next != &state->idle) {
+        fiber_idle_remove(FIBER_FROM_IDLE(state->idle.next));
     }
+    stacklet_clear_bases(state->thread_h);
+}
 
-    if (parent) {
-        /* check if parent is on the same (real) thread */
-        if (parent->ts_dict != current->ts_dict) {
-            PyErr_SetString(PyExc_FiberError, "parent cannot be on a different thread");
-            return -1;
+
+/*
+ * Pack the saved stacks of up to 'max' Fibers (or all of them if 0) which were
+ * suspended at least 'idle' seconds ago, returns how many were packed
+ */
+static Py_ssize_t
+fibers_pack_idle(FiberThreadState *state, double now, double idle, Py_ssize_t max)
+{
+    Fiber *fiber;
+    stacklet_handle h;
+    Py_ssize_t tried = 0, packed = 0;
+
+    while (state->idle.next != &state->idle && (max == 0 || tried < max)) {
+        fiber = FIBER_FROM_IDLE(state->idle.next);
+        if (now - fiber->suspended_at < idle) {
+            break;
         }
-        if (parent->stacklet_h == EMPTY_STACKLET_HANDLE) {
-            PyErr_SetString(PyExc_ValueError, "parent must not have ended");
-            return -1;
+        fiber_idle_remove(fiber);
+        tried++;
+#ifdef FIBERS_CLONE
+        /* the frames of clones are found through their C stack */
+        if (fiber->shared) {
+            continue;
+        }
+#endif
+        if ((h = stacklet_pack(fiber->stacklet_h))) {
+            fiber->stacklet_h = h;
+            packed++;
         }
-    } else {
-        parent = current;
     }
+    return packed;
+}
 
-    if (target) {
-        if (!PyCallable_Check(target)) {
-            PyErr_SetString(PyExc_TypeError, "if specified, target must be a callable");
-            return -1;
+
+/* Keep the list of suspended Fibers after a switch from 'origin' */
+static INLINE void
+fibers_idle_switched(Fiber *origin, Fiber *current)
+{
+    FiberThreadState *state = _fibers_tls.main->ts_state;
+    double now;
+
+    if (current->idle.next) {
+        fiber_idle_remove(current);
+    }
+    if (state->compress_idle > 0) {
+        now = fibers_now();
+        if (origin->stacklet_h != EMPTY_STACKLET_HANDLE) {
+            fiber_idle_add(state, origin, now);
         }
-        if (t_args) {
-            if (!PyTuple_Check(t_args)) {
-                PyErr_SetString(PyExc_TypeError, "args must be a tuple");
-                return -1;
-            }
+        /* one at a time, so that no switch gets much slower */
+        fibers_pack_idle(state, now, state->compress_idle, 1);
+    }
+}
+
+
+#ifndef FIBERS_NO_STATS
+static PyObject *
+fibers_stats_as_dict(const FiberStats *stats, const struct stacklet_stats *sstats)
+{
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "created", (Py_ssize_t)stats->created,
+                         "finished", (Py_ssize_t)stats->finished,
+                         "switches", (Py_ssize_t)stats->switches,
+                         "saved_bytes", (Py_ssize_t)sstats->saved_bytes,
+                         "unchanged_bytes", (Py_ssize_t)sstats->unchanged_bytes,
+                         "streamed_bytes", (Py_ssize_t)sstats->streamed_bytes,
+                         "restored_bytes", (Py_ssize_t)sstats->restored_bytes,
+                         "saved_stack_bytes", (Py_ssize_t)sstats->current_saved,
+                         "peak_saved_stack_bytes", (Py_ssize_t)sstats->peak_saved,
+                         "chain_walks", (Py_ssize_t)sstats->chain_walks,
+                         "chain_steps", (Py_ssize_t)sstats->chain_steps,
+                         "max_chain_steps", (Py_ssize_t)sstats->max_chain_steps,
+                         "mallocs", (Py_ssize_t)sstats->mallocs,
+                         "packed_stacks", (Py_ssize_t)sstats->packs,
+                         "unpacked_stacks", (Py_ssize_t)sstats->unpacks,
+                         "packed_saved_bytes", (Py_ssize_t)sstats->packed_saved,
+                         "stack_bases", (Py_ssize_t)sstats->bases,
+                         "stack_base_bytes", (Py_ssize_t)sstats->base_bytes);
+}
+
+
+/*
+ * Get statistics for the current thread and for the whole process
+ */
+static PyObject *
+fibers_func_stats(PyObject *obj)
+{
+    FiberThreadState *state;
+    FiberStats process_stats;
+    struct stacklet_stats sstats, process_sstats;
+    PyObject *thread_dict, *process_dict, *result;
+
+    UNUSED_ARG(obj);
+
+    if (!get_current()) {
+        return NULL;
+    }
+
+    /* the counters of other threads may be changing while they are read, if
+     * they run without the GIL */
+    FIBERS_THREADS_LOCK();
+    process_stats = _fibers_dead_stats;
+    process_sstats = _fibers_dead_stacklet_stats;
+    for (state = _fibers_threads; state != NULL; state = state->next) {
+        stacklet_get_stats(state->thread_h, &sstats);
+        stacklet_stats_add(&process_sstats, &sstats);
+        fiber_stats_add(&process_stats, &state->stats);
+    }
+    FIBERS_THREADS_UNLOCK();
+
+    state = _fibers_tls.main->ts_state;
+    stacklet_get_stats(state->thread_h, &sstats);
+    thread_dict = fibers_stats_as_dict(&state->stats, &sstats);
+    if (thread_dict == NULL) {
+        return NULL;
+    }
+    process_dict = fibers_stats_as_dict(&process_stats, &process_sstats);
+    if (process_dict == NULL) {
+        Py_DECREF(thread_dict);
+        return NULL;
+    }
+    result = Py_BuildValue("{s:O,s:O}", "thread", thread_dict, "process", process_dict);
+    Py_DECREF(thread_dict);
+    Py_DECREF(process_dict);
+    return result;
+}
+
+
+/*
+ * Get the histogram of the C stack high-water marks of the Fibers which
+ * finished in the current thread, as (limit, count) tuples
+ */
+static PyObject *
+fibers_func_stack_histogram(PyObject *obj)
+{
+    FiberThreadState *state;
+    PyObject *result, *item;
+    size_t limit = 1024;
+    int i;
+
+    UNUSED_ARG(obj);
+
+    if (!get_current()) {
+        return NULL;
+    }
+
+    state = _fibers_tls.main->ts_state;
+    if (!(result = PyList_New(FIBERS_STACK_HISTOGRAM_SIZE))) {
+        return NULL;
+    }
+    for (i = 0; i < FIBERS_STACK_HISTOGRAM_SIZE; i++) {
+        if (i < FIBERS_STACK_HISTOGRAM_SIZE - 1) {
+            item = Py_BuildValue("(nn)", (Py_ssize_t)limit, (Py_ssize_t)state->stack_histogram[i]);
         } else {
-            t_args = PyTuple_New(0);
+            item = Py_BuildValue("(On)", Py_None, (Py_ssize_t)state->stack_histogram[i]);
+        }
+        if (!item) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
+        limit <<= 1;
+    }
+    return result;
+}
+#endif
+
+
+/*
+ * Get information about the pool of saved stack buffers of the current thread
+ */
+static PyObject *
+fibers_func_stack_pool_info(PyObject *obj)
+{
+    Fiber *current;
+    struct stacklet_pool_info info;
+
+    UNUSED_ARG(obj);
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+    stacklet_get_pool_info(current->thread_h, &info);
+#if PY_MINOR_VERSION >= 11
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:i}",
+                         "limit", (Py_ssize_t)info.limit,
+                         "retained", (Py_ssize_t)info.retained,
+                         "hits", (Py_ssize_t)info.hits,
+                         "misses", (Py_ssize_t)info.misses,
+                         "in_use", (Py_ssize_t)info.in_use,
+                         "budget", (Py_ssize_t)info.budget,
+                         "kept", (Py_ssize_t)info.kept,
+                         "datastack_chunks", _fibers_tls.main->ts_state->nfree_chunks);
+#else
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "limit", (Py_ssize_t)info.limit,
+                         "retained", (Py_ssize_t)info.retained,
+                         "hits", (Py_ssize_t)info.hits,
+                         "misses", (Py_ssize_t)info.misses,
+                         "in_use", (Py_ssize_t)info.in_use,
+                         "budget", (Py_ssize_t)info.budget,
+                         "kept", (Py_ssize_t)info.kept);
+#endif
+}
+
+
+/*
+ * Set the maximum amount of bytes of the saved stacks of the suspended Fibers
+ * of the current thread, 0 for no limit
+ */
+static PyObject *
+fibers_func_set_stack_budget(PyObject *obj, PyObject *args)
+{
+    Fiber *current;
+    Py_ssize_t budget;
+
+    UNUSED_ARG(obj);
+
+    if (!PyArg_ParseTuple(args, "n:set_stack_budget", &budget)) {
+        return NULL;
+    }
+
+    if (budget < 0) {
+        PyErr_SetString(PyExc_ValueError, "budget must be a positive number");
+        return NULL;
+    }
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+    stacklet_set_budget(current->thread_h, (size_t)budget);
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Save stacks of at least this many bytes with non-temporal stores, in all
+ * threads, 0 never to
+ */
+static PyObject *
+fibers_func_set_stack_stream_threshold(PyObject *obj, PyObject *args)
+{
+    Py_ssize_t threshold;
+
+    UNUSED_ARG(obj);
+
+    if (!PyArg_ParseTuple(args, "n:set_stack_stream_threshold", &threshold)) {
+        return NULL;
+    }
+
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be a positive number");
+        return NULL;
+    }
+
+    stacklet_set_stream_threshold((size_t)threshold);
+    Py_RETURN_NONE;
+}
+
+
+/* How stacks are copied */
+static PyObject *
+fibers_func_stack_copy_info(PyObject *obj)
+{
+    const char *kernel = stacklet_stream_kernel();
+
+    UNUSED_ARG(obj);
+
+    return Py_BuildValue("{s:z,s:n}",
+                         "stream_kernel", kernel,
+                         "stream_threshold", (Py_ssize_t)stacklet_get_stream_threshold());
+}
+
+
+/*
+ * Pack the saved stacks of the Fibers of the current thread which stay
+ * suspended for at least the given number of seconds, 0 to stop
+ */
+static PyObject *
+fibers_func_set_stack_compression(PyObject *obj, PyObject *args)
+{
+    FiberThreadState *state;
+    double idle;
+
+    UNUSED_ARG(obj);
+
+    if (!PyArg_ParseTuple(args, "d:set_stack_compression", &idle)) {
+        return NULL;
+    }
+
+    if (!(idle >= 0)) {
+        PyErr_SetString(PyExc_ValueError, "idle must be a positive number");
+        return NULL;
+    }
+
+    if (!get_current()) {
+        return NULL;
+    }
+    state = _fibers_tls.main->ts_state;
+    state->compress_idle = idle;
+    if (idle == 0) {
+        fiber_idle_clear(state);
+    }
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Pack the saved stacks of the Fibers of the current thread which have been
+ * suspended long enough now, instead of on the next switches
+ */
+static PyObject *
+fibers_func_compress_stacks(PyObject *obj)
+{
+    FiberThreadState *state;
+
+    UNUSED_ARG(obj);
+
+    if (!get_current()) {
+        return NULL;
+    }
+    state = _fibers_tls.main->ts_state;
+    if (state->compress_idle == 0) {
+        return PyLong_FromLong(0);
+    }
+    return PyLong_FromSsize_t(fibers_pack_idle(state, fibers_now(), state->compress_idle, 0));
+}
+
+
+/* Saved stacks are allocated with these, so that tracemalloc sees them */
+static void *
+fibers_stack_malloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (p != NULL) {
+        PyTraceMalloc_Track(FIBERS_TRACEMALLOC_DOMAIN, (uintptr_t)p, size);
+    }
+    return p;
+}
+
+
+static void
+fibers_stack_free(void *p)
+{
+    PyTraceMalloc_Untrack(FIBERS_TRACEMALLOC_DOMAIN, (uintptr_t)p);
+    free(p);
+}
+
+
+/*
+ * Set the maximum amount of bytes kept by the pool of saved stack buffers of
+ * the current thread
+ */
+static PyObject *
+fibers_func_set_stack_pool_limit(PyObject *obj, PyObject *args)
+{
+    Fiber *current;
+    Py_ssize_t limit;
+
+    UNUSED_ARG(obj);
+
+    if (!PyArg_ParseTuple(args, "n:set_stack_pool_limit", &limit)) {
+        return NULL;
+    }
+
+    if (limit < 0) {
+        PyErr_SetString(PyExc_ValueError, "limit must be a positive number");
+        return NULL;
+    }
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+    stacklet_set_pool_limit(current->thread_h, (size_t)limit);
+    Py_RETURN_NONE;
+}
+
+
+/* Give the Fiber what it runs when started */
+static int
+fiber_set_target(Fiber *self, PyObject *target, PyObject *t_args, PyObject *t_kwargs)
+{
+    if (target) {
+        if (!PyCallable_Check(target)) {
+            PyErr_SetString(PyExc_TypeError, "if specified, target must be a callable");
+            return -1;
+        }
+        if (t_args) {
+            if (!PyTuple_Check(t_args)) {
+                PyErr_SetString(PyExc_TypeError, "args must be a tuple");
+                return -1;
+            }
+            Py_INCREF(t_args);
+        } else if (!(t_args = PyTuple_New(0))) {
+            return -1;
+        }
+        if (t_kwargs) {
+            if (!PyDict_Check(t_kwargs)) {
+                Py_DECREF(t_args);
+                PyErr_SetString(PyExc_TypeError, "kwargs must be a dict");
+                return -1;
+            }
+        }
+    } else {
+        Py_XINCREF(t_args);
+    }
+
+    Py_XINCREF(target);
+    Py_XINCREF(t_kwargs);
+    self->target = target;
+    self->args = t_args;
+    self->kwargs = t_kwargs;
+    return 0;
+}
+
+
+static int
+fiber_new_stack(Fiber *self, Py_ssize_t stack_size)
+{
+#ifdef _WIN32
+    PyErr_SetString(get_state()->FiberError, "stack_size is not supported on this platform");
+    return -1;
+#else
+    self->stack_h = stacklet_newstack((size_t)stack_size);
+    if (self->stack_h == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->stack_size = stack_size;
+    return 0;
+#endif
+}
+
+
+/*
+ * Initialize a Fiber with already parsed arguments. The default parent is
+ * the current Fiber.
+ */
+static int
+fiber_init(Fiber *self, PyObject *target, PyObject *t_args, PyObject *t_kwargs, Fiber *parent, Py_ssize_t stack_size)
+{
+    Fiber *current;
+
+    if (stack_size != 0 && stack_size < FIBERS_MIN_STACK_SIZE) {
+        PyErr_Format(PyExc_ValueError, "stack_size must be 0 or at least %d", FIBERS_MIN_STACK_SIZE);
+        return -1;
+    }
+
+    if (!(current = get_current())) {
+        return -1;
+    }
+
+    if (parent) {
+        /* check if parent is on the same (real) thread */
+        if (parent->ts_dict != current->ts_dict) {
+            PyErr_SetString(get_state()->FiberError, "parent cannot be on a different thread");
+            return -1;
+        }
+        if (parent->stacklet_h == EMPTY_STACKLET_HANDLE) {
+            PyErr_SetString(PyExc_ValueError, "parent must not have ended");
+            return -1;
+        }
+    } else {
+        parent = current;
+    }
+
+    if (stack_size != 0 && fiber_new_stack(self, stack_size) < 0) {
+        return -1;
+    }
+
+    if (fiber_set_target(self, target, t_args, t_kwargs) < 0) {
+        return -1;
+    }
+    FIBERS_STAT_INC(created);
+
+    Py_INCREF(parent);
+    self->parent = parent;
+    self->thread_h = parent->thread_h;
+    self->ts_dict = parent->ts_dict;
+    Py_INCREF(self->ts_dict);
+
+    self->initialized = True;
+    return 0;
+}
+
+
+/*
+ * Create a new Fiber, as Fiber(target, args, kwargs) would.
+ */
+static Fiber *
+fiber_new(PyObject *target, PyObject *t_args, PyObject *t_kwargs)
+{
+    PyTypeObject *cls = get_state()->FiberType;
+    Fiber *fiber;
+
+    fiber = (Fiber *)cls->tp_new(cls, NULL, NULL);
+    if (!fiber) {
+        return NULL;
+    }
+    if (fiber_init(fiber, target, t_args, t_kwargs, NULL, 0) < 0) {
+        Py_DECREF(fiber);
+        return NULL;
+    }
+    return fiber;
+}
+
+
+static int
+Fiber_tp_init(Fiber *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"target", "args", "kwargs", "parent", "stack_size", NULL};
+
+    PyObject *target, *t_args, *t_kwargs;
+    Fiber *parent;
+    Py_ssize_t stack_size;
+    target = t_args = t_kwargs = NULL;
+    parent = NULL;
+    stack_size = 0;
+
+    if (self->initialized) {
+        PyErr_SetString(PyExc_RuntimeError, "object was already initialized");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO!n:__init__", kwlist, &target, &t_args, &t_kwargs, get_state()->FiberType, &parent, &stack_size)) {
+        return -1;
+    }
+
+    return fiber_init(self, target, t_args, t_kwargs, parent, stack_size);
+}
+
+
+
+static PyObject *
+Fiber_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    Fiber *self = (Fiber *)PyType_GenericNew(type, args, kwargs);
+    if (!self) {
+        return NULL;
+    }
+    self->dict = NULL;
+    self->ts_dict = NULL;
+    self->weakreflist = NULL;
+    self->parent = NULL;
+    self->ts_current = NULL;
+    self->ts_state = NULL;
+    self->thread_h = NULL;
+    self->stacklet_h = NULL;
+    self->stack_h = NULL;
+    self->stack_size = 0;
+    self->scheduler = NULL;
+#ifdef FIBERS_CLONE
+    self->shared = NULL;
+    self->chunk_copy = NULL;
+    self->chunk_copy_len = 0;
+#endif
+    self->initialized = False;
+    self->is_main = False;
+    self->ready = False;
+    return (PyObject *)self;
+}
+
+
+#if PY_VERSION_HEX >= 0x03090000
+/*
+ * Fiber(...) and Generator(...) without building an argument tuple and
+ * parsing it with a format string. Calls to subclasses, which could override
+ * __new__ or __init__, don't get here: tp_vectorcall is not inherited.
+ */
+static PyObject *
+Fiber_tp_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    static const char *kwlist[] = {"target", "args", "kwargs", "parent", "stack_size"};
+
+    PyObject *values[5] = {NULL, NULL, NULL, NULL, NULL};
+    PyObject *key;
+    Py_ssize_t nargs, nkw, stack_size, i;
+    PyTypeObject *cls = (PyTypeObject *)type;
+    PyTypeObject *fiber_type = get_state()->FiberType;
+    Fiber *self;
+    int j;
+
+    nargs = PyVectorcall_NARGS(nargsf);
+    nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    if (nargs > 5) {
+        PyErr_Format(PyExc_TypeError, "__init__() takes at most 5 arguments (%zd given)", nargs);
+        return NULL;
+    }
+    for (i = 0; i < nargs; i++) {
+        values[i] = args[i];
+    }
+    for (i = 0; i < nkw; i++) {
+        key = PyTuple_GET_ITEM(kwnames, i);
+        for (j = 0; j < 5 && PyUnicode_CompareWithASCIIString(key, kwlist[j]) != 0; j++);
+        if (j == 5) {
+            PyErr_Format(PyExc_TypeError, "'%U' is an invalid keyword argument for __init__()", key);
+            return NULL;
+        }
+        if (values[j]) {
+            PyErr_Format(PyExc_TypeError, "argument for __init__() given by name ('%s') and position (%d)", kwlist[j], j + 1);
+            return NULL;
+        }
+        values[j] = args[nargs + i];
+    }
+
+    if (values[3] && !PyObject_TypeCheck(values[3], fiber_type)) {
+        PyErr_Format(PyExc_TypeError, "__init__() argument 4 must be %.50s, not %.50s", fiber_type->tp_name, Py_TYPE(values[3])->tp_name);
+        return NULL;
+    }
+    stack_size = 0;
+    if (values[4] && (stack_size = PyNumber_AsSsize_t(values[4], PyExc_OverflowError)) == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    self = (Fiber *)Fiber_tp_new(cls, NULL, NULL);
+    if (!self) {
+        return NULL;
+    }
+    if (fiber_init(self, values[0], values[1], values[2], (Fiber *)values[3], stack_size) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+#endif
+
+
+#if PY_MINOR_VERSION >= 11
+/* Chunks of the size the interpreter allocates first are kept for new
+ * Fibers, up to this many per thread */
+#define FIBERS_CHUNK_SIZE (16 * 1024)
+#define FIBERS_CHUNK_POOL_SIZE 16
+
+/* Data stack chunks come from the arena allocator, like the interpreter's */
+static void
+fiber_chunk_free(_PyStackChunk *chunk)
+{
+    PyObjectArenaAllocator alloc;
+
+    PyObject_GetArenaAllocator(&alloc);
+    alloc.free(alloc.ctx, chunk, chunk->size);
+}
+
+
+/*
+ * Give a new Fiber its first data stack chunk from the pool, if there is one.
+ * Like the interpreter does for the first chunk, the first slot is skipped so
+ * that popping the first frame doesn't free it.
+ */
+static INLINE void
+fiber_datastack_init(FiberThreadState *state, PyThreadState *tstate)
+{
+    _PyStackChunk *chunk = state->free_chunks;
+
+    if (chunk == NULL) {
+        tstate->datastack_chunk = NULL;
+        tstate->datastack_top = NULL;
+        tstate->datastack_limit = NULL;
+        return;
+    }
+    state->free_chunks = chunk->previous;
+    state->nfree_chunks--;
+    chunk->previous = NULL;
+    chunk->top = 0;
+    tstate->datastack_chunk = chunk;
+    tstate->datastack_top = &chunk->data[1];
+    tstate->datastack_limit = (PyObject **)((char *)chunk + chunk->size);
+}
+
+
+/* The Fiber finished, so all frames are gone but its first chunk, which goes
+ * back to the pool */
+static INLINE void
+fiber_datastack_release(FiberThreadState *state, PyThreadState *tstate)
+{
+    _PyStackChunk *chunk = tstate->datastack_chunk;
+
+    tstate->datastack_chunk = NULL;
+    tstate->datastack_top = NULL;
+    tstate->datastack_limit = NULL;
+    if (chunk == NULL) {
+        return;
+    }
+    ASSERT(chunk->previous == NULL);
+    if (chunk->size == FIBERS_CHUNK_SIZE && state->nfree_chunks < FIBERS_CHUNK_POOL_SIZE) {
+        chunk->previous = state->free_chunks;
+        state->free_chunks = chunk;
+        state->nfree_chunks++;
+    } else {
+        fiber_chunk_free(chunk);
+    }
+}
+
+
+static void
+fiber_datastack_clear(FiberThreadState *state)
+{
+    _PyStackChunk *chunk;
+
+    while ((chunk = state->free_chunks) != NULL) {
+        state->free_chunks = chunk->previous;
+        fiber_chunk_free(chunk);
+    }
+    state->nfree_chunks = 0;
+}
+#endif
+
+
+#ifdef FIBERS_CLONE
+/* Where a frame of a suspended Fiber is, given where its copy of the shared
+ * chunk is: frames outside of the chunk are where their address says */
+static INLINE _PyInterpreterFrame *
+fiber_frame_at(FiberSharedChunk *shared, char *image, _PyInterpreterFrame *frame)
+{
+    char *chunk = (char *)shared->chunk;
+
+    if ((char *)frame >= chunk && (char *)frame < chunk + shared->chunk->size) {
+        return (_PyInterpreterFrame *)(image + ((char *)frame - chunk));
+    }
+    return frame;
+}
+
+
+/* The innermost frame of a suspended Fiber, as seen from its C stack */
+static INLINE _PyInterpreterFrame *
+fiber_innermost_frame(Fiber *self)
+{
+    if (self->ts.cframe == NULL) {
+        return NULL;
+    }
+    return *(_PyInterpreterFrame **)_stacklet_translate_pointer(self->stacklet_h, (char **)&self->ts.cframe->current_frame);
+}
+
+
+/* How much of the shared chunk a suspended Fiber uses */
+static INLINE size_t
+fiber_chunk_used(Fiber *self)
+{
+    _PyStackChunk *chunk = self->shared->chunk;
+
+    if (self->ts.datastack_chunk == chunk) {
+        return (char *)self->ts.datastack_top - (char *)chunk;
+    }
+    return chunk->size;
+}
+
+
+/* Where the frames of a suspended Fiber in the shared chunk are now */
+static INLINE char *
+fiber_chunk_image(Fiber *self, size_t *len)
+{
+    if (self->shared->owner == self) {
+        *len = fiber_chunk_used(self);
+        return (char *)self->shared->chunk;
+    }
+    *len = self->chunk_copy_len;
+    return self->chunk_copy;
+}
+
+
+static void
+fiber_memswap(char *a, char *b, size_t len)
+{
+    char tmp[256];
+    size_t n;
+
+    while (len) {
+        n = Py_MIN(len, sizeof(tmp));
+        memcpy(tmp, a, n);
+        memcpy(a, b, n);
+        memcpy(b, tmp, n);
+        a += n;
+        b += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Put the frames of the Fiber about to run in the shared chunk. Copies are
+ * as big as the chunk, so the one of the previous owner can just trade
+ * places with ours and nothing needs to be allocated.
+ */
+static void
+fiber_chunk_acquire(Fiber *self)
+{
+    FiberSharedChunk *shared = self->shared;
+    Fiber *owner = shared->owner;
+    char *copy = self->chunk_copy;
+    size_t owner_len;
+
+    if (owner == self) {
+        return;
+    }
+    if (owner) {
+        owner_len = fiber_chunk_used(owner);
+        fiber_memswap((char *)shared->chunk, copy, Py_MAX(owner_len, self->chunk_copy_len));
+        owner->chunk_copy = copy;
+        owner->chunk_copy_len = owner_len;
+    } else {
+        memcpy(shared->chunk, copy, self->chunk_copy_len);
+        PyMem_Free(copy);
+    }
+    self->chunk_copy = NULL;
+    self->chunk_copy_len = 0;
+    shared->owner = self;
+}
+
+
+/* The Fiber doesn't use the shared chunk anymore. Returns whether clones
+ * still do. */
+static Bool
+fiber_chunk_release(Fiber *self)
+{
+    FiberSharedChunk *shared = self->shared;
+
+    if (shared->owner == self) {
+        shared->owner = NULL;
+    }
+    PyMem_Free(self->chunk_copy);
+    self->chunk_copy = NULL;
+    self->chunk_copy_len = 0;
+    self->shared = NULL;
+    /* the chunk itself is left alone, like the ones of Fibers which were
+     * never cloned */
+    if (--shared->refs == 0) {
+        PyMem_Free(shared);
+        return False;
+    }
+    return True;
+}
+
+
+/*
+ * Drop the references held by the frames of a suspended clone which is
+ * going away. The value stack of the innermost frame is only known if it
+ * called switch() or throw(), and neither are those of frames which called
+ * C code, so only their local variables are released. Frames whose frame
+ * object is referenced elsewhere are left alone.
+ */
+static void
+fiber_frames_clear(Fiber *self)
+{
+    _PyInterpreterFrame *frame, *f;
+    PyFrameObject *frame_obj;
+    PyObject **top;
+    char *image;
+    size_t len;
+    int i, n;
+
+    image = fiber_chunk_image(self, &len);
+    top = self->ts.stack_pointer;
+    frame = fiber_innermost_frame(self);
+    while (frame) {
+        f = fiber_frame_at(self->shared, image, frame);
+        n = f->f_code->co_nlocalsplus;
+        if (top) {
+            n = (int)(top - frame->localsplus);
+            top = NULL;
+        } else if (f->stacktop > n) {
+            n = f->stacktop;
         }
-        if (t_kwargs) {
-            if (!PyDict_Check(t_kwargs)) {
-                PyErr_SetString(PyExc_TypeError, "kwargs must be a dict");
-                return -1;
+        frame = f->previous;
+        if (f->owner != FRAME_OWNED_BY_THREAD) {
+            continue;
+        }
+        frame_obj = f->frame_obj;
+        if (frame_obj) {
+            if (Py_REFCNT(frame_obj) > 1) {
+                continue;
             }
+            f->frame_obj = NULL;
+            frame_obj->f_frame = f;
+            Py_DECREF(frame_obj);
         }
+        for (i = 0; i < n; i++) {
+            Py_CLEAR(f->localsplus[i]);
+        }
+        Py_CLEAR(f->f_locals);
+        Py_CLEAR(f->f_func);
+        Py_CLEAR(f->f_code);
     }
+}
+#endif
 
-    Py_XINCREF(target);
-    Py_XINCREF(t_args);
-    Py_XINCREF(t_kwargs);
-    self->target = target;
-    self->args = t_args;
-    self->kwargs = t_kwargs;
 
-    Py_INCREF(parent);
-    self->parent = parent;
-    self->thread_h = parent->thread_h;
-    self->ts_dict = parent->ts_dict;
-    Py_INCREF(self->ts_dict);
+/* Keep the high-water mark of the C stack of a Fiber which was suspended */
+static inline void
+fiber_note_stack(Fiber *self, stacklet_handle h)
+{
+    size_t extent = stacklet_stack_extent(h);
 
-    self->initialized = True;
-    return 0;
+    if (extent > self->max_stack) {
+        self->max_stack = extent;
+    }
 }
 
 
-static PyObject *
-Fiber_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+#ifndef FIBERS_NO_STATS
+static void
+fiber_stack_histogram_add(FiberThreadState *state, size_t max_stack)
 {
-    Fiber *self = (Fiber *)PyType_GenericNew(type, args, kwargs);
-    if (!self) {
-        return NULL;
+    size_t limit = 1024;
+    int i;
+
+    for (i = 0; i < FIBERS_STACK_HISTOGRAM_SIZE - 1 && max_stack >= limit; i++) {
+        limit <<= 1;
     }
-    self->dict = NULL;
-    self->ts_dict = NULL;
-    self->weakreflist = NULL;
-    self->parent = NULL;
-    self->thread_h = NULL;
-    self->stacklet_h = NULL;
-    self->initialized = False;
-    self->is_main = False;
-    return (PyObject *)self;
+    state->stack_histogram[i]++;
 }
+#endif
 
 
 static stacklet_handle
 stacklet__callback(stacklet_handle h, void *arg)
 {
+    volatile FiberSwitchState *sw;
     Fiber *origin, *self, *target;
     PyObject *result, *value;
     PyThreadState *tstate;
@@ -212,11 +1316,17 @@ stacklet__callback(stacklet_handle h, void *arg)
 
     self = get_current();
     ASSERT(self != NULL);
-    origin = _global_state.origin;
-    value = _global_state.value;
+    sw = FIBERS_SWITCH_STATE;
+    origin = sw->origin;
+    value = sw->value;
 
     /* save the handle to switch back to the fiber that created us */
     origin->stacklet_h = h;
+    fiber_note_stack(origin, h);
+    fibers_idle_switched(origin, self);
+
+    /* our separate stack, if any, is now owned by stacklet */
+    self->stack_h = NULL;
 
     /* set current thread state before starting this new Fiber */
     tstate = PyThreadState_Get();
@@ -224,19 +1334,30 @@ stacklet__callback(stacklet_handle h, void *arg)
     tstate->exc_state.exc_value = NULL;
 #if PY_MINOR_VERSION < 11
     tstate->frame = NULL;
+#if PY_MINOR_VERSION >= 10
+    /* the first frame links to it, not to the C stack of the origin, and
+     * takes whether tracing is on from it */
+    tstate->root_cframe.use_tracing = tstate->cframe->use_tracing;
+    tstate->cframe = &tstate->root_cframe;
+#endif
     tstate->exc_state.exc_type = NULL;
     tstate->exc_state.exc_traceback = NULL;
 #else
-    tstate->datastack_chunk = NULL;
-    tstate->datastack_top = NULL;
-    tstate->datastack_limit = NULL;
+    fiber_datastack_init(_fibers_tls.main->ts_state, tstate);
+#if PY_MINOR_VERSION < 13
     tstate->cframe->current_frame = NULL;
+#else
+    tstate->current_frame = NULL;
+#endif
 #endif
     tstate->exc_state.previous_item = NULL;
 
-    self->ts.frame = NULL;
     self->ts.exc_state.exc_value = NULL;
 #if PY_MINOR_VERSION < 11
+    self->ts.frame = NULL;
+#if PY_MINOR_VERSION >= 10
+    self->ts.cframe = NULL;
+#endif
     self->ts.recursion_depth = tstate->recursion_depth;
     self->ts.exc_state.exc_type = NULL;
     self->ts.exc_state.exc_traceback = NULL;
@@ -247,7 +1368,11 @@ stacklet__callback(stacklet_handle h, void *arg)
     self->ts.recursion_depth = tstate->py_recursion_limit - tstate->py_recursion_remaining;
     self->ts.c_recursion_remaining = tstate->c_recursion_remaining;
 #endif
+#if PY_MINOR_VERSION < 13
     self->ts.cframe = NULL;
+#else
+    self->ts.current_frame = NULL;
+#endif
     self->ts.datastack_chunk = NULL;
     self->ts.datastack_top = NULL;
     self->ts.datastack_limit = NULL;
@@ -265,6 +1390,23 @@ stacklet__callback(stacklet_handle h, void *arg)
         Py_INCREF(Py_None);
     }
 
+    /* a clone of this Fiber may be the one which got here, so only trust
+     * the current Fiber from now on */
+    self = _fibers_tls.current;
+#ifdef FIBERS_CLONE
+    if (self->shared && fiber_chunk_release(self)) {
+        /* the clones which are left keep the chunk */
+        tstate->datastack_chunk = NULL;
+        tstate->datastack_top = NULL;
+        tstate->datastack_limit = NULL;
+    }
+#endif
+
+    FIBERS_STAT_INC(finished);
+#ifndef FIBERS_NO_STATS
+    fiber_stack_histogram_add(_fibers_tls.main->ts_state, self->max_stack);
+#endif
+
     /* cleanup target and arguments */
     Py_XDECREF(self->target);
     Py_XDECREF(self->args);
@@ -273,13 +1415,19 @@ stacklet__callback(stacklet_handle h, void *arg)
     self->args = NULL;
     self->kwargs = NULL;
 
+#if PY_MINOR_VERSION >= 11
+    /* nothing runs on our data stack anymore */
+    fiber_datastack_release(_fibers_tls.main->ts_state, tstate);
+#endif
+
     /* this Fiber has finished, select the parent as the next one to be run  */
     target_h = NULL;
     target = self->parent;
     while(target) {
         if (target->stacklet_h && target->stacklet_h != EMPTY_STACKLET_HANDLE) {
-            _global_state.value = result;
-            _global_state.origin = self;
+            sw->value = result;
+            sw->origin = self;
+            sw->target = target;
             target_h = target->stacklet_h;
             break;
         }
@@ -294,14 +1442,18 @@ stacklet__callback(stacklet_handle h, void *arg)
 static PyObject *
 do_switch(Fiber *self, PyObject *value)
 {
+    volatile FiberSwitchState *sw;
     PyThreadState *tstate;
     stacklet_handle stacklet_h;
+    struct stacklet_pool_info info;
     Fiber *origin, *current;
     PyObject *result;
 
     /* save state */
     current = get_current();
     ASSERT(current != NULL);
+    FIBERS_STAT_INC(switches);
+    fiber_release_posted(current->thread_h);
     tstate = PyThreadState_Get();
     ASSERT(tstate != NULL);
     ASSERT(tstate->dict != NULL);
@@ -309,6 +1461,9 @@ do_switch(Fiber *self, PyObject *value)
 #if PY_MINOR_VERSION < 11
     current->ts.recursion_depth = tstate->recursion_depth;
     current->ts.frame = tstate->frame;
+#if PY_MINOR_VERSION >= 10
+    current->ts.cframe = tstate->cframe;
+#endif
     current->ts.exc_state.exc_type = tstate->exc_state.exc_type;
     current->ts.exc_state.exc_traceback = tstate->exc_state.exc_traceback;
 #else
@@ -318,55 +1473,90 @@ do_switch(Fiber *self, PyObject *value)
     current->ts.recursion_depth = tstate->py_recursion_limit - tstate->py_recursion_remaining;
     current->ts.c_recursion_remaining = tstate->c_recursion_remaining;
 #endif
-    current->ts.frame = PyThreadState_GetFrame(tstate);
-    Py_XDECREF(current->ts.frame);
+    /* the interpreter frames are only referred to by pointers, saving them
+     * needs no frame objects */
+#if PY_MINOR_VERSION < 13
     current->ts.cframe = tstate->cframe;
+#else
+    current->ts.current_frame = tstate->current_frame;
+#endif
     current->ts.datastack_chunk = tstate->datastack_chunk;
     current->ts.datastack_top = tstate->datastack_top;
     current->ts.datastack_limit = tstate->datastack_limit;
 #endif
     current->ts.exc_state.previous_item = tstate->exc_state.previous_item;
+    if (current->ts.recursion_depth > current->max_depth) {
+        current->max_depth = current->ts.recursion_depth;
+    }
     ASSERT(current->stacklet_h == NULL);
 
-    /* _global_state is to pass values across a switch. Its contents are only
-     * valid immediately before and after a switch. For any other purpose, the
-     * current fiber is identified by current_fiber_key in the thread state
-     * dictionary. */
-    _global_state.origin = current;
-    _global_state.value = value;
+    /* the switch state is to pass values across a switch. Its contents are
+     * only valid immediately before and after a switch. For any other purpose,
+     * the current fiber is identified by the per-thread cache (see
+     * get_current). */
+    sw = FIBERS_SWITCH_STATE;
+    sw->origin = current;
+    sw->target = self;
+    sw->value = value;
 
     /* make the target fiber the new current one. */
-    if (PyDict_SetItem(tstate->dict, current_fiber_key, (PyObject *) self) < 0) {
-        return NULL;
-    }
+    set_current(self);
 
     /* switch to existing, or create new fiber */
     if (self->stacklet_h == NULL) {
-        stacklet_h = stacklet_new(self->thread_h, stacklet__callback, NULL);
+        if (self->stack_h != NULL) {
+            stacklet_h = stacklet_new_stack(self->thread_h, self->stack_h, stacklet__callback, NULL);
+        } else {
+            stacklet_h = stacklet_new(self->thread_h, stacklet__callback, NULL);
+        }
     } else {
         stacklet_h = stacklet_switch(self->stacklet_h);
     }
 
+    if (stacklet_h == NULL) {
+        /* there was no memory to save our stack, or not within the budget of
+         * the thread: nothing happened, we are still running and restore our
+         * own state */
+        Py_XDECREF(value);
+        stacklet_get_pool_info(current->thread_h, &info);
+        if (info.budget != 0) {
+            PyErr_SetString(PyExc_MemoryError, "cannot switch: the saved stacks would exceed the stack budget");
+        } else {
+            PyErr_NoMemory();
+        }
+        sw->target = current;
+        sw->value = NULL;
+    }
+
     /* need to store the handle of the stacklet that switched to us, so that
      * later it can be resumed again. (stacklet_h can also be
      * EMPTY_STACKLET_HANDLE in which case the stacklet exited) */
-    ASSERT(stacklet_h != NULL);
-    origin = _global_state.origin;
+    origin = sw->origin;
     origin->stacklet_h = stacklet_h;
+    if (stacklet_h != NULL && stacklet_h != EMPTY_STACKLET_HANDLE) {
+        fiber_note_stack(origin, stacklet_h);
+    }
+    /* the Fiber being resumed may be a clone of the one which was suspended
+     * here, and it's already the current one */
+    current = sw->target;
     current->stacklet_h = NULL;  /* handle is valid only once */
-    result = _global_state.value;
+    result = sw->value;
+    if (stacklet_h != NULL) {
+        fibers_idle_switched(origin, current);
+    }
 
     /* back to the fiber that did the switch. this may drop the refcount on
      * origin to zero. */
-    if (PyDict_SetItem(tstate->dict, current_fiber_key, (PyObject *) current) < 0) {
-        return NULL;
-    }
+    set_current(current);
 
     /* restore state */
     tstate->exc_state.exc_value = current->ts.exc_state.exc_value;
 #if PY_MINOR_VERSION < 11
     tstate->recursion_depth = current->ts.recursion_depth;
     tstate->frame = current->ts.frame;
+#if PY_MINOR_VERSION >= 10
+    tstate->cframe = current->ts.cframe;
+#endif
     tstate->exc_state.exc_type = current->ts.exc_state.exc_type;
     tstate->exc_state.exc_traceback = current->ts.exc_state.exc_traceback;
 #else
@@ -376,143 +1566,524 @@ do_switch(Fiber *self, PyObject *value)
     tstate->py_recursion_remaining = tstate->py_recursion_limit - current->ts.recursion_depth;
     tstate->c_recursion_remaining = current->ts.c_recursion_remaining;
 #endif
+#if PY_MINOR_VERSION < 13
     tstate->cframe = current->ts.cframe;
+#else
+    tstate->current_frame = current->ts.current_frame;
+#endif
     tstate->datastack_chunk = current->ts.datastack_chunk;
     tstate->datastack_top = current->ts.datastack_top;
     tstate->datastack_limit = current->ts.datastack_limit;
 #endif
     tstate->exc_state.previous_item = current->ts.exc_state.previous_item;
 
-    current->ts.frame = NULL;
     current->ts.exc_state.exc_value = NULL;
 #if PY_MINOR_VERSION < 11
+    current->ts.frame = NULL;
+#if PY_MINOR_VERSION >= 10
+    current->ts.cframe = NULL;
+#endif
     current->ts.exc_state.exc_type = NULL;
     current->ts.exc_state.exc_traceback = NULL;
 #else
+#if PY_MINOR_VERSION < 13
     current->ts.cframe = NULL;
+#else
+    current->ts.current_frame = NULL;
+#endif
     current->ts.datastack_chunk = NULL;
     current->ts.datastack_top = NULL;
     current->ts.datastack_limit = NULL;
 #endif
     current->ts.exc_state.previous_item = NULL;
+#ifdef FIBERS_CLONE
+    current->ts.stack_pointer = NULL;
+    if (current->shared) {
+        fiber_chunk_acquire(current);
+    }
+#endif
+
+    return result;
+}
+
+
+/* Remember where the value stack of the calling frame ends, in case this
+ * Fiber is cloned while suspended: when called from Python code the
+ * arguments are the topmost items of that stack */
+#ifdef FIBERS_CLONE
+#define FIBER_SAVE_STACK_POINTER(fiber, args, nargs)                        \
+    do {                                                                    \
+        (fiber)->ts.stack_pointer = PyThreadState_GET()->cframe->use_tracing \
+                                    ? NULL : (PyObject **)(args) + (nargs); \
+    } while(0)
+#else
+#define FIBER_SAVE_STACK_POINTER(fiber, args, nargs)
+#endif
+
+
+static PyObject *
+Fiber_func_switch(Fiber *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    Fiber *current;
+    PyObject *value = Py_None;
+
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError, "switch expected at most 1 argument, got %zd", nargs);
+        return NULL;
+    }
+    if (nargs == 1) {
+        value = args[0];
+    }
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+
+    /* the state of a Fiber on a different thread may be changing, without
+     * the GIL */
+    if (self->thread_h != current->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot switch to a Fiber on a different thread");
+        return NULL;
+    }
+
+    if (self == current) {
+        PyErr_SetString(get_state()->FiberError, "cannot switch from a Fiber to itself");
+        return NULL;
+    }
+
+    if (self->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        PyErr_SetString(get_state()->FiberError, "Fiber has ended");
+        return NULL;
+    }
+
+    if (self->stacklet_h == NULL && value != Py_None) {
+        PyErr_SetString(PyExc_ValueError, "cannot specify a value when the Fiber wasn't started");
+        return NULL;
+    }
+    Py_INCREF(value);
+
+    FIBER_SAVE_STACK_POINTER(current, args, nargs);
+    return do_switch(self, value);
+}
+
+
+static PyObject *
+Fiber_func_throw(Fiber *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    Fiber *current;
+    PyObject *typ, *val, *tb;
+
+    val = tb = NULL;
+
+    if (nargs < 1 || nargs > 3) {
+        PyErr_Format(PyExc_TypeError, "throw expected from 1 to 3 arguments, got %zd", nargs);
+        return NULL;
+    }
+    typ = args[0];
+    if (nargs > 1) {
+        val = args[1];
+    }
+    if (nargs > 2) {
+        tb = args[2];
+    }
+
+    /* First, check the traceback argument, replacing None, with NULL */
+    if (tb == Py_None) {
+        tb = NULL;
+    } else if (tb != NULL && !PyTraceBack_Check(tb)) {
+	PyErr_SetString(PyExc_TypeError, "throw() third argument must be a traceback object");
+	return NULL;
+    }
+
+    Py_INCREF(typ);
+    Py_XINCREF(val);
+    Py_XINCREF(tb);
+
+    if (PyExceptionClass_Check(typ)) {
+        PyErr_NormalizeException(&typ, &val, &tb);
+    } else if (PyExceptionInstance_Check(typ)) {
+        /* Raising an instance. The value should be a dummy. */
+        if (val && val != Py_None) {
+	    PyErr_SetString(PyExc_TypeError, "instance exceptions cannot have a separate value");
+	    goto error;
+	} else {
+	    /* Normalize to raise <class>, <instance> */
+	    Py_XDECREF(val);
+            val = typ;
+            typ = PyExceptionInstance_Class(typ);
+	    Py_INCREF(typ);
+	}
+    } else {
+	/* Not something you can raise. throw() fails. */
+        PyErr_Format(PyExc_TypeError, "exceptions must be classes, or instances, not %s", Py_TYPE(typ)->tp_name);
+	goto error;
+    }
+
+    if (!(current = get_current())) {
+        goto error;
+    }
+
+    if (self->thread_h != current->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot switch to a Fiber on a different thread");
+        goto error;
+    }
+
+    if (self == current) {
+        PyErr_SetString(get_state()->FiberError, "cannot throw from a Fiber to itself");
+        goto error;
+    }
+
+    if (self->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        PyErr_SetString(get_state()->FiberError, "Fiber has ended");
+        goto error;
+    }
+
+    /* set error and do a switch with NULL as the value */
+    PyErr_Restore(typ, val, tb);
+
+    FIBER_SAVE_STACK_POINTER(current, args, nargs);
+    return do_switch(self, NULL);
+
+error:
+    /* Didn't use our arguments, so restore their original refcounts */
+    Py_DECREF(typ);
+    Py_XDECREF(val);
+    Py_XDECREF(tb);
+    return NULL;
+}
+
+
+#ifdef FIBERS_CLONE
+/*
+ * Check that the frames of a suspended Fiber can be copied, returning the
+ * innermost one. Only the references held by the interpreter frames are
+ * known, so there must be no C code in between them, nor in between the
+ * target and the start of the Fiber, which could hold references of its
+ * own or pointers to memory owned by the Fiber.
+ */
+static _PyInterpreterFrame *
+fiber_clone_check(Fiber *self)
+{
+    _PyInterpreterFrame *innermost, *frame, *f;
+    FiberSharedChunk tmp, *shared;
+    PyObject **stackbase;
+    char *image, *chunk;
+    size_t len;
+    int entries;
+
+    if (self->ts.stack_pointer == NULL) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber which isn't suspended in switch() or throw() called from Python code");
+        return NULL;
+    }
+    if (!PyFunction_Check(self->target)) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber whose target isn't a Python function");
+        return NULL;
+    }
+    if (self->kwargs && PyDict_GET_SIZE(self->kwargs) != 0) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber started with keyword arguments");
+        return NULL;
+    }
+    if (stacklet_on_separate_stack(self->stacklet_h)) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber running on a separate stack");
+        return NULL;
+    }
+
+    shared = self->shared;
+    if (shared == NULL) {
+        tmp.chunk = self->ts.datastack_chunk;
+        tmp.owner = self;
+        shared = &tmp;
+    }
+    if (self->ts.datastack_chunk != shared->chunk || shared->chunk->previous != NULL) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber whose frames don't fit in one data stack chunk");
+        return NULL;
+    }
+    chunk = (char *)shared->chunk;
+    image = shared == &tmp ? chunk : fiber_chunk_image(self, &len);
+
+    innermost = fiber_innermost_frame(self);
+    entries = 0;
+    for (frame = innermost; frame != NULL; frame = f->previous) {
+        if ((char *)frame < chunk || (char *)frame >= chunk + shared->chunk->size) {
+            PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber suspended in a generator or coroutine");
+            return NULL;
+        }
+        f = fiber_frame_at(shared, image, frame);
+        if (f->owner != FRAME_OWNED_BY_THREAD) {
+            PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber suspended in a generator or coroutine");
+            return NULL;
+        }
+        entries += f->is_entry;
+        if (frame == innermost) {
+            stackbase = frame->localsplus + f->f_code->co_nlocalsplus;
+            if (self->ts.stack_pointer < stackbase || self->ts.stack_pointer > stackbase + f->f_code->co_stacksize) {
+                PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber which isn't suspended in switch() or throw() called from Python code");
+                return NULL;
+            }
+        }
+    }
+    if (entries != 1) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber suspended in Python code called from C code");
+        return NULL;
+    }
+    return innermost;
+}
+
+
+/* Replace an iterator over a builtin sequence with a copy of it */
+static int
+fiber_copy_iterator(PyObject **item)
+{
+    FibersState *state = get_state();
+    PyObject *obj = *item, *module;
+    PyTypeObject *type;
+
+    if (obj == NULL) {
+        return 0;
+    }
+    type = Py_TYPE(obj);
+    if (type != &PyRangeIter_Type && type != &PyLongRangeIter_Type && type != &PyListIter_Type &&
+        type != &PyListRevIter_Type && type != &PyTupleIter_Type) {
+        return 0;
+    }
+    if (state->copy_func == NULL) {
+        if (!(module = PyImport_ImportModule("copy"))) {
+            return -1;
+        }
+        state->copy_func = PyObject_GetAttrString(module, "copy");
+        Py_DECREF(module);
+        if (state->copy_func == NULL) {
+            return -1;
+        }
+    }
+    if (!(*item = PyObject_CallOneArg(state->copy_func, obj))) {
+        *item = obj;
+        return -1;
+    }
+    Py_DECREF(obj);
+    return 0;
+}
+
+
+/*
+ * Give the clone its own copy of the frames and of the C stack. The frames
+ * stay at the same addresses, the shared chunk holds the ones of the Fiber
+ * which runs or ran last.
+ */
+static int
+fiber_clone_frames(Fiber *self, Fiber *clone, _PyInterpreterFrame *innermost)
+{
+    FiberSharedChunk *shared;
+    _PyInterpreterFrame *frame, *f;
+    char *image, *copy;
+    size_t len;
+    int i, n;
+
+    shared = self->shared;
+    if (shared == NULL) {
+        shared = PyMem_Malloc(sizeof(FiberSharedChunk));
+        if (shared == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        shared->chunk = self->ts.datastack_chunk;
+        shared->owner = self;
+        shared->refs = 1;
+    }
+    copy = PyMem_Malloc(shared->chunk->size);
+    if (copy == NULL || !(clone->stacklet_h = stacklet_clone(self->stacklet_h))) {
+        PyMem_Free(copy);
+        if (shared != self->shared) {
+            PyMem_Free(shared);
+        }
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->shared = shared;
+    image = fiber_chunk_image(self, &len);
+    memcpy(copy, image, len);
+    shared->refs++;
+    clone->shared = shared;
+    clone->chunk_copy = copy;
+    clone->chunk_copy_len = len;
+
+    clone->ts = self->ts;
+    Py_XINCREF(clone->ts.exc_state.exc_value);
+
+    /* the copied frames hold references of their own */
+    for (frame = innermost; frame != NULL; frame = f->previous) {
+        f = fiber_frame_at(shared, copy, frame);
+        if (frame == innermost) {
+            n = (int)(self->ts.stack_pointer - frame->localsplus);
+        } else {
+            n = f->stacktop;
+        }
+        for (i = 0; i < n; i++) {
+            Py_XINCREF(f->localsplus[i]);
+        }
+        Py_XINCREF(f->f_locals);
+        Py_INCREF(f->f_func);
+        Py_INCREF(f->f_code);
+        f->frame_obj = NULL;
+    }
 
-    return result;
+    /* for loops over builtin sequences go on independently: their
+     * iterators are on the value stack, where nothing else can see them */
+    for (frame = innermost; frame != NULL; frame = f->previous) {
+        f = fiber_frame_at(shared, copy, frame);
+        n = frame == innermost ? (int)(self->ts.stack_pointer - frame->localsplus) : f->stacktop;
+        for (i = f->f_code->co_nlocalsplus; i < n; i++) {
+            if (fiber_copy_iterator(&f->localsplus[i]) < 0) {
+                /* the clone is complete, deallocating it cleans up */
+                return -1;
+            }
+        }
+    }
+    return 0;
 }
+#endif
 
 
+/*
+ * Clone a Fiber which is suspended or wasn't started yet. The clone gets the
+ * same target, arguments and parent and, if started, a copy of the C stack
+ * and the Python frames of the Fiber, from where it continues on its own
+ * when switched to. The objects those frames refer to are not copied.
+ */
 static PyObject *
-Fiber_func_switch(Fiber *self, PyObject *args)
+Fiber_func_clone(Fiber *self)
 {
-    Fiber *current;
-    PyObject *value = Py_None;
+    Fiber *current, *clone;
+#ifdef FIBERS_CLONE
+    _PyInterpreterFrame *innermost = NULL;
+#endif
 
-    if (!PyArg_ParseTuple(args, "|O:switch", &value)) {
+    if (!(current = get_current())) {
         return NULL;
     }
 
-    if (!(current = get_current())) {
+    if (self == current) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone the current Fiber");
         return NULL;
     }
 
-    if (self == current) {
-        PyErr_SetString(PyExc_FiberError, "cannot switch from a Fiber to itself");
+    if (self->is_main) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a main Fiber");
         return NULL;
     }
 
     if (self->stacklet_h == EMPTY_STACKLET_HANDLE) {
-        PyErr_SetString(PyExc_FiberError, "Fiber has ended");
+        PyErr_SetString(get_state()->FiberError, "Fiber has ended");
         return NULL;
     }
 
     if (self->thread_h != current->thread_h) {
-        PyErr_SetString(PyExc_FiberError, "cannot switch to a Fiber on a different thread");
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber on a different thread");
         return NULL;
     }
 
-    if (self->stacklet_h == NULL && value != Py_None) {
-        PyErr_SetString(PyExc_ValueError, "cannot specify a value when the Fiber wasn't started");
+    if (self->stack_h != NULL) {
+        PyErr_SetString(get_state()->FiberError, "cannot clone a Fiber running on a separate stack");
         return NULL;
     }
-    Py_INCREF(value);
 
-    return do_switch(self, value);
+    if (self->stacklet_h != NULL) {
+#ifdef FIBERS_CLONE
+        /* the frames are found through the saved stack, as it is */
+        if (stacklet_is_packed(self->stacklet_h)) {
+            stacklet_handle h = stacklet_unpack(self->stacklet_h);
+            if (h == NULL) {
+                return PyErr_NoMemory();
+            }
+            self->stacklet_h = h;
+        }
+        if (!(innermost = fiber_clone_check(self))) {
+            return NULL;
+        }
+#else
+        PyErr_SetString(get_state()->FiberError, "cloning a started Fiber is not supported on this Python version");
+        return NULL;
+#endif
+    }
+
+    clone = (Fiber *)Fiber_tp_new(Py_TYPE(self), NULL, NULL);
+    if (!clone) {
+        return NULL;
+    }
+    if (self->dict && !(clone->dict = PyDict_Copy(self->dict))) {
+        Py_DECREF(clone);
+        return NULL;
+    }
+#ifdef FIBERS_CLONE
+    if (innermost && fiber_clone_frames(self, clone, innermost) < 0) {
+        Py_DECREF(clone);
+        return NULL;
+    }
+#endif
+    Py_XINCREF(self->target);
+    Py_XINCREF(self->args);
+    Py_XINCREF(self->kwargs);
+    clone->target = self->target;
+    clone->args = self->args;
+    clone->kwargs = self->kwargs;
+    Py_INCREF(self->parent);
+    clone->parent = self->parent;
+    clone->thread_h = self->thread_h;
+    clone->ts_dict = self->ts_dict;
+    Py_INCREF(clone->ts_dict);
+    clone->max_stack = self->max_stack;
+    clone->max_depth = self->max_depth;
+    clone->initialized = True;
+    FIBERS_STAT_INC(created);
+    return (PyObject *)clone;
 }
 
 
+/*
+ * Bind a Fiber which has ended to a new target, so that it can be switched
+ * to again. It keeps its parent, its attributes, the Scheduler which runs it
+ * and the size of its separate stack, if it had one.
+ */
 static PyObject *
-Fiber_func_throw(Fiber *self, PyObject *args)
+Fiber_func_reset(Fiber *self, PyObject *args, PyObject *kwargs)
 {
-    Fiber *current;
-    PyObject *typ, *val, *tb;
-
-    val = tb = NULL;
-
-    if (!PyArg_ParseTuple(args, "O|OO:throw", &typ, &val, &tb)) {
-	return NULL;
-    }
-
-    /* First, check the traceback argument, replacing None, with NULL */
-    if (tb == Py_None) {
-        tb = NULL;
-    } else if (tb != NULL && !PyTraceBack_Check(tb)) {
-	PyErr_SetString(PyExc_TypeError, "throw() third argument must be a traceback object");
-	return NULL;
-    }
+    static char *kwlist[] = {"target", "args", "kwargs", NULL};
 
-    Py_INCREF(typ);
-    Py_XINCREF(val);
-    Py_XINCREF(tb);
+    PyObject *target, *t_args, *t_kwargs;
+    Fiber *current;
+    target = t_args = t_kwargs = NULL;
 
-    if (PyExceptionClass_Check(typ)) {
-        PyErr_NormalizeException(&typ, &val, &tb);
-    } else if (PyExceptionInstance_Check(typ)) {
-        /* Raising an instance. The value should be a dummy. */
-        if (val && val != Py_None) {
-	    PyErr_SetString(PyExc_TypeError, "instance exceptions cannot have a separate value");
-	    goto error;
-	} else {
-	    /* Normalize to raise <class>, <instance> */
-	    Py_XDECREF(val);
-            val = typ;
-            typ = PyExceptionInstance_Class(typ);
-	    Py_INCREF(typ);
-	}
-    } else {
-	/* Not something you can raise. throw() fails. */
-        PyErr_Format(PyExc_TypeError, "exceptions must be classes, or instances, not %s", Py_TYPE(typ)->tp_name);
-	goto error;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOO:reset", kwlist, &target, &t_args, &t_kwargs)) {
+        return NULL;
     }
 
     if (!(current = get_current())) {
-        goto error;
-    }
-
-    if (self == current) {
-        PyErr_SetString(PyExc_FiberError, "cannot throw from a Fiber to itself");
-        goto error;
+        return NULL;
     }
 
-    if (self->stacklet_h == EMPTY_STACKLET_HANDLE) {
-        PyErr_SetString(PyExc_FiberError, "Fiber has ended");
-        goto error;
+    if (self->stacklet_h != EMPTY_STACKLET_HANDLE) {
+        PyErr_SetString(get_state()->FiberError, "Fiber has not ended");
+        return NULL;
     }
 
     if (self->thread_h != current->thread_h) {
-        PyErr_SetString(PyExc_FiberError, "cannot switch to a Fiber on a different thread");
+        PyErr_SetString(get_state()->FiberError, "cannot reset a Fiber on a different thread");
         return NULL;
     }
 
-    /* set error and do a switch with NULL as the value */
-    PyErr_Restore(typ, val, tb);
-
-    return do_switch(self, NULL);
-
-error:
-    /* Didn't use our arguments, so restore their original refcounts */
-    Py_DECREF(typ);
-    Py_XDECREF(val);
-    Py_XDECREF(tb);
-    return NULL;
+    /* the separate stack was released when the Fiber ended */
+    if (self->stack_size != 0 && self->stack_h == NULL && fiber_new_stack(self, self->stack_size) < 0) {
+        return NULL;
+    }
+    ASSERT(self->target == NULL);
+    if (fiber_set_target(self, target, t_args, t_kwargs) < 0) {
+        return NULL;
+    }
+    self->stacklet_h = NULL;
+    self->max_stack = 0;
+    self->max_depth = 0;
+    FIBERS_STAT_INC(created);
+    Py_RETURN_NONE;
 }
 
 
@@ -530,6 +2101,44 @@ Fiber_func_is_alive(Fiber *self)
 }
 
 
+/*
+ * The size of the Fiber including the memory only it uses: its saved C stack,
+ * its separate stack, its Python data stack while suspended and the copy of
+ * the frames of a clone
+ */
+static PyObject *
+Fiber_func_sizeof(Fiber *self)
+{
+    size_t size = Py_TYPE(self)->tp_basicsize;
+#if PY_MINOR_VERSION >= 11
+    _PyStackChunk *chunk;
+#endif
+
+    if (self->stacklet_h != NULL && self->stacklet_h != EMPTY_STACKLET_HANDLE) {
+        size += stacklet_buffer_size(self->stacklet_h);
+    }
+    if (self->stack_size != 0 && self->stacklet_h != EMPTY_STACKLET_HANDLE) {
+        size += self->stack_size;
+    }
+#if PY_MINOR_VERSION >= 11
+    if (!self->is_main) {
+#ifdef FIBERS_CLONE
+        if (self->chunk_copy) {
+            size += self->shared->chunk->size;
+        }
+        chunk = (self->shared && self->shared->owner != self) ? NULL : self->ts.datastack_chunk;
+#else
+        chunk = self->ts.datastack_chunk;
+#endif
+        for (; chunk != NULL; chunk = chunk->previous) {
+            size += chunk->size;
+        }
+    }
+#endif
+    return PyLong_FromSize_t(size);
+}
+
+
 static PyObject *
 Fiber_func_getstate(Fiber *self)
 {
@@ -592,6 +2201,17 @@ Fiber_parent_get(Fiber *self, void* c)
 }
 
 
+static PyObject *
+Fiber_stack_stats_get(Fiber *self, void* c)
+{
+    UNUSED_ARG(c);
+
+    return Py_BuildValue("{s:n,s:i}",
+                         "max_stack_bytes", (Py_ssize_t)self->max_stack,
+                         "max_recursion_depth", self->max_depth);
+}
+
+
 static int
 Fiber_parent_set(Fiber *self, PyObject *val, void* c)
 {
@@ -603,7 +2223,7 @@ Fiber_parent_set(Fiber *self, PyObject *val, void* c)
         return -1;
     }
 
-    if (!PyObject_TypeCheck(val, &FiberType)) {
+    if (!PyObject_TypeCheck(val, get_state()->FiberType)) {
         PyErr_SetString(PyExc_TypeError, "parent must be a Fiber");
         return -1;
     }
@@ -644,13 +2264,16 @@ Fiber_tp_traverse(Fiber *self, visitproc visit, void *arg)
     Py_VISIT(self->dict);
     Py_VISIT(self->ts_dict);
     Py_VISIT(self->parent);
-    Py_VISIT(self->ts.frame);
+    Py_VISIT(self->ts_current);
+    Py_VISIT(self->scheduler);
     Py_VISIT(self->ts.exc_state.exc_value);
 #if PY_MINOR_VERSION < 11
+    Py_VISIT(self->ts.frame);
     Py_VISIT(self->ts.exc_state.exc_type);
     Py_VISIT(self->ts.exc_state.exc_traceback);
 #endif
     Py_VISIT(self->ts.exc_state.previous_item);
+    MY_HEAPTYPE_VISIT(self);
 
     return 0;
 }
@@ -665,9 +2288,11 @@ Fiber_tp_clear(Fiber *self)
     Py_CLEAR(self->dict);
     Py_CLEAR(self->ts_dict);
     Py_CLEAR(self->parent);
-    Py_CLEAR(self->ts.frame);
+    Py_CLEAR(self->ts_current);
+    Py_CLEAR(self->scheduler);
     Py_CLEAR(self->ts.exc_state.exc_value);
 #if PY_MINOR_VERSION < 11
+    Py_CLEAR(self->ts.frame);
     Py_CLEAR(self->ts.exc_state.exc_type);
     Py_CLEAR(self->ts.exc_state.exc_traceback);
 #endif
@@ -677,22 +2302,94 @@ Fiber_tp_clear(Fiber *self)
 }
 
 
+/*
+ * Release the Fiber. Its stacklet and its place in the lists of its thread
+ * are only touched by that thread, or once it has finished.
+ */
 static void
-Fiber_tp_dealloc(Fiber *self)
+fiber_release(Fiber *self)
 {
+    PyTypeObject *tp = Py_TYPE(self);
+
+#ifdef FIBERS_CLONE
+    if (self->shared) {
+        fiber_frames_clear(self);
+        fiber_chunk_release(self);
+    }
+#endif
+    if (self->idle.next) {
+        fiber_idle_remove(self);
+    }
     if (self->stacklet_h != NULL && self->stacklet_h != EMPTY_STACKLET_HANDLE) {
         stacklet_destroy(self->stacklet_h);
         self->stacklet_h = NULL;
     }
+    if (self->stack_h != NULL) {
+        stacklet_deletestack(self->stack_h);
+        self->stack_h = NULL;
+    }
     if (self->is_main) {
+        fiber_idle_clear(self->ts_state);
+        /* Fibers dropped by other threads from now on are released there */
+        stacklet_closethread(self->thread_h);
+        fiber_release_posted(self->thread_h);
+#ifndef FIBERS_NO_STATS
+        fiber_thread_state_unlink(self->ts_state);
+#endif
+#if PY_MINOR_VERSION >= 11
+        fiber_datastack_clear(self->ts_state);
+#endif
         stacklet_deletethread(self->thread_h);
         self->thread_h = NULL;
+        PyMem_Free(self->ts_state);
+        self->ts_state = NULL;
+        if (_fibers_tls.main == self) {
+            memset(&_fibers_tls, 0, sizeof(_fibers_tls));
+        }
     }
     if (self->weakreflist != NULL) {
         PyObject_ClearWeakRefs((PyObject *)self);
     }
     Py_TYPE(self)->tp_clear((PyObject *)self);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    tp->tp_free((PyObject *)self);
+    MY_HEAPTYPE_DECREF(tp);
+}
+
+
+/*
+ * Release the suspended Fibers which other threads dropped, see
+ * Fiber_tp_dealloc. Called by the thread which owns them.
+ */
+static void
+fiber_release_posted(stacklet_thread_handle thread_h)
+{
+    void **link;
+
+    while ((link = stacklet_take_posted(thread_h)) != NULL) {
+        fiber_release((Fiber *)((char *)link - offsetof(Fiber, posted)));
+    }
+}
+
+
+static void
+Fiber_tp_dealloc(Fiber *self)
+{
+    PyObject_GC_UnTrack(self);
+
+    /* Without the GIL another thread may drop a suspended Fiber: its Python
+     * references are cleared here, and its thread releases the rest the next
+     * time it switches. If that thread is finishing, nothing needs it */
+    if (self->stacklet_h != NULL && self->stacklet_h != EMPTY_STACKLET_HANDLE &&
+            (_fibers_tls.main == NULL || _fibers_tls.main->thread_h != self->thread_h)) {
+        if (self->weakreflist != NULL) {
+            PyObject_ClearWeakRefs((PyObject *)self);
+        }
+        Py_TYPE(self)->tp_clear((PyObject *)self);
+        if (stacklet_post(self->thread_h, &self->posted)) {
+            return;
+        }
+    }
+    fiber_release(self);
 }
 
 
@@ -700,9 +2397,12 @@ static PyMethodDef
 Fiber_tp_methods[] = {
     { "current", (PyCFunction)fibers_func_current, METH_CLASS|METH_NOARGS, "Returns the current Fiber" },
     { "is_alive", (PyCFunction)Fiber_func_is_alive, METH_NOARGS, "Returns true if the Fiber can still be switched to" },
-    { "switch", (PyCFunction)Fiber_func_switch, METH_VARARGS, "Switch execution to this Fiber" },
-    { "throw", (PyCFunction)Fiber_func_throw, METH_VARARGS, "Switch execution and raise the specified exception to this Fiber" },
+    { "reset", (PyCFunction)Fiber_func_reset, METH_VARARGS|METH_KEYWORDS, "Make a Fiber which has ended run the given target when switched to" },
+    { "switch", (PyCFunction)Fiber_func_switch, METH_FASTCALL, "Switch execution to this Fiber" },
+    { "throw", (PyCFunction)Fiber_func_throw, METH_FASTCALL, "Switch execution and raise the specified exception to this Fiber" },
+    { "clone", (PyCFunction)Fiber_func_clone, METH_NOARGS, "Return a copy of this Fiber, which must be suspended or not started yet" },
     { "__getstate__", (PyCFunction)Fiber_func_getstate, METH_NOARGS, "Serialize the Fiber object, not really" },
+    { "__sizeof__", (PyCFunction)Fiber_func_sizeof, METH_NOARGS, "Size of the Fiber in memory, in bytes, including its saved stack" },
     { NULL }
 };
 
@@ -710,65 +2410,239 @@ Fiber_tp_methods[] = {
 static PyGetSetDef Fiber_tp_getsets[] = {
     {"__dict__", (getter)Fiber_dict_get, (setter)Fiber_dict_set, "Instance dictionary", NULL},
     {"parent", (getter)Fiber_parent_get, (setter)Fiber_parent_set, "Fiber parent or None if it's the main Fiber", NULL},
+    {"stack_stats", (getter)Fiber_stack_stats_get, NULL, "High-water marks of the C stack and of the Python recursion depth", NULL},
+    {NULL}
+};
+
+
+static PyMemberDef Fiber_tp_members[] = {
+#if PY_VERSION_HEX >= 0x03090000
+    {"__dictoffset__", T_PYSSIZET, offsetof(Fiber, dict), READONLY},
+    {"__weaklistoffset__", T_PYSSIZET, offsetof(Fiber, weakreflist), READONLY},
+#endif
     {NULL}
 };
 
 
-static PyTypeObject FiberType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "fibers._cfibers.Fiber",                                        /*tp_name*/
-    sizeof(Fiber),                                                  /*tp_basicsize*/
-    0,                                                              /*tp_itemsize*/
-    (destructor)Fiber_tp_dealloc,                                   /*tp_dealloc*/
-    0,                                                              /*tp_print*/
-    0,                                                              /*tp_getattr*/
-    0,                                                              /*tp_setattr*/
-    0,                                                              /*tp_compare*/
-    0,                                                              /*tp_repr*/
-    0,                                                              /*tp_as_number*/
-    0,                                                              /*tp_as_sequence*/
-    0,                                                              /*tp_as_mapping*/
-    0,                                                              /*tp_hash */
-    0,                                                              /*tp_call*/
-    0,                                                              /*tp_str*/
-    0,                                                              /*tp_getattro*/
-    0,                                                              /*tp_setattro*/
-    0,                                                              /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,  /*tp_flags*/
-    0,                                                              /*tp_doc*/
-    (traverseproc)Fiber_tp_traverse,                                /*tp_traverse*/
-    (inquiry)Fiber_tp_clear,                                        /*tp_clear*/
-    0,                                                              /*tp_richcompare*/
-    offsetof(Fiber, weakreflist),                                   /*tp_weaklistoffset*/
-    0,                                                              /*tp_iter*/
-    0,                                                              /*tp_iternext*/
-    Fiber_tp_methods,                                               /*tp_methods*/
-    0,                                                              /*tp_members*/
-    Fiber_tp_getsets,                                               /*tp_getsets*/
-    0,                                                              /*tp_base*/
-    0,                                                              /*tp_dict*/
-    0,                                                              /*tp_descr_get*/
-    0,                                                              /*tp_descr_set*/
-    offsetof(Fiber, dict),                                          /*tp_dictoffset*/
-    (initproc)Fiber_tp_init,                                        /*tp_init*/
-    0,                                                              /*tp_alloc*/
-    Fiber_tp_new,                                                   /*tp_new*/
+static PyType_Slot Fiber_tp_slots[] = {
+    {Py_tp_dealloc, Fiber_tp_dealloc},
+    {Py_tp_traverse, Fiber_tp_traverse},
+    {Py_tp_clear, Fiber_tp_clear},
+    {Py_tp_methods, Fiber_tp_methods},
+    {Py_tp_members, Fiber_tp_members},
+    {Py_tp_getset, Fiber_tp_getsets},
+    {Py_tp_init, Fiber_tp_init},
+    {Py_tp_new, Fiber_tp_new},
+    {0, NULL}
+};
+
+
+static PyType_Spec Fiber_tp_spec = {
+    "fibers._cfibers.Fiber",
+    sizeof(Fiber),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    Fiber_tp_slots
 };
 
 
+#include "uring.c"
+#include "scheduler.c"
+#include "channel.c"
+#include "pool.c"
+#include "generator.c"
+
+
 static PyMethodDef
 fibers_methods[] = {
     { "current", (PyCFunction)fibers_func_current, METH_NOARGS, "Get the current Fiber" },
+#ifndef FIBERS_NO_STATS
+    { "stats", (PyCFunction)fibers_func_stats, METH_NOARGS, "Get statistics for the current thread and for the whole process" },
+    { "stack_histogram", (PyCFunction)fibers_func_stack_histogram, METH_NOARGS, "Get the histogram of the C stack high-water marks of the Fibers which finished in the current thread" },
+#endif
+    { "yield_", (PyCFunction)fibers_func_yield, METH_FASTCALL, "Switch from the current Generator, or a Fiber it started, to its caller with the given value" },
+    { "select", (PyCFunction)fibers_func_select, METH_O, "Wait until one of the given Channel operations can be done, and do it" },
+    { "set_stack_budget", (PyCFunction)fibers_func_set_stack_budget, METH_VARARGS, "Set the maximum amount of bytes of the saved stacks of the suspended Fibers of the current thread" },
+    { "set_stack_stream_threshold", (PyCFunction)fibers_func_set_stack_stream_threshold, METH_VARARGS, "Save stacks of at least the given amount of bytes with non-temporal stores, 0 never to" },
+    { "stack_copy_info", (PyCFunction)fibers_func_stack_copy_info, METH_NOARGS, "Get the kernel and the threshold for saving stacks with non-temporal stores" },
+    { "set_stack_compression", (PyCFunction)fibers_func_set_stack_compression, METH_VARARGS, "Pack the saved stacks of the Fibers of the current thread which stay suspended for at least the given number of seconds" },
+    { "compress_stacks", (PyCFunction)fibers_func_compress_stacks, METH_NOARGS, "Pack the saved stacks of the Fibers of the current thread which have been suspended long enough" },
+    { "stack_pool_info", (PyCFunction)fibers_func_stack_pool_info, METH_NOARGS, "Get information about the pool of saved stack buffers of the current thread" },
+    { "set_stack_pool_limit", (PyCFunction)fibers_func_set_stack_pool_limit, METH_VARARGS, "Set the maximum amount of bytes kept by the pool of saved stack buffers of the current thread" },
     { NULL }
 };
 
 
+/*
+ * Fill the module state. All the module objects of an interpreter share the
+ * types and exceptions of the first one, as with single-phase initialization,
+ * so that Fibers created through any of them work together.
+ */
+static int
+fibers_exec(PyObject *fibers)
+{
+    FibersState *state = (FibersState *)PyModule_GetState(fibers);
+    FibersState *first = fibers_find_state(PyThreadState_Get());
+
+    if (first) {
+        *state = *first;
+        Py_INCREF(state->FiberType);
+        Py_INCREF(state->SchedulerType);
+        Py_INCREF(state->ChannelType);
+        Py_INCREF(state->FiberPoolType);
+        Py_INCREF(state->GeneratorType);
+        Py_INCREF(state->FiberError);
+        Py_INCREF(state->ChannelClosed);
+        Py_INCREF(state->main_fiber_key);
+#ifdef FIBERS_CLONE
+        Py_XINCREF(state->copy_func);
+#endif
+    } else {
+        /* the same for all interpreters, and before any stack is saved */
+        stacklet_set_allocator(fibers_stack_malloc, fibers_stack_free);
+
+        /* key for per-thread dictionary */
+        state->main_fiber_key = PyUnicode_InternFromString("__fibers_main");
+        if (state->main_fiber_key == NULL) {
+            return -1;
+        }
+
+        /* Exceptions */
+        state->FiberError = PyErr_NewException("fibers._cfibers.error", NULL, NULL);
+        state->ChannelClosed = PyErr_NewException("fibers._cfibers.ChannelClosed", NULL, NULL);
+        if (!state->FiberError || !state->ChannelClosed) {
+            return -1;
+        }
+
+        /* Types */
+        state->FiberType = MyPyType_FromSpec(&Fiber_tp_spec, offsetof(Fiber, dict), offsetof(Fiber, weakreflist));
+        state->SchedulerType = MyPyType_FromSpec(&Scheduler_tp_spec, 0, offsetof(Scheduler, weakreflist));
+        state->ChannelType = MyPyType_FromSpec(&Channel_tp_spec, 0, offsetof(Channel, weakreflist));
+        state->FiberPoolType = MyPyType_FromSpec(&FiberPool_tp_spec, 0, offsetof(FiberPool, weakreflist));
+        if (!state->FiberType || !state->SchedulerType || !state->ChannelType || !state->FiberPoolType) {
+            return -1;
+        }
+        state->GeneratorType = MyPyType_FromSpecWithBase(&Generator_tp_spec, state->FiberType,
+                                                          offsetof(Fiber, dict), offsetof(Fiber, weakreflist));
+        if (!state->GeneratorType) {
+            return -1;
+        }
+#if PY_VERSION_HEX >= 0x03090000
+        state->FiberType->tp_vectorcall = Fiber_tp_vectorcall;
+        state->GeneratorType->tp_vectorcall = Fiber_tp_vectorcall;
+#endif
+    }
+
+    if (MyPyModule_AddType(fibers, "error", (PyTypeObject *)state->FiberError) ||
+        MyPyModule_AddType(fibers, "ChannelClosed", (PyTypeObject *)state->ChannelClosed) ||
+        MyPyModule_AddType(fibers, "Fiber", state->FiberType) ||
+        MyPyModule_AddType(fibers, "Scheduler", state->SchedulerType) ||
+        MyPyModule_AddType(fibers, "Channel", state->ChannelType) ||
+        MyPyModule_AddType(fibers, "FiberPool", state->FiberPoolType) ||
+        MyPyModule_AddType(fibers, "Generator", state->GeneratorType) ||
+        PyModule_AddIntConstant(fibers, "TRACEMALLOC_DOMAIN", FIBERS_TRACEMALLOC_DOMAIN) < 0) {
+        return -1;
+    }
+
+    if (!first) {
+        /* Fibers find the module state through the interpreter, as they don't
+         * always have a module object at hand */
+#if PY_VERSION_HEX >= 0x03080000
+        PyObject *dict = PyInterpreterState_GetDict(PyThreadState_Get()->interp);
+        if (dict == NULL) {
+            PyErr_SetString(PyExc_ImportError, "the interpreter has no dictionary");
+            return -1;
+        }
+        if (PyDict_SetItemString(dict, FIBERS_MODULE_KEY, fibers) < 0) {
+            return -1;
+        }
+#else
+        Py_INCREF(fibers);
+        _fibers_module = fibers;
+#endif
+    }
+
+    return 0;
+}
+
+
+static int
+fibers_traverse(PyObject *fibers, visitproc visit, void *arg)
+{
+    FibersState *state = (FibersState *)PyModule_GetState(fibers);
+
+    Py_VISIT(state->FiberType);
+    Py_VISIT(state->SchedulerType);
+    Py_VISIT(state->ChannelType);
+    Py_VISIT(state->FiberPoolType);
+    Py_VISIT(state->GeneratorType);
+    Py_VISIT(state->FiberError);
+    Py_VISIT(state->ChannelClosed);
+#ifdef FIBERS_CLONE
+    Py_VISIT(state->copy_func);
+#endif
+    return 0;
+}
+
+
+static int
+fibers_clear(PyObject *fibers)
+{
+    FibersState *state = (FibersState *)PyModule_GetState(fibers);
+
+    Py_CLEAR(state->FiberType);
+    Py_CLEAR(state->SchedulerType);
+    Py_CLEAR(state->ChannelType);
+    Py_CLEAR(state->FiberPoolType);
+    Py_CLEAR(state->GeneratorType);
+    Py_CLEAR(state->FiberError);
+    Py_CLEAR(state->ChannelClosed);
+    Py_CLEAR(state->main_fiber_key);
+#ifdef FIBERS_CLONE
+    Py_CLEAR(state->copy_func);
+#endif
+    return 0;
+}
+
+
+static void
+fibers_free(void *fibers)
+{
+    fibers_clear((PyObject *)fibers);
+}
+
+
+static PyModuleDef_Slot fibers_slots[] = {
+    {Py_mod_exec, fibers_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    /* everything but the process-wide statistics is per-interpreter, and
+     * those are protected by a lock */
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    /* the switch state is per-thread, and only the thread owning a stacklet
+     * destroys it, see Fiber_tp_dealloc. Until that is tested in CI without
+     * the GIL it's only declared as not needed on request */
+#ifdef FIBERS_GIL_NOT_USED
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#else
+    {Py_mod_gil, Py_MOD_GIL_USED},
+#endif
+#endif
+    {0, NULL}
+};
+
+
 static PyModuleDef fibers_module = {
     PyModuleDef_HEAD_INIT,
     "fibers._cfibers",    /*m_name*/
     NULL,                 /*m_doc*/
-    -1,                   /*m_size*/
+    sizeof(FibersState),  /*m_size*/
     fibers_methods,       /*m_methods*/
+    fibers_slots,         /*m_slots*/
+    fibers_traverse,      /*m_traverse*/
+    fibers_clear,         /*m_clear*/
+    fibers_free,          /*m_free*/
 };
 
 
@@ -776,30 +2650,5 @@ static PyModuleDef fibers_module = {
 PyMODINIT_FUNC
 PyInit__cfibers(void)
 {
-    PyObject *fibers;
-
-    /* Main module */
-    fibers = PyModule_Create(&fibers_module);
-
-    /* keys for per-thread dictionary */
-    main_fiber_key = PyUnicode_InternFromString("__fibers_main");
-    current_fiber_key = PyUnicode_InternFromString("__fibers_current");
-
-    if ((current_fiber_key == NULL) || (main_fiber_key == NULL)) {
-        goto fail;
-    }
-
-    /* Exceptions */
-    PyExc_FiberError = PyErr_NewException("fibers._cfibers.error", NULL, NULL);
-    MyPyModule_AddType(fibers, "error", (PyTypeObject *)PyExc_FiberError);
-
-    /* Types */
-    MyPyModule_AddType(fibers, "Fiber", &FiberType);
-
-    return fibers;
-
-fail:
-    Py_DECREF(fibers);
-
-    return NULL;
+    return PyModuleDef_Init(&fibers_module);
 }
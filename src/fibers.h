@@ -4,6 +4,16 @@
 /* python */
 #define PY_SSIZE_T_CLEAN
 #include "Python.h"
+#include "structmember.h"
+
+/* Suspended Fibers can be cloned where the layout of interpreter frames is
+ * known, see Fiber_func_clone */
+#if PY_VERSION_HEX >= 0x030B0000 && PY_VERSION_HEX < 0x030C0000 && !defined(PYPY_VERSION)
+#define FIBERS_CLONE
+#define Py_BUILD_CORE
+#include "internal/pycore_frame.h"
+#undef Py_BUILD_CORE
+#endif
 
 /* stacklet */
 #include "stacklet.h"
@@ -15,6 +25,63 @@ typedef int Bool;
 
 #define UNUSED_ARG(arg)  (void)arg
 
+/* Statistics, unless compiled with FIBERS_NO_STATS */
+typedef struct {
+    size_t created;     /* Fibers initialized */
+    size_t finished;    /* Fibers whose target returned or raised */
+    size_t switches;    /* switches done with switch() or throw() */
+} FiberStats;
+
+/* tracemalloc domain of the buffers which hold saved C stacks ("FIBR") */
+#define FIBERS_TRACEMALLOC_DOMAIN 0x46494252
+
+/* Buckets of the histogram of the C stack high-water marks of finished
+ * Fibers: below 1KiB, below 2KiB, ... below 1MiB, and the rest */
+#define FIBERS_STACK_HISTOGRAM_SIZE 12
+
+/* Values passed across a switch. Only valid immediately before and after a
+ * switch, so each thread needs its own */
+typedef struct {
+    struct _fiber *origin;
+    struct _fiber *target;
+    PyObject *value;
+} FiberSwitchState;
+
+/* Links of the list of suspended Fibers of a thread, see fiber_idle_add */
+typedef struct _fiber_idle_link {
+    struct _fiber_idle_link *prev;
+    struct _fiber_idle_link *next;
+} FiberIdleLink;
+
+/* Per-thread state, owned by the main Fiber */
+typedef struct _fiber_thread_state {
+    stacklet_thread_handle thread_h;
+    volatile FiberSwitchState switch_state;
+    double compress_idle;       /* seconds before saved stacks are packed, 0: off */
+    FiberIdleLink idle;         /* suspended Fibers, least recent first */
+#if PY_MINOR_VERSION >= 11
+    _PyStackChunk *free_chunks; /* data stack chunks for new Fibers, */
+    int nfree_chunks;           /* linked by their previous pointer  */
+#endif
+#ifndef FIBERS_NO_STATS
+    FiberStats stats;
+    size_t stack_histogram[FIBERS_STACK_HISTOGRAM_SIZE];
+    struct _fiber_thread_state *prev;   /* list of all threads, for */
+    struct _fiber_thread_state *next;   /* process-wide statistics  */
+#endif
+} FiberThreadState;
+
+#ifdef FIBERS_CLONE
+/* The first chunk of the Python data stack of a Fiber, shared with its
+ * clones: their frames are at the same addresses, so only one of them can
+ * have its frames in it and the others keep a copy */
+typedef struct {
+    _PyStackChunk *chunk;
+    struct _fiber *owner;       /* whose frames are in the chunk, if any */
+    Py_ssize_t refs;
+} FiberSharedChunk;
+#endif
+
 /* Python types */
 typedef struct _fiber {
     PyObject_HEAD
@@ -22,37 +89,188 @@ typedef struct _fiber {
     PyObject *dict;
     PyObject *weakreflist;
     struct _fiber *parent;
+    struct _fiber *ts_current;  /* main Fiber only: the current one, if not main */
+    FiberThreadState *ts_state; /* main Fiber only */
     stacklet_thread_handle thread_h;
     stacklet_handle stacklet_h;
+    stacklet_stack_handle stack_h;
+    Py_ssize_t stack_size;      /* of the separate stack, if any */
+    size_t max_stack;           /* largest C stack seen suspended, in bytes */
+    int max_depth;              /* deepest Python recursion seen switching */
+    FiberIdleLink idle;         /* while suspended, if stacks are packed */
+    void *posted;               /* dropped by another thread, see stacklet_post() */
+    double suspended_at;
+    struct _scheduler *scheduler;   /* the Scheduler which runs this Fiber, if any */
     Bool initialized;
     Bool is_main;
+    Bool ready;                 /* in the ready queue of its Scheduler */
     PyObject *target;
     PyObject *args;
     PyObject *kwargs;
+#ifdef FIBERS_CLONE
+    FiberSharedChunk *shared;   /* NULL unless cloned */
+    char *chunk_copy;           /* our frames, while the chunk isn't ours */
+    size_t chunk_copy_len;
+#endif
     struct {
-#if PY_MINOR_VERSION >= 11
+#if PY_MINOR_VERSION >= 13
+        struct _PyInterpreterFrame *current_frame;
+#elif PY_MINOR_VERSION >= 11
         _PyCFrame *cframe;
+#elif PY_MINOR_VERSION >= 10
+        CFrame *cframe;             /* on the C stack of the Fiber */
+#endif
+#if PY_MINOR_VERSION >= 11
         _PyStackChunk *datastack_chunk;
         PyObject **datastack_top;
         PyObject **datastack_limit;
-#endif
+#else
         struct _frame *frame;
+#endif
         int recursion_depth;
 #if PY_MINOR_VERSION >= 12
         int c_recursion_remaining;
 #endif
         _PyErr_StackItem exc_state;
+#ifdef FIBERS_CLONE
+        PyObject **stack_pointer;   /* top of the value stack of the frame
+                                       which called switch() or throw() */
+#endif
     } ts;
 } Fiber;
 
-static PyTypeObject FiberType;
+/* A Fiber which is iterated over, see generator.c */
+typedef struct {
+    Fiber fiber;
+    Fiber *yielder;     /* the Fiber to resume, if not this one */
+} Generator;
+
+/* A Fiber blocked until an operation completes */
+/* FiberWaiter status */
+#define WAITER_WAITING   0
+#define WAITER_DONE      1
+#define WAITER_CLOSED    2
+#define WAITER_CANCELLED 3
+#define WAITER_TIMEOUT   4
+
+typedef struct {
+    Fiber *fiber;
+    PyObject *value;        /* the received value */
+    Py_ssize_t index;       /* the operation which completed, for select() */
+    Py_ssize_t timer;       /* position in the timer heap, or -1 */
+    int res;                /* result of an io_uring operation */
+    Bool close_res;         /* 'res' is a new fd, closed if nobody waits for it */
+    int status;
+    int refs;               /* the blocked Fiber and each place it waits in */
+} FiberWaiter;
+
+typedef struct {
+    FiberWaiter *reader;
+    FiberWaiter *writer;
+} SchedulerFd;
+
+typedef struct {
+    double deadline;
+    uint64_t seq;           /* FIFO order for equal deadlines */
+    FiberWaiter *w;
+} SchedulerTimer;
+
+typedef struct _scheduler_ring SchedulerRing;
+
+typedef struct _scheduler {
+    PyObject_HEAD
+    PyObject *weakreflist;
+    stacklet_thread_handle thread_h;
+    Fiber *hub;             /* the Fiber which called run(), while it runs */
+    Fiber **ready;          /* ring buffer of Fibers ready to run */
+    Py_ssize_t ready_head;
+    Py_ssize_t ready_len;
+    Py_ssize_t ready_size;  /* a power of two */
+    /* I/O and timers */
+    int epfd;               /* -1 until needed */
+    SchedulerFd *fds;       /* indexed by file descriptor */
+    int fds_size;
+    SchedulerTimer *timers; /* binary heap, by deadline */
+    Py_ssize_t timers_len;
+    Py_ssize_t timers_size;
+    uint64_t timers_seq;
+    Py_ssize_t io_waiting;  /* Fibers waiting for I/O or a timer */
+    Py_ssize_t fds_waiting; /* those of them waiting for epoll */
+    unsigned int io_tick;
+    int io_uring;           /* -1 if it should be used when available */
+    SchedulerRing *ring;    /* NULL until needed */
+    Bool stack_order;       /* run the cheapest ready Fiber to switch to first */
+    unsigned int stack_picks;   /* since the first ready Fiber was taken */
+} Scheduler;
+
+typedef struct {
+    FiberWaiter *w;         /* NULL for buffered values */
+    PyObject *value;        /* the buffered value or the one to send */
+    Py_ssize_t index;
+} ChannelEntry;
+
+typedef struct {
+    ChannelEntry *entries;
+    Py_ssize_t head;
+    Py_ssize_t len;
+    Py_ssize_t size;        /* a power of two */
+} ChannelRing;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *weakreflist;
+    Py_ssize_t capacity;
+    Bool closed;
+    stacklet_thread_handle thread_h;    /* of the Fibers using it, once used */
+    ChannelRing buffer;
+    ChannelRing recvq;      /* Fibers waiting to receive */
+    ChannelRing sendq;      /* Fibers waiting to send */
+} Channel;
+
+typedef struct {
+    PyObject *target;
+    PyObject *args;
+    PyObject *kwargs;       /* NULL if there are none */
+} PoolTask;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *weakreflist;
+    Scheduler *scheduler;
+    Py_ssize_t size;        /* maximum number of workers */
+    Py_ssize_t workers;     /* workers which are running */
+    Fiber **idle;           /* parked workers, up to size of them */
+    Py_ssize_t idle_len;
+    PoolTask *tasks;        /* ring buffer of submitted tasks */
+    Py_ssize_t tasks_head;
+    Py_ssize_t tasks_len;
+    Py_ssize_t tasks_size;  /* a power of two */
+    Bool closed;
+} FiberPool;
+
+/* Module state, one per interpreter */
+typedef struct {
+    PyTypeObject *FiberType;
+    PyTypeObject *SchedulerType;
+    PyTypeObject *ChannelType;
+    PyTypeObject *FiberPoolType;
+    PyTypeObject *GeneratorType;
+    PyObject *FiberError;
+    PyObject *ChannelClosed;
+    PyObject *main_fiber_key;   /* for the per-thread dictionary */
+#ifdef FIBERS_CLONE
+    PyObject *copy_func;        /* copy.copy, once needed */
+#endif
+} FibersState;
 
 
 /* Some helper stuff */
 #ifdef _MSC_VER
     #define INLINE __inline
+    #define THREAD_LOCAL __declspec(thread)
 #else
     #define INLINE inline
+    #define THREAD_LOCAL __thread
 #endif
 
 #define ASSERT(x)                                                           \
@@ -65,13 +283,59 @@ static PyTypeObject FiberType;
     } while(0)                                                              \
 
 
+/* Create a heap type from its spec, with the given base if not NULL. The
+ * offsets of the instance dictionary and weak references list can only be
+ * given as members from 3.9 on, and the bases must be a tuple before 3.10 */
+static PyTypeObject *
+MyPyType_FromSpecWithBase(PyType_Spec *spec, PyTypeObject *base, Py_ssize_t dictoffset, Py_ssize_t weaklistoffset)
+{
+    PyTypeObject *type;
+    PyObject *bases = NULL;
+
+    if (base) {
+        bases = PyTuple_Pack(1, (PyObject *)base);
+        if (!bases) {
+            return NULL;
+        }
+    }
+    type = (PyTypeObject *)PyType_FromSpecWithBases(spec, bases);
+    Py_XDECREF(bases);
+#if PY_VERSION_HEX < 0x03090000
+    if (type) {
+        type->tp_dictoffset = dictoffset;
+        type->tp_weaklistoffset = weaklistoffset;
+    }
+#else
+    UNUSED_ARG(dictoffset);
+    UNUSED_ARG(weaklistoffset);
+#endif
+    return type;
+}
+
+#define MyPyType_FromSpec(spec, dictoffset, weaklistoffset) \
+    MyPyType_FromSpecWithBase(spec, NULL, dictoffset, weaklistoffset)
+
+
+/* Instances of heap types own a reference to their type, released on
+ * dealloc, from 3.8 on */
+#if PY_VERSION_HEX >= 0x03080000
+#define MY_HEAPTYPE_DECREF(type) Py_DECREF(type)
+#else
+#define MY_HEAPTYPE_DECREF(type)
+#endif
+
+/* and it's visited from 3.9 on */
+#if PY_VERSION_HEX >= 0x03090000
+#define MY_HEAPTYPE_VISIT(self) Py_VISIT(Py_TYPE(self))
+#else
+#define MY_HEAPTYPE_VISIT(self)
+#endif
+
+
 /* Add a type to a module */
 static int
 MyPyModule_AddType(PyObject *module, const char *name, PyTypeObject *type)
 {
-    if (PyType_Ready(type)) {
-        return -1;
-    }
     Py_INCREF(type);
     if (PyModule_AddObject(module, name, (PyObject *)type)) {
         Py_DECREF(type);
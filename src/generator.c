@@ -0,0 +1,196 @@
+/*
+ * Generator: a Fiber which is iterated over. Each next() switches into it,
+ * making the caller its parent, and yield_() switches back to the caller with
+ * a value, from the Generator or from a Fiber it started. When that Fiber is
+ * not the Generator itself it's the one resumed by the next next(). The
+ * iteration stops when the target of the Generator returns.
+ */
+
+/* The target returned this, the iteration is over */
+static PyObject *
+generator_stop(PyObject *result)
+{
+    PyObject *exc;
+
+    if (result != Py_None) {
+        exc = PyObject_CallFunctionObjArgs(PyExc_StopIteration, result, NULL);
+        if (exc) {
+            PyErr_SetObject(PyExc_StopIteration, exc);
+            Py_DECREF(exc);
+        }
+    }
+    Py_DECREF(result);
+    return NULL;
+}
+
+
+/*
+ * Switch into the Generator, or the Fiber which yielded for it. Returns NULL
+ * without an exception set once it has ended.
+ */
+static PyObject *
+generator_resume(Generator *self, PyObject *value)
+{
+    Fiber *fiber = (Fiber *)self;
+    Fiber *current, *target, *p;
+    PyObject *result;
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+
+    if (fiber->thread_h != current->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot switch to a Fiber on a different thread");
+        return NULL;
+    }
+
+    if (fiber->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        return NULL;
+    }
+
+    /* making the caller the parent must not make the parent chain cyclic */
+    for (p = current; p != NULL; p = p->parent) {
+        if (p == fiber) {
+            PyErr_SetString(PyExc_ValueError, "Generator already executing");
+            return NULL;
+        }
+    }
+
+    if (fiber->stacklet_h == NULL && value != Py_None) {
+        PyErr_SetString(PyExc_TypeError, "can't send non-None value to a just-started Generator");
+        return NULL;
+    }
+
+    if (fiber->parent != current) {
+        p = fiber->parent;
+        Py_INCREF(current);
+        fiber->parent = current;
+        Py_XDECREF(p);
+    }
+
+    /* the yielder can only be resumed once */
+    target = self->yielder;
+    self->yielder = NULL;
+
+    Py_INCREF(value);
+    result = do_switch(target ? target : fiber, value);
+    Py_XDECREF(target);
+
+    if (result && fiber->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        return generator_stop(result);
+    }
+    return result;
+}
+
+
+static PyObject *
+Generator_tp_iternext(Generator *self)
+{
+    return generator_resume(self, Py_None);
+}
+
+
+static PyObject *
+Generator_func_send(Generator *self, PyObject *value)
+{
+    PyObject *result;
+
+    result = generator_resume(self, value);
+    if (!result && !PyErr_Occurred()) {
+        PyErr_SetNone(PyExc_StopIteration);
+    }
+    return result;
+}
+
+
+/*
+ * Switch from the current Fiber to the caller of next() on the nearest
+ * Generator it runs in, with the given value. Returns the value given to
+ * send(), or None.
+ */
+static PyObject *
+fibers_func_yield(PyObject *obj, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyTypeObject *generator_type = get_state()->GeneratorType;
+    PyObject *value = Py_None;
+    Fiber *current, *g, *consumer;
+    Generator *gen;
+
+    UNUSED_ARG(obj);
+
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError, "yield_ expected at most 1 argument, got %zd", nargs);
+        return NULL;
+    }
+    if (nargs == 1) {
+        value = args[0];
+    }
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+
+    for (g = current; g != NULL && !PyObject_TypeCheck(g, generator_type); g = g->parent);
+    if (g == NULL) {
+        PyErr_SetString(get_state()->FiberError, "yield_() called outside of a Generator");
+        return NULL;
+    }
+
+    consumer = g->parent;
+    if (consumer == NULL || consumer->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        PyErr_SetString(get_state()->FiberError, "the caller of the Generator has ended");
+        return NULL;
+    }
+
+    gen = (Generator *)g;
+    if (current != g) {
+        Py_INCREF(current);
+        Py_XSETREF(gen->yielder, current);
+    }
+
+    Py_INCREF(value);
+    FIBER_SAVE_STACK_POINTER(current, args, nargs);
+    return do_switch(consumer, value);
+}
+
+
+static int
+Generator_tp_traverse(Generator *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->yielder);
+    return Fiber_tp_traverse((Fiber *)self, visit, arg);
+}
+
+
+static int
+Generator_tp_clear(Generator *self)
+{
+    Py_CLEAR(self->yielder);
+    return Fiber_tp_clear((Fiber *)self);
+}
+
+
+static PyMethodDef
+Generator_tp_methods[] = {
+    { "send", (PyCFunction)Generator_func_send, METH_O, "Resume the Generator, yield_() returns the given value there" },
+    { NULL }
+};
+
+
+static PyType_Slot Generator_tp_slots[] = {
+    {Py_tp_traverse, Generator_tp_traverse},
+    {Py_tp_clear, Generator_tp_clear},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, Generator_tp_iternext},
+    {Py_tp_methods, Generator_tp_methods},
+    {0, NULL},
+};
+
+
+static PyType_Spec Generator_tp_spec = {
+    "fibers._cfibers.Generator",
+    sizeof(Generator),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    Generator_tp_slots
+};
@@ -0,0 +1,433 @@
+/*
+ * FiberPool: long lived worker Fibers, run by a Scheduler, which run the
+ * submitted callables one after the other. Submitting a task only queues it,
+ * and wakes up an idle worker or starts a new one if there is room for it.
+ */
+
+static int
+pool_push(FiberPool *self, const PoolTask *task)
+{
+    PoolTask *tasks;
+    Py_ssize_t i, size;
+
+    if (self->tasks_len == self->tasks_size) {
+        size = self->tasks_size ? self->tasks_size * 2 : 16;
+        tasks = PyMem_Malloc(size * sizeof(PoolTask));
+        if (!tasks) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < self->tasks_len; i++) {
+            tasks[i] = self->tasks[(self->tasks_head + i) & (self->tasks_size - 1)];
+        }
+        PyMem_Free(self->tasks);
+        self->tasks = tasks;
+        self->tasks_head = 0;
+        self->tasks_size = size;
+    }
+    self->tasks[(self->tasks_head + self->tasks_len) & (self->tasks_size - 1)] = *task;
+    self->tasks_len++;
+    return 0;
+}
+
+
+static Bool
+pool_pop(FiberPool *self, PoolTask *task)
+{
+    if (self->tasks_len == 0) {
+        return False;
+    }
+    *task = self->tasks[self->tasks_head];
+    self->tasks_head = (self->tasks_head + 1) & (self->tasks_size - 1);
+    self->tasks_len--;
+    return True;
+}
+
+
+static void
+pool_task_clear(PoolTask *task)
+{
+    Py_DECREF(task->target);
+    Py_DECREF(task->args);
+    Py_XDECREF(task->kwargs);
+}
+
+
+/* The worker isn't parked anymore, if it was */
+static void
+pool_idle_remove(FiberPool *self, Fiber *fiber)
+{
+    Py_ssize_t i;
+
+    for (i = self->idle_len - 1; i >= 0; i--) {
+        if (self->idle[i] == fiber) {
+            self->idle[i] = self->idle[--self->idle_len];
+            Py_DECREF(fiber);
+            return;
+        }
+    }
+}
+
+
+static PyObject *pool_worker(FiberPool *self, PyObject *unused);
+
+static PyMethodDef pool_worker_def = {
+    "worker", (PyCFunction)pool_worker, METH_NOARGS, NULL
+};
+
+
+/* Make sure the tasks which are queued will be run */
+static int
+pool_wake(FiberPool *self)
+{
+    PyObject *func;
+    Fiber *fiber;
+    int r;
+
+    if (self->idle_len) {
+        fiber = self->idle[--self->idle_len];
+        r = fiber->ready ? 0 : scheduler_push(self->scheduler, fiber);
+        Py_DECREF(fiber);
+        return r;
+    }
+    if (self->workers == self->size) {
+        /* the busy workers will get to them */
+        return 0;
+    }
+
+    func = PyCFunction_New(&pool_worker_def, (PyObject *)self);
+    if (!func) {
+        return -1;
+    }
+    fiber = fiber_new(func, NULL, NULL);
+    Py_DECREF(func);
+    if (!fiber) {
+        return -1;
+    }
+    if (scheduler_adopt(self->scheduler, fiber) < 0 || scheduler_push(self->scheduler, fiber) < 0) {
+        Py_DECREF(fiber);
+        return -1;
+    }
+    Py_DECREF(fiber);
+    self->workers++;
+    return 0;
+}
+
+
+/* A worker ends because of an error, the tasks it leaves must still be run */
+static PyObject *
+pool_worker_error(FiberPool *self)
+{
+    PyObject *type, *value, *tb;
+
+    self->workers--;
+    if (self->tasks_len) {
+        PyErr_Fetch(&type, &value, &tb);
+        if (pool_wake(self) < 0) {
+            PyErr_WriteUnraisable((PyObject *)self);
+        }
+        PyErr_Restore(type, value, tb);
+    }
+    return NULL;
+}
+
+
+/*
+ * What the workers run: tasks, back to back, parking when there are none.
+ * Other ready Fibers get their turn between tasks. Errors end the worker and
+ * propagate to the Fiber which runs the Scheduler, like those of spawned
+ * Fibers. The worker holds no references while parked, so dropping it then
+ * leaks nothing.
+ */
+static PyObject *
+pool_worker(FiberPool *self, PyObject *unused)
+{
+    Scheduler *scheduler = self->scheduler;
+    Fiber *current;
+    PoolTask task;
+    PyObject *result;
+
+    UNUSED_ARG(unused);
+
+    current = get_current();
+    ASSERT(current != NULL);
+
+    for (;;) {
+        if (pool_pop(self, &task)) {
+            result = PyObject_Call(task.target, task.args, task.kwargs);
+            pool_task_clear(&task);
+            if (!result) {
+                return pool_worker_error(self);
+            }
+            Py_DECREF(result);
+            if (scheduler->ready_len) {
+                result = Scheduler_func_yield(scheduler);
+                if (!result) {
+                    return pool_worker_error(self);
+                }
+                Py_DECREF(result);
+            }
+            continue;
+        }
+        if (self->closed) {
+            break;
+        }
+        Py_INCREF(current);
+        self->idle[self->idle_len++] = current;
+        result = scheduler_park(scheduler, current);
+        /* when woken up by a submission it's not idle anymore already */
+        pool_idle_remove(self, current);
+        if (!result) {
+            return pool_worker_error(self);
+        }
+        Py_DECREF(result);
+    }
+
+    self->workers--;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+FiberPool_func_submit(FiberPool *self, PyObject *args, PyObject *kwargs)
+{
+    PoolTask task;
+    Fiber *current;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "submit() missing required argument 'target'");
+        return NULL;
+    }
+    task.target = PyTuple_GET_ITEM(args, 0);
+    if (!PyCallable_Check(task.target)) {
+        PyErr_SetString(PyExc_TypeError, "target must be a callable");
+        return NULL;
+    }
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+    if (current->thread_h != self->scheduler->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot submit to a FiberPool on a different thread");
+        return NULL;
+    }
+    if (self->closed) {
+        PyErr_SetString(get_state()->FiberError, "FiberPool is closed");
+        return NULL;
+    }
+
+    task.args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (!task.args) {
+        return NULL;
+    }
+    task.kwargs = NULL;
+    if (kwargs && PyDict_GET_SIZE(kwargs)) {
+        /* don't share the caller's dictionary */
+        task.kwargs = PyDict_Copy(kwargs);
+        if (!task.kwargs) {
+            Py_DECREF(task.args);
+            return NULL;
+        }
+    }
+    Py_INCREF(task.target);
+
+    if (pool_push(self, &task) < 0) {
+        pool_task_clear(&task);
+        return NULL;
+    }
+    if (pool_wake(self) < 0) {
+        /* the task stays queued, for the workers there are */
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* Idle workers end now, busy ones once there are no tasks left */
+static PyObject *
+FiberPool_func_close(FiberPool *self)
+{
+    Fiber *fiber;
+
+    self->closed = True;
+    while (self->idle_len) {
+        fiber = self->idle[--self->idle_len];
+        if (!fiber->ready && scheduler_push(self->scheduler, fiber) < 0) {
+            self->idle[self->idle_len++] = fiber;
+            return NULL;
+        }
+        Py_DECREF(fiber);
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+FiberPool_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"scheduler", "size", NULL};
+
+    Scheduler *scheduler;
+    Py_ssize_t size = 16;
+    FiberPool *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|n:FiberPool", kwlist, get_state()->SchedulerType, &scheduler, &size)) {
+        return NULL;
+    }
+    if (size < 1) {
+        PyErr_SetString(PyExc_ValueError, "size must be at least 1");
+        return NULL;
+    }
+
+    self = (FiberPool *)PyType_GenericNew(type, args, kwargs);
+    if (!self) {
+        return NULL;
+    }
+    self->weakreflist = NULL;
+    Py_INCREF(scheduler);
+    self->scheduler = scheduler;
+    self->size = size;
+    self->workers = 0;
+    self->idle = PyMem_Malloc(size * sizeof(Fiber *));
+    self->idle_len = 0;
+    self->tasks = NULL;
+    self->tasks_head = 0;
+    self->tasks_len = 0;
+    self->tasks_size = 0;
+    self->closed = False;
+    if (!self->idle) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)self;
+}
+
+
+static int
+FiberPool_tp_traverse(FiberPool *self, visitproc visit, void *arg)
+{
+    PoolTask *task;
+    Py_ssize_t i;
+
+    for (i = 0; i < self->tasks_len; i++) {
+        task = &self->tasks[(self->tasks_head + i) & (self->tasks_size - 1)];
+        Py_VISIT(task->target);
+        Py_VISIT(task->args);
+        Py_VISIT(task->kwargs);
+    }
+    for (i = 0; i < self->idle_len; i++) {
+        Py_VISIT(self->idle[i]);
+    }
+    Py_VISIT(self->scheduler);
+    MY_HEAPTYPE_VISIT(self);
+
+    return 0;
+}
+
+
+static int
+FiberPool_tp_clear(FiberPool *self)
+{
+    PoolTask task;
+
+    while (pool_pop(self, &task)) {
+        pool_task_clear(&task);
+    }
+    while (self->idle_len) {
+        Py_DECREF(self->idle[--self->idle_len]);
+    }
+    Py_CLEAR(self->scheduler);
+
+    return 0;
+}
+
+
+static void
+FiberPool_tp_dealloc(FiberPool *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject *)self);
+    }
+    FiberPool_tp_clear(self);
+    PyMem_Free(self->idle);
+    PyMem_Free(self->tasks);
+    tp->tp_free((PyObject *)self);
+    MY_HEAPTYPE_DECREF(tp);
+}
+
+
+static PyObject *
+FiberPool_pending_get(FiberPool *self, void *c)
+{
+    UNUSED_ARG(c);
+
+    return PyLong_FromSsize_t(self->tasks_len);
+}
+
+
+static PyObject *
+FiberPool_workers_get(FiberPool *self, void *c)
+{
+    UNUSED_ARG(c);
+
+    return PyLong_FromSsize_t(self->workers);
+}
+
+
+static PyObject *
+FiberPool_idle_get(FiberPool *self, void *c)
+{
+    UNUSED_ARG(c);
+
+    return PyLong_FromSsize_t(self->idle_len);
+}
+
+
+static PyMethodDef
+FiberPool_tp_methods[] = {
+    { "submit", (PyCFunction)FiberPool_func_submit, METH_VARARGS|METH_KEYWORDS, "Queue a call of the given callable, to be run by one of the workers" },
+    { "close", (PyCFunction)FiberPool_func_close, METH_NOARGS, "Stop accepting tasks, the workers end once the queued ones are done" },
+    { NULL }
+};
+
+
+static PyGetSetDef FiberPool_tp_getsets[] = {
+    {"pending", (getter)FiberPool_pending_get, NULL, "Number of tasks waiting for a worker", NULL},
+    {"workers", (getter)FiberPool_workers_get, NULL, "Number of worker Fibers", NULL},
+    {"idle", (getter)FiberPool_idle_get, NULL, "Number of worker Fibers parked waiting for tasks", NULL},
+    {NULL}
+};
+
+
+static PyMemberDef FiberPool_tp_members[] = {
+    {"scheduler", T_OBJECT, offsetof(FiberPool, scheduler), READONLY, "The Scheduler which runs the workers"},
+    {"size", T_PYSSIZET, offsetof(FiberPool, size), READONLY, "Maximum number of worker Fibers"},
+#if PY_VERSION_HEX >= 0x03090000
+    {"__weaklistoffset__", T_PYSSIZET, offsetof(FiberPool, weakreflist), READONLY},
+#endif
+    {NULL}
+};
+
+
+static PyType_Slot FiberPool_tp_slots[] = {
+    {Py_tp_dealloc, FiberPool_tp_dealloc},
+    {Py_tp_traverse, FiberPool_tp_traverse},
+    {Py_tp_clear, FiberPool_tp_clear},
+    {Py_tp_methods, FiberPool_tp_methods},
+    {Py_tp_members, FiberPool_tp_members},
+    {Py_tp_getset, FiberPool_tp_getsets},
+    {Py_tp_new, FiberPool_tp_new},
+    {0, NULL},
+};
+
+
+static PyType_Spec FiberPool_tp_spec = {
+    "fibers._cfibers.FiberPool",
+    sizeof(FiberPool),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    FiberPool_tp_slots
+};
@@ -0,0 +1,1527 @@
+
+/*
+ * Scheduler: runs Fibers in FIFO order, or with stack_order the cheapest to
+ * switch to first. Fibers which yield or park switch directly to the next
+ * ready Fiber, control only goes back to the Fiber which called run() (the
+ * hub) when a Fiber ends or there is nothing left to run.
+ * When nothing is ready the hub waits for I/O (with epoll, on Linux) and
+ * timers, and makes the Fibers waiting for them ready.
+ */
+
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/* events handled per epoll_wait call */
+#define SCHEDULER_MAX_EVENTS 256
+
+/* how often I/O is polled when Fibers keep running without blocking */
+#define SCHEDULER_POLL_INTERVAL 64
+
+/* how many ready Fibers stack_order looks at, every this many picks it takes
+ * the first one so that none waits for long */
+#define SCHEDULER_STACK_WINDOW 8
+
+/* I/O operations, see scheduler_io */
+#define SCHEDULER_OP_READ   0
+#define SCHEDULER_OP_WRITE  1
+#define SCHEDULER_OP_RECV   2
+#define SCHEDULER_OP_SEND   3
+#define SCHEDULER_OP_ACCEPT 4
+#define SCHEDULER_OP_FSYNC  5
+
+static int scheduler_poll(Scheduler *self, Bool block);
+
+
+static int
+scheduler_push(Scheduler *self, Fiber *fiber)
+{
+    Fiber **ready;
+    Py_ssize_t i, size;
+
+    if (self->ready_len == self->ready_size) {
+        size = self->ready_size ? self->ready_size * 2 : 16;
+        ready = PyMem_Malloc(size * sizeof(Fiber *));
+        if (!ready) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < self->ready_len; i++) {
+            ready[i] = self->ready[(self->ready_head + i) & (self->ready_size - 1)];
+        }
+        PyMem_Free(self->ready);
+        self->ready = ready;
+        self->ready_head = 0;
+        self->ready_size = size;
+    }
+    Py_INCREF(fiber);
+    fiber->ready = True;
+    self->ready[(self->ready_head + self->ready_len) & (self->ready_size - 1)] = fiber;
+    self->ready_len++;
+    return 0;
+}
+
+
+/* Put a Fiber which was just taken back at the front of the queue */
+static void
+scheduler_push_front(Scheduler *self, Fiber *fiber)
+{
+    /* there is room for it, since it was just taken */
+    self->ready_head = (self->ready_head - 1) & (self->ready_size - 1);
+    self->ready[self->ready_head] = fiber;
+    self->ready_len++;
+    fiber->ready = True;
+}
+
+
+/* Returns a new reference to the next Fiber to run, or NULL if there is none */
+static Fiber *
+scheduler_pop(Scheduler *self)
+{
+    Fiber *fiber;
+
+    while (self->ready_len) {
+        fiber = self->ready[self->ready_head];
+        self->ready_head = (self->ready_head + 1) & (self->ready_size - 1);
+        self->ready_len--;
+        fiber->ready = False;
+        if (fiber->stacklet_h != EMPTY_STACKLET_HANDLE) {
+            return fiber;
+        }
+        Py_DECREF(fiber);
+    }
+    return NULL;
+}
+
+
+/* Bytes of C stack to copy to switch from the current Fiber to the given one */
+static size_t
+scheduler_switch_cost(Scheduler *self, Fiber *fiber, Fiber *current)
+{
+    if (fiber == current || fiber->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        return 0;
+    }
+    if (fiber->stacklet_h == NULL) {
+        /* it starts from the hub, see scheduler_switch */
+        if (current == self->hub || !self->hub || !self->hub->stacklet_h) {
+            return 0;
+        }
+        return stacklet_switch_cost(self->hub->stacklet_h);
+    }
+    return stacklet_switch_cost(fiber->stacklet_h);
+}
+
+
+/*
+ * Returns a new reference to the next Fiber to run, or NULL if there is none.
+ * With stack_order it's the one among the first ready Fibers which needs the
+ * least copying to switch to, other than 'skip', except every
+ * SCHEDULER_STACK_WINDOW picks.
+ */
+static Fiber *
+scheduler_next(Scheduler *self, Fiber *current, Fiber *skip)
+{
+    Py_ssize_t i, n, best, mask;
+    size_t cost, best_cost;
+    Fiber *fiber;
+
+    if (!self->stack_order || self->ready_len < 2) {
+        return scheduler_pop(self);
+    }
+    if (++self->stack_picks == SCHEDULER_STACK_WINDOW) {
+        self->stack_picks = 0;
+        return scheduler_pop(self);
+    }
+
+    mask = self->ready_size - 1;
+    n = self->ready_len < SCHEDULER_STACK_WINDOW ? self->ready_len : SCHEDULER_STACK_WINDOW;
+    best = -1;
+    best_cost = 0;
+    for (i = 0; i < n; i++) {
+        fiber = self->ready[(self->ready_head + i) & mask];
+        if (fiber == skip) {
+            continue;
+        }
+        cost = scheduler_switch_cost(self, fiber, current);
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+
+    if (best > 0) {
+        /* move it to the front, the others keep their order */
+        fiber = self->ready[(self->ready_head + best) & mask];
+        for (i = best; i > 0; i--) {
+            self->ready[(self->ready_head + i) & mask] = self->ready[(self->ready_head + i - 1) & mask];
+        }
+        self->ready[self->ready_head] = fiber;
+    }
+    return scheduler_pop(self);
+}
+
+
+/* Don't let Fibers waiting for I/O starve while others keep running */
+static INLINE void
+scheduler_tick(Scheduler *self)
+{
+    if (self->io_waiting && ++self->io_tick >= SCHEDULER_POLL_INTERVAL) {
+        self->io_tick = 0;
+        if (scheduler_poll(self, False) < 0) {
+            /* the hub will get the error when it polls again */
+            PyErr_Clear();
+        }
+    }
+}
+
+
+/* Switch to the given Fiber, consuming the reference */
+static PyObject *
+scheduler_switch(Scheduler *self, Fiber *fiber)
+{
+    PyObject *result;
+    Fiber *p;
+
+    /* a new Fiber starts running at the point of the C stack where it's
+     * switched to, so start them all from the hub instead of nesting them
+     * in each other */
+    if (fiber->stacklet_h == NULL && self->hub && get_current() != self->hub) {
+        scheduler_push_front(self, fiber);
+        fiber = self->hub;
+        Py_INCREF(fiber);
+    }
+
+    /* when a Fiber ends control goes back to the hub, unless that would make
+     * the parent chain cyclic */
+    if (self->hub && fiber != self->hub && fiber->parent != self->hub) {
+        for (p = self->hub; p != NULL && p != fiber; p = p->parent);
+        if (p == NULL) {
+            p = fiber->parent;
+            Py_INCREF(self->hub);
+            fiber->parent = self->hub;
+            Py_XDECREF(p);
+        }
+    }
+
+    Py_INCREF(Py_None);
+    result = do_switch(fiber, Py_None);
+    Py_DECREF(fiber);
+    return result;
+}
+
+
+/* Check that the current Fiber is one this Scheduler runs */
+static Fiber *
+scheduler_check_current(Scheduler *self, const char *func)
+{
+    Fiber *current;
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+    if (current->scheduler != self || current == self->hub) {
+        PyErr_Format(get_state()->FiberError, "%s() must be called from a Fiber run by this Scheduler", func);
+        return NULL;
+    }
+    return current;
+}
+
+
+static int
+scheduler_adopt(Scheduler *self, Fiber *fiber)
+{
+    if (fiber->thread_h != self->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot schedule a Fiber on a different thread");
+        return -1;
+    }
+    if (fiber->scheduler == NULL) {
+        Py_INCREF(self);
+        fiber->scheduler = self;
+    } else if (fiber->scheduler != self) {
+        PyErr_SetString(get_state()->FiberError, "Fiber belongs to a different Scheduler");
+        return -1;
+    }
+    return 0;
+}
+
+
+static FiberWaiter *
+waiter_new(Fiber *fiber)
+{
+    FiberWaiter *w;
+
+    w = PyMem_Malloc(sizeof(FiberWaiter));
+    if (!w) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    Py_INCREF(fiber);
+    w->fiber = fiber;
+    w->value = NULL;
+    w->index = 0;
+    w->timer = -1;
+    w->res = -1;
+    w->close_res = False;
+    w->status = WAITER_WAITING;
+    w->refs = 1;
+    return w;
+}
+
+
+static void
+waiter_release(FiberWaiter *w)
+{
+    if (--w->refs == 0) {
+        Py_XDECREF(w->value);
+        Py_DECREF(w->fiber);
+        PyMem_Free(w);
+    }
+}
+
+
+/* The operation completed, make the waiting Fiber ready to run */
+static int
+waiter_wake(FiberWaiter *w, int status)
+{
+    Fiber *fiber = w->fiber;
+
+    if (w->status != WAITER_WAITING) {
+        return 0;
+    }
+    w->status = status;
+    if (!fiber->ready && scheduler_push(fiber->scheduler, fiber) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* The current Fiber, if it's one which can block */
+static Fiber *
+scheduler_check_block(void)
+{
+    Fiber *current;
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+    if (current->scheduler == NULL || current == current->scheduler->hub) {
+        PyErr_SetString(get_state()->FiberError, "cannot block outside of a Fiber run by a Scheduler");
+        return NULL;
+    }
+    return current;
+}
+
+
+static PyObject *scheduler_park(Scheduler *self, Fiber *current);
+
+/* Park the current Fiber until its operation completes */
+static int
+waiter_block(Fiber *current, FiberWaiter *w)
+{
+    PyObject *result;
+
+    while (w->status == WAITER_WAITING) {
+        result = scheduler_park(current->scheduler, current);
+        if (!result) {
+            w->status = WAITER_CANCELLED;
+            return -1;
+        }
+        Py_DECREF(result);
+    }
+    return 0;
+}
+
+
+static INLINE Bool
+timer_less(const SchedulerTimer *a, const SchedulerTimer *b)
+{
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+
+static INLINE void
+timer_set(Scheduler *self, Py_ssize_t i, const SchedulerTimer *timer)
+{
+    self->timers[i] = *timer;
+    timer->w->timer = i;
+}
+
+
+static void
+timer_sift_up(Scheduler *self, Py_ssize_t i)
+{
+    SchedulerTimer timer = self->timers[i];
+    Py_ssize_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!timer_less(&timer, &self->timers[parent])) {
+            break;
+        }
+        timer_set(self, i, &self->timers[parent]);
+        i = parent;
+    }
+    timer_set(self, i, &timer);
+}
+
+
+static void
+timer_sift_down(Scheduler *self, Py_ssize_t i)
+{
+    SchedulerTimer timer = self->timers[i];
+    Py_ssize_t child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= self->timers_len) {
+            break;
+        }
+        if (child + 1 < self->timers_len && timer_less(&self->timers[child + 1], &self->timers[child])) {
+            child++;
+        }
+        if (!timer_less(&self->timers[child], &timer)) {
+            break;
+        }
+        timer_set(self, i, &self->timers[child]);
+        i = child;
+    }
+    timer_set(self, i, &timer);
+}
+
+
+static int
+scheduler_timer_add(Scheduler *self, FiberWaiter *w, double deadline)
+{
+    SchedulerTimer *timers;
+    Py_ssize_t size;
+
+    if (self->timers_len == self->timers_size) {
+        size = self->timers_size ? self->timers_size * 2 : 16;
+        timers = PyMem_Realloc(self->timers, size * sizeof(SchedulerTimer));
+        if (!timers) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->timers = timers;
+        self->timers_size = size;
+    }
+    self->timers[self->timers_len].deadline = deadline;
+    self->timers[self->timers_len].seq = self->timers_seq++;
+    self->timers[self->timers_len].w = w;
+    self->timers_len++;
+    w->refs++;
+    timer_sift_up(self, self->timers_len - 1);
+    return 0;
+}
+
+
+static void
+scheduler_timer_remove(Scheduler *self, FiberWaiter *w)
+{
+    Py_ssize_t i = w->timer;
+
+    if (i < 0) {
+        return;
+    }
+    w->timer = -1;
+    self->timers_len--;
+    if (i < self->timers_len) {
+        timer_set(self, i, &self->timers[self->timers_len]);
+        if (i > 0 && timer_less(&self->timers[i], &self->timers[(i - 1) / 2])) {
+            timer_sift_up(self, i);
+        } else {
+            timer_sift_down(self, i);
+        }
+    }
+    waiter_release(w);
+}
+
+
+static SchedulerFd *
+scheduler_fd(Scheduler *self, int fd)
+{
+    SchedulerFd *fds;
+    int size;
+
+    if (fd >= self->fds_size) {
+        size = Py_MAX(fd + 1, self->fds_size * 2);
+        fds = PyMem_Realloc(self->fds, size * sizeof(SchedulerFd));
+        if (!fds) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memset(fds + self->fds_size, 0, (size - self->fds_size) * sizeof(SchedulerFd));
+        self->fds = fds;
+        self->fds_size = size;
+    }
+    return &self->fds[fd];
+}
+
+
+#ifdef __linux__
+static int
+scheduler_epfd(Scheduler *self)
+{
+    if (self->epfd < 0) {
+        self->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (self->epfd < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+    return self->epfd;
+}
+
+
+/* (Re)register the file descriptor for the events its waiters want, once */
+static int
+scheduler_fd_arm(Scheduler *self, int fd)
+{
+    SchedulerFd *slot = &self->fds[fd];
+    struct epoll_event ev;
+
+    if (scheduler_epfd(self) < 0) {
+        return -1;
+    }
+
+    ev.events = EPOLLONESHOT | (slot->reader ? EPOLLIN : 0) | (slot->writer ? EPOLLOUT : 0);
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int
+scheduler_fd_ready(Scheduler *self, int fd, uint32_t events)
+{
+    SchedulerFd *slot;
+    FiberWaiter *w;
+    int r = 0;
+
+    if (fd >= self->fds_size) {
+        return 0;
+    }
+    slot = &self->fds[fd];
+    if (slot->reader && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        w = slot->reader;
+        slot->reader = NULL;
+        r |= waiter_wake(w, WAITER_DONE);
+        waiter_release(w);
+    }
+    if (slot->writer && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        w = slot->writer;
+        slot->writer = NULL;
+        r |= waiter_wake(w, WAITER_DONE);
+        waiter_release(w);
+    }
+    if ((slot->reader || slot->writer) && scheduler_fd_arm(self, fd) < 0) {
+        /* wake them up, they will get the error when using it */
+        PyErr_Clear();
+        return scheduler_fd_ready(self, fd, EPOLLERR);
+    }
+    return r;
+}
+#endif
+
+
+static Bool
+scheduler_use_uring(Scheduler *self)
+{
+#ifdef FIBERS_IO_URING
+    if (self->io_uring < 0) {
+        self->io_uring = uring_probe();
+    }
+    return self->io_uring;
+#else
+    return False;
+#endif
+}
+
+
+#ifdef FIBERS_IO_URING
+static SchedulerRing *
+scheduler_ring(Scheduler *self)
+{
+    struct epoll_event ev;
+    SchedulerRing *ring;
+
+    if (self->ring) {
+        return self->ring;
+    }
+    if (scheduler_epfd(self) < 0) {
+        return NULL;
+    }
+    if (!(ring = uring_new(URING_ENTRIES))) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    /* completions also wake up epoll_wait, for when both are waited for */
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.fd = ring->fd;
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, ring->fd, &ev) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        uring_free(ring);
+        return NULL;
+    }
+    self->ring = ring;
+    return ring;
+}
+#endif
+
+
+/*
+ * Wait for I/O and timers. Without 'block' only what is ready now is
+ * handled, otherwise it waits until the next timer expires.
+ */
+static int
+scheduler_poll(Scheduler *self, Bool block)
+{
+    double timeout, now;
+    FiberWaiter *w;
+    int r;
+
+    timeout = block ? -1 : 0;
+    if (block && self->timers_len) {
+        timeout = Py_MAX(0, self->timers[0].deadline - fibers_now());
+    }
+    if (block) {
+        /* the parked Fibers don't switch, pack their stacks from here */
+        FiberThreadState *state = _fibers_tls.main->ts_state;
+        if (state->compress_idle > 0) {
+            now = fibers_now();
+            fibers_pack_idle(state, now, state->compress_idle, 0);
+            if (state->idle.next != &state->idle) {
+                now = Py_MAX(0, FIBER_FROM_IDLE(state->idle.next)->suspended_at + state->compress_idle - now);
+                timeout = timeout < 0 ? now : Py_MIN(timeout, now);
+            }
+        }
+    }
+
+#ifdef FIBERS_IO_URING
+    if (self->ring) {
+        if (!self->fds_waiting && self->ring->ops && (timeout <= 0 || (self->ring->features & IORING_FEAT_EXT_ARG))) {
+            /* only io_uring operations and timers, submit and wait at once */
+            if (uring_submit(self->ring, timeout) < 0 || uring_reap(self->ring) < 0) {
+                return -1;
+            }
+            goto timers;
+        }
+        /* submit everything queued in this round, then wait with epoll */
+        if (uring_submit(self->ring, 0) < 0) {
+            return -1;
+        }
+        if (uring_completed(self->ring)) {
+            timeout = 0;
+        }
+    }
+#endif
+
+#ifdef __linux__
+    if (self->epfd >= 0) {
+        struct epoll_event events[SCHEDULER_MAX_EVENTS];
+        int i, n, ms;
+
+        ms = timeout < 0 ? -1 : (int)Py_MIN(ceil(timeout * 1000), INT_MAX);
+        Py_BEGIN_ALLOW_THREADS
+        n = epoll_wait(self->epfd, events, SCHEDULER_MAX_EVENTS, ms);
+        Py_END_ALLOW_THREADS
+        if (n < 0) {
+            if (errno != EINTR) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                return -1;
+            }
+            if (PyErr_CheckSignals() < 0) {
+                return -1;
+            }
+            n = 0;
+        }
+        for (i = 0; i < n; i++) {
+            if (scheduler_fd_ready(self, events[i].data.fd, events[i].events) < 0) {
+                return -1;
+            }
+        }
+    } else
+#endif
+    if (timeout > 0) {
+        Py_BEGIN_ALLOW_THREADS
+#ifdef _WIN32
+        Sleep((DWORD)Py_MIN(ceil(timeout * 1000), INFINITE - 1));
+        r = 0;
+#else
+        struct timeval tv;
+        tv.tv_sec = (time_t)timeout;
+        tv.tv_usec = (long)((timeout - (double)tv.tv_sec) * 1e6);
+        r = select(0, NULL, NULL, NULL, &tv);
+#endif
+        Py_END_ALLOW_THREADS
+        if (r < 0 && PyErr_CheckSignals() < 0) {
+            return -1;
+        }
+    }
+
+#ifdef FIBERS_IO_URING
+    if (self->ring && uring_reap(self->ring) < 0) {
+        return -1;
+    }
+timers:
+#endif
+    if (self->timers_len) {
+        now = fibers_now();
+        while (self->timers_len && self->timers[0].deadline <= now) {
+            w = self->timers[0].w;
+            r = waiter_wake(w, WAITER_TIMEOUT);
+            scheduler_timer_remove(self, w);
+            if (r < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Park the current Fiber until fd is ready, returns the waiter status */
+static int
+scheduler_wait_io(Scheduler *self, Fiber *current, int fd, Bool write, double timeout)
+{
+#ifndef __linux__
+    PyErr_SetString(get_state()->FiberError, "waiting for file descriptors is not supported on this platform");
+    return -1;
+#else
+    FiberWaiter *w, **slot_w;
+    SchedulerFd *slot;
+    int r;
+
+    if (!(slot = scheduler_fd(self, fd))) {
+        return -1;
+    }
+    slot_w = write ? &slot->writer : &slot->reader;
+    if (*slot_w) {
+        PyErr_Format(get_state()->FiberError, "another Fiber is already waiting for fd %d to be %s", fd, write ? "writable" : "readable");
+        return -1;
+    }
+
+    if (!(w = waiter_new(current))) {
+        return -1;
+    }
+    *slot_w = w;
+    w->refs++;
+    if (scheduler_fd_arm(self, fd) < 0 || (timeout >= 0 && scheduler_timer_add(self, w, fibers_now() + timeout) < 0)) {
+        r = -1;
+    } else {
+        self->io_waiting++;
+        self->fds_waiting++;
+        r = waiter_block(current, w);
+        self->fds_waiting--;
+        self->io_waiting--;
+    }
+
+    /* the slot may have moved while blocked */
+    slot_w = write ? &self->fds[fd].writer : &self->fds[fd].reader;
+    if (*slot_w == w) {
+        *slot_w = NULL;
+        waiter_release(w);
+    }
+    scheduler_timer_remove(self, w);
+    if (r == 0) {
+        r = w->status;
+    }
+    waiter_release(w);
+    return r;
+#endif
+}
+
+
+static PyObject *
+scheduler_wait_fd(Scheduler *self, PyObject *args, PyObject *kwargs, Bool write)
+{
+    static char *kwlist[] = {"fd", "timeout", NULL};
+
+    PyObject *fileobj, *timeout_obj = Py_None;
+    double timeout = -1;
+    Fiber *current;
+    int fd, r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, write ? "O|O:wait_writable" : "O|O:wait_readable", kwlist, &fileobj, &timeout_obj)) {
+        return NULL;
+    }
+    if ((fd = PyObject_AsFileDescriptor(fileobj)) < 0) {
+        return NULL;
+    }
+    if (timeout_obj != Py_None) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        timeout = Py_MAX(timeout, 0);
+    }
+
+    if (!(current = scheduler_check_current(self, write ? "wait_writable" : "wait_readable"))) {
+        return NULL;
+    }
+
+    if ((r = scheduler_wait_io(self, current, fd, write, timeout)) < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(r == WAITER_DONE);
+}
+
+
+#ifndef _WIN32
+/*
+ * Run an I/O operation for the current Fiber. With io_uring it's queued and
+ * the Fiber parks until it completes, otherwise the system call is retried
+ * after waiting for the file descriptor to be ready. 'buf' must belong to
+ * 'owner', which is kept alive for as long as the kernel may use it.
+ */
+static Py_ssize_t
+scheduler_io(Scheduler *self, Fiber *current, int op, int fd, PyObject *owner, char *buf, size_t len, int64_t off, int flags)
+{
+    Py_ssize_t r;
+
+#ifdef FIBERS_IO_URING
+    static const int opcodes[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_RECV, IORING_OP_SEND,
+                                  IORING_OP_ACCEPT, IORING_OP_FSYNC};
+    SchedulerRing *ring;
+    FiberWaiter *w;
+    int res;
+
+    if (scheduler_use_uring(self)) {
+        if (!(ring = scheduler_ring(self)) || !(w = waiter_new(current))) {
+            return -1;
+        }
+        Py_XINCREF(owner);
+        w->value = owner;
+        if (op == SCHEDULER_OP_ACCEPT) {
+            flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+            w->close_res = True;
+        }
+        if (uring_prep(ring, opcodes[op], fd, buf, (unsigned int)Py_MIN(len, INT_MAX), (uint64_t)off, flags, w) < 0) {
+            r = -1;
+        } else {
+            self->io_waiting++;
+            r = waiter_block(current, w);
+            self->io_waiting--;
+            if (r < 0) {
+                uring_cancel(ring, w);
+            }
+        }
+        res = w->res;
+        waiter_release(w);
+        if (r < 0) {
+            if (op == SCHEDULER_OP_ACCEPT && res >= 0) {
+                /* it completed before the Fiber stopped waiting */
+                close(res);
+            }
+            return -1;
+        }
+        if (res < 0) {
+            errno = -res;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        return res;
+    }
+#endif
+
+    if (op == SCHEDULER_OP_ACCEPT && !(fcntl(fd, F_GETFL) & O_NONBLOCK)) {
+        /* a listening socket in blocking mode would block the thread: wait
+         * for a connection first, and accept it without the GIL in case it's
+         * gone meanwhile */
+        if (scheduler_wait_io(self, current, fd, False, -1) < 0) {
+            return -1;
+        }
+    }
+    for (;;) {
+        switch (op) {
+            case SCHEDULER_OP_READ:
+                Py_BEGIN_ALLOW_THREADS
+                r = off < 0 ? read(fd, buf, len) : pread(fd, buf, len, off);
+                Py_END_ALLOW_THREADS
+                break;
+            case SCHEDULER_OP_WRITE:
+                Py_BEGIN_ALLOW_THREADS
+                r = off < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, off);
+                Py_END_ALLOW_THREADS
+                break;
+            case SCHEDULER_OP_RECV:
+                r = recv(fd, buf, len, flags | MSG_DONTWAIT);
+                break;
+            case SCHEDULER_OP_SEND:
+                r = send(fd, buf, len, flags | MSG_DONTWAIT);
+                break;
+            case SCHEDULER_OP_ACCEPT:
+                Py_BEGIN_ALLOW_THREADS
+#ifdef __linux__
+                r = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+                r = accept(fd, NULL, NULL);
+#endif
+                Py_END_ALLOW_THREADS
+                break;
+            default:
+                Py_BEGIN_ALLOW_THREADS
+                r = fsync(fd);
+                Py_END_ALLOW_THREADS
+                break;
+        }
+        if (r >= 0) {
+            return r;
+        }
+        if (errno == EINTR) {
+            if (PyErr_CheckSignals() < 0) {
+                return -1;
+            }
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (scheduler_wait_io(self, current, fd, op == SCHEDULER_OP_WRITE || op == SCHEDULER_OP_SEND, -1) < 0) {
+                return -1;
+            }
+        } else {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+}
+
+
+static PyObject *
+scheduler_read(Scheduler *self, PyObject *args, PyObject *kwargs, int op)
+{
+    static char *read_kwlist[] = {"fd", "n", "offset", NULL};
+    static char *recv_kwlist[] = {"sock", "n", "flags", NULL};
+
+    PyObject *fileobj, *buf;
+    Py_ssize_t n, r;
+    long long extra;
+    Fiber *current;
+    int fd;
+
+    extra = op == SCHEDULER_OP_READ ? -1 : 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, op == SCHEDULER_OP_READ ? "On|L:read" : "On|L:recv",
+                                     op == SCHEDULER_OP_READ ? read_kwlist : recv_kwlist, &fileobj, &n, &extra)) {
+        return NULL;
+    }
+    if ((fd = PyObject_AsFileDescriptor(fileobj)) < 0) {
+        return NULL;
+    }
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "n must be a positive integer or zero");
+        return NULL;
+    }
+
+    if (!(current = scheduler_check_current(self, op == SCHEDULER_OP_READ ? "read" : "recv"))) {
+        return NULL;
+    }
+
+    if (!(buf = PyBytes_FromStringAndSize(NULL, n))) {
+        return NULL;
+    }
+    if (op == SCHEDULER_OP_READ) {
+        r = scheduler_io(self, current, op, fd, buf, PyBytes_AS_STRING(buf), n, extra, 0);
+    } else {
+        r = scheduler_io(self, current, op, fd, buf, PyBytes_AS_STRING(buf), n, 0, (int)extra);
+    }
+    if (r < 0) {
+        Py_DECREF(buf);
+        return NULL;
+    }
+    if (r != n) {
+        _PyBytes_Resize(&buf, r);
+    }
+    return buf;
+}
+
+
+static PyObject *
+scheduler_write(Scheduler *self, PyObject *args, PyObject *kwargs, int op)
+{
+    static char *write_kwlist[] = {"fd", "data", "offset", NULL};
+    static char *send_kwlist[] = {"sock", "data", "flags", NULL};
+
+    PyObject *fileobj, *data;
+    Py_ssize_t r;
+    long long extra;
+    Fiber *current;
+    int fd;
+
+    extra = op == SCHEDULER_OP_WRITE ? -1 : 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, op == SCHEDULER_OP_WRITE ? "OO|L:write" : "OO|L:send",
+                                     op == SCHEDULER_OP_WRITE ? write_kwlist : send_kwlist, &fileobj, &data, &extra)) {
+        return NULL;
+    }
+    if ((fd = PyObject_AsFileDescriptor(fileobj)) < 0) {
+        return NULL;
+    }
+
+    if (!(current = scheduler_check_current(self, op == SCHEDULER_OP_WRITE ? "write" : "send"))) {
+        return NULL;
+    }
+
+    /* the kernel may read it after a cancelled Fiber returns, so it must not change */
+    if (PyBytes_CheckExact(data)) {
+        Py_INCREF(data);
+    } else if (!(data = PyBytes_FromObject(data))) {
+        return NULL;
+    }
+    if (op == SCHEDULER_OP_WRITE) {
+        r = scheduler_io(self, current, op, fd, data, PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data), extra, 0);
+    } else {
+        r = scheduler_io(self, current, op, fd, data, PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data), 0, (int)extra);
+    }
+    Py_DECREF(data);
+    if (r < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(r);
+}
+
+
+static PyObject *
+Scheduler_func_read(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    return scheduler_read(self, args, kwargs, SCHEDULER_OP_READ);
+}
+
+
+static PyObject *
+Scheduler_func_recv(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    return scheduler_read(self, args, kwargs, SCHEDULER_OP_RECV);
+}
+
+
+static PyObject *
+Scheduler_func_write(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    return scheduler_write(self, args, kwargs, SCHEDULER_OP_WRITE);
+}
+
+
+static PyObject *
+Scheduler_func_send(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    return scheduler_write(self, args, kwargs, SCHEDULER_OP_SEND);
+}
+
+
+static PyObject *
+Scheduler_func_accept(Scheduler *self, PyObject *fileobj)
+{
+    Py_ssize_t r;
+    Fiber *current;
+    int fd;
+
+    if ((fd = PyObject_AsFileDescriptor(fileobj)) < 0) {
+        return NULL;
+    }
+    if (!(current = scheduler_check_current(self, "accept"))) {
+        return NULL;
+    }
+    if ((r = scheduler_io(self, current, SCHEDULER_OP_ACCEPT, fd, NULL, NULL, 0, 0, 0)) < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(r);
+}
+
+
+static PyObject *
+Scheduler_func_fsync(Scheduler *self, PyObject *fileobj)
+{
+    Fiber *current;
+    int fd;
+
+    if ((fd = PyObject_AsFileDescriptor(fileobj)) < 0) {
+        return NULL;
+    }
+    if (!(current = scheduler_check_current(self, "fsync"))) {
+        return NULL;
+    }
+    if (scheduler_io(self, current, SCHEDULER_OP_FSYNC, fd, NULL, NULL, 0, 0, 0) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+#endif
+
+
+static PyObject *
+Scheduler_func_wait_readable(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    return scheduler_wait_fd(self, args, kwargs, False);
+}
+
+
+static PyObject *
+Scheduler_func_wait_writable(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    return scheduler_wait_fd(self, args, kwargs, True);
+}
+
+
+static PyObject *
+Scheduler_func_sleep(Scheduler *self, PyObject *args)
+{
+    FiberWaiter *w;
+    Fiber *current;
+    double seconds;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "d:sleep", &seconds)) {
+        return NULL;
+    }
+
+    if (!(current = scheduler_check_current(self, "sleep"))) {
+        return NULL;
+    }
+
+    if (!(w = waiter_new(current))) {
+        return NULL;
+    }
+    if (scheduler_timer_add(self, w, fibers_now() + Py_MAX(seconds, 0)) < 0) {
+        r = -1;
+    } else {
+        self->io_waiting++;
+        r = waiter_block(current, w);
+        self->io_waiting--;
+    }
+    scheduler_timer_remove(self, w);
+    waiter_release(w);
+
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+Scheduler_func_spawn(Scheduler *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *target, *t_args, *t_kwargs;
+    Fiber *fiber;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "spawn() missing required argument 'target'");
+        return NULL;
+    }
+    target = PyTuple_GET_ITEM(args, 0);
+
+    t_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (!t_args) {
+        return NULL;
+    }
+    t_kwargs = NULL;
+    if (kwargs && PyDict_GET_SIZE(kwargs)) {
+        /* don't share the caller's dictionary */
+        t_kwargs = PyDict_Copy(kwargs);
+        if (!t_kwargs) {
+            Py_DECREF(t_args);
+            return NULL;
+        }
+    }
+
+    fiber = fiber_new(target, t_args, t_kwargs);
+    Py_DECREF(t_args);
+    Py_XDECREF(t_kwargs);
+    if (!fiber) {
+        return NULL;
+    }
+
+    if (scheduler_adopt(self, fiber) < 0 || scheduler_push(self, fiber) < 0) {
+        Py_DECREF(fiber);
+        return NULL;
+    }
+    return (PyObject *)fiber;
+}
+
+
+static PyObject *
+Scheduler_func_yield(Scheduler *self)
+{
+    Fiber *current, *next;
+
+    if (!(current = scheduler_check_current(self, "yield_"))) {
+        return NULL;
+    }
+
+    scheduler_tick(self);
+    if (self->ready_len == 0) {
+        /* nothing else to run */
+        Py_RETURN_NONE;
+    }
+    if (!current->ready && scheduler_push(self, current) < 0) {
+        return NULL;
+    }
+    next = scheduler_next(self, current, current);
+    if (next == current) {
+        Py_DECREF(next);
+        Py_RETURN_NONE;
+    }
+    return scheduler_switch(self, next);
+}
+
+
+/* Switch to the next ready Fiber, without making the current one ready */
+static PyObject *
+scheduler_park(Scheduler *self, Fiber *current)
+{
+    Fiber *next;
+
+    scheduler_tick(self);
+    next = scheduler_next(self, current, NULL);
+    if (next == current) {
+        /* it was unparked before it parked */
+        Py_DECREF(next);
+        Py_RETURN_NONE;
+    }
+    if (!next) {
+        if (!self->hub) {
+            PyErr_SetString(get_state()->FiberError, "Scheduler is not running");
+            return NULL;
+        }
+        next = self->hub;
+        Py_INCREF(next);
+    }
+    return scheduler_switch(self, next);
+}
+
+
+static PyObject *
+Scheduler_func_park(Scheduler *self)
+{
+    Fiber *current;
+
+    if (!(current = scheduler_check_current(self, "park"))) {
+        return NULL;
+    }
+    return scheduler_park(self, current);
+}
+
+
+static PyObject *
+Scheduler_func_unpark(Scheduler *self, PyObject *args)
+{
+    Fiber *fiber;
+
+    if (!PyArg_ParseTuple(args, "O!:unpark", get_state()->FiberType, &fiber)) {
+        return NULL;
+    }
+
+    if (fiber->stacklet_h == EMPTY_STACKLET_HANDLE) {
+        PyErr_SetString(get_state()->FiberError, "Fiber has ended");
+        return NULL;
+    }
+
+    if (scheduler_adopt(self, fiber) < 0) {
+        return NULL;
+    }
+    if (!fiber->ready && scheduler_push(self, fiber) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+Scheduler_func_run(Scheduler *self)
+{
+    Fiber *current, *next;
+    PyObject *result;
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+
+    if (self->hub) {
+        PyErr_SetString(get_state()->FiberError, "Scheduler is already running");
+        return NULL;
+    }
+
+    if (current->thread_h != self->thread_h) {
+        PyErr_SetString(get_state()->FiberError, "cannot run a Scheduler on a different thread");
+        return NULL;
+    }
+
+    Py_INCREF(current);
+    self->hub = current;
+
+    result = Py_None;
+    Py_INCREF(result);
+    for (;;) {
+        next = scheduler_next(self, current, NULL);
+        if (!next) {
+            if (!self->io_waiting) {
+                break;
+            }
+            /* nothing to run, wait for I/O and timers */
+            if (scheduler_poll(self, True) < 0) {
+                Py_DECREF(result);
+                result = NULL;
+                break;
+            }
+            continue;
+        }
+        if (next == current) {
+            Py_DECREF(next);
+            continue;
+        }
+        /* we get here when a Fiber ends (result is its return value) or when
+         * nothing is ready anymore */
+        Py_DECREF(result);
+        result = scheduler_switch(self, next);
+        if (!result) {
+            break;
+        }
+    }
+
+    self->hub = NULL;
+    Py_DECREF(current);
+
+    if (result) {
+        Py_DECREF(result);
+        Py_RETURN_NONE;
+    }
+    return NULL;
+}
+
+
+static PyObject *
+Scheduler_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"io_uring", "stack_order", NULL};
+
+    PyObject *io_uring = Py_None;
+    PyObject *stack_order = Py_False;
+    Scheduler *self;
+    Fiber *current;
+    int use_uring = -1;
+    int by_stack;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO:Scheduler", kwlist, &io_uring, &stack_order)) {
+        return NULL;
+    }
+    if (io_uring != Py_None && (use_uring = PyObject_IsTrue(io_uring)) < 0) {
+        return NULL;
+    }
+    if ((by_stack = PyObject_IsTrue(stack_order)) < 0) {
+        return NULL;
+    }
+#ifdef FIBERS_IO_URING
+    if (use_uring > 0 && !uring_probe()) {
+#else
+    if (use_uring > 0) {
+#endif
+        PyErr_SetString(get_state()->FiberError, "io_uring is not available");
+        return NULL;
+    }
+
+    if (!(current = get_current())) {
+        return NULL;
+    }
+
+    self = (Scheduler *)PyType_GenericNew(type, args, kwargs);
+    if (!self) {
+        return NULL;
+    }
+    self->weakreflist = NULL;
+    self->thread_h = current->thread_h;
+    self->hub = NULL;
+    self->ready = NULL;
+    self->ready_head = 0;
+    self->ready_len = 0;
+    self->ready_size = 0;
+    self->epfd = -1;
+    self->fds = NULL;
+    self->fds_size = 0;
+    self->timers = NULL;
+    self->timers_len = 0;
+    self->timers_size = 0;
+    self->timers_seq = 0;
+    self->io_waiting = 0;
+    self->fds_waiting = 0;
+    self->io_tick = 0;
+    self->io_uring = use_uring;
+    self->ring = NULL;
+    self->stack_order = by_stack ? True : False;
+    self->stack_picks = 0;
+    return (PyObject *)self;
+}
+
+
+static int
+Scheduler_tp_traverse(Scheduler *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->ready_len; i++) {
+        Py_VISIT(self->ready[(self->ready_head + i) & (self->ready_size - 1)]);
+    }
+    Py_VISIT(self->hub);
+    MY_HEAPTYPE_VISIT(self);
+
+    return 0;
+}
+
+
+static int
+Scheduler_tp_clear(Scheduler *self)
+{
+    FiberWaiter *w;
+    Fiber *fiber;
+    int fd;
+
+    while ((fiber = scheduler_pop(self))) {
+        Py_DECREF(fiber);
+    }
+    Py_CLEAR(self->hub);
+    /* Fibers waiting for I/O or timers won't be woken up anymore */
+    while (self->timers_len) {
+        scheduler_timer_remove(self, self->timers[0].w);
+    }
+    for (fd = 0; fd < self->fds_size; fd++) {
+        if ((w = self->fds[fd].reader)) {
+            self->fds[fd].reader = NULL;
+            waiter_release(w);
+        }
+        if ((w = self->fds[fd].writer)) {
+            self->fds[fd].writer = NULL;
+            waiter_release(w);
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+Scheduler_tp_dealloc(Scheduler *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject *)self);
+    }
+    Scheduler_tp_clear(self);
+    PyMem_Free(self->ready);
+    PyMem_Free(self->fds);
+    PyMem_Free(self->timers);
+#ifdef FIBERS_IO_URING
+    if (self->ring) {
+        /* the waiters of operations still in flight are leaked, their
+         * buffers may be written to until the kernel is done with them */
+        uring_free(self->ring);
+    }
+#endif
+#ifdef __linux__
+    if (self->epfd >= 0) {
+        close(self->epfd);
+    }
+#endif
+    tp->tp_free((PyObject *)self);
+    MY_HEAPTYPE_DECREF(tp);
+}
+
+
+static PyObject *
+Scheduler_ready_get(Scheduler *self, void *c)
+{
+    UNUSED_ARG(c);
+
+    return PyLong_FromSsize_t(self->ready_len);
+}
+
+
+static PyMethodDef
+Scheduler_tp_methods[] = {
+    { "spawn", (PyCFunction)Scheduler_func_spawn, METH_VARARGS|METH_KEYWORDS, "Create a Fiber which runs the given callable and make it ready to run" },
+    { "yield_", (PyCFunction)Scheduler_func_yield, METH_NOARGS, "Switch to the next ready Fiber, the current one stays ready" },
+    { "park", (PyCFunction)Scheduler_func_park, METH_NOARGS, "Switch to the next ready Fiber, the current one won't run again until unparked" },
+    { "unpark", (PyCFunction)Scheduler_func_unpark, METH_VARARGS, "Make the given Fiber ready to run" },
+    { "run", (PyCFunction)Scheduler_func_run, METH_NOARGS, "Run ready Fibers until there are none left, nor waiting for I/O or timers" },
+    { "wait_readable", (PyCFunction)Scheduler_func_wait_readable, METH_VARARGS|METH_KEYWORDS, "Park the current Fiber until the file descriptor is readable or the timeout expires" },
+    { "wait_writable", (PyCFunction)Scheduler_func_wait_writable, METH_VARARGS|METH_KEYWORDS, "Park the current Fiber until the file descriptor is writable or the timeout expires" },
+    { "sleep", (PyCFunction)Scheduler_func_sleep, METH_VARARGS, "Park the current Fiber for the given number of seconds" },
+#ifndef _WIN32
+    { "read", (PyCFunction)Scheduler_func_read, METH_VARARGS|METH_KEYWORDS, "Read up to n bytes from the file descriptor" },
+    { "write", (PyCFunction)Scheduler_func_write, METH_VARARGS|METH_KEYWORDS, "Write data to the file descriptor, returns the number of bytes written" },
+    { "recv", (PyCFunction)Scheduler_func_recv, METH_VARARGS|METH_KEYWORDS, "Receive up to n bytes from the socket" },
+    { "send", (PyCFunction)Scheduler_func_send, METH_VARARGS|METH_KEYWORDS, "Send data on the socket, returns the number of bytes sent" },
+    { "accept", (PyCFunction)Scheduler_func_accept, METH_O, "Accept a connection on the socket, returns its file descriptor" },
+    { "fsync", (PyCFunction)Scheduler_func_fsync, METH_O, "Flush the file descriptor to disk" },
+#endif
+    { NULL }
+};
+
+
+static PyObject *
+Scheduler_io_uring_get(Scheduler *self, void *c)
+{
+    UNUSED_ARG(c);
+    return PyBool_FromLong(scheduler_use_uring(self));
+}
+
+
+static PyObject *
+Scheduler_stack_order_get(Scheduler *self, void *c)
+{
+    UNUSED_ARG(c);
+    return PyBool_FromLong(self->stack_order);
+}
+
+
+static PyGetSetDef Scheduler_tp_getsets[] = {
+    {"ready", (getter)Scheduler_ready_get, NULL, "Number of Fibers ready to run", NULL},
+    {"io_uring", (getter)Scheduler_io_uring_get, NULL, "Whether I/O operations use io_uring", NULL},
+    {"stack_order", (getter)Scheduler_stack_order_get, NULL, "Whether the ready Fibers which are the cheapest to switch to run first", NULL},
+    {NULL}
+};
+
+
+static PyMemberDef Scheduler_tp_members[] = {
+#if PY_VERSION_HEX >= 0x03090000
+    {"__weaklistoffset__", T_PYSSIZET, offsetof(Scheduler, weakreflist), READONLY},
+#endif
+    {NULL}
+};
+
+
+static PyType_Slot Scheduler_tp_slots[] = {
+    {Py_tp_dealloc, Scheduler_tp_dealloc},
+    {Py_tp_traverse, Scheduler_tp_traverse},
+    {Py_tp_clear, Scheduler_tp_clear},
+    {Py_tp_methods, Scheduler_tp_methods},
+    {Py_tp_members, Scheduler_tp_members},
+    {Py_tp_getset, Scheduler_tp_getsets},
+    {Py_tp_new, Scheduler_tp_new},
+    {0, NULL},
+};
+
+
+static PyType_Spec Scheduler_tp_spec = {
+    "fibers._cfibers.Scheduler",
+    sizeof(Scheduler),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    Scheduler_tp_slots
+};
@@ -5,9 +5,21 @@
 #include "stacklet.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#  if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
+#  ifndef MAP_STACK
+#    define MAP_STACK 0
+#  endif
+#endif
+
 /************************************************************
  * platform specific code
  */
@@ -28,10 +40,55 @@
 
 /* #define DEBUG_DUMP */
 
+/* Other threads may read a few words of a thread while it runs: its
+ * statistics and what was posted to it, see stacklet_post().  Those are
+ * written with relaxed atomic stores, and the list of posted items is
+ * protected by a lock which is only held for a few instructions.
+ */
+#ifdef _MSC_VER
+#  include <intrin.h>
+typedef long g_lock_t;
+#  define G_LOAD(x)        (*(volatile size_t *)&(x))
+#  define G_STORE(x, v)    (*(volatile size_t *)&(x) = (v))
+#  define G_LOAD_PTR(x)    (*(void * volatile *)&(x))
+#  define G_STORE_PTR(x, v) (*(void * volatile *)&(x) = (v))
+#  define G_LOCK(l)        while (_InterlockedExchange(&(l), 1) != 0) {}
+#  define G_UNLOCK(l)      _InterlockedExchange(&(l), 0)
+#else
+typedef int g_lock_t;
+#  define G_LOAD(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#  define G_STORE(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#  define G_LOAD_PTR(x)    __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#  define G_STORE_PTR(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#  define G_LOCK(l)                                                    \
+    while (__atomic_exchange_n(&(l), 1, __ATOMIC_ACQUIRE) != 0) {}
+#  define G_UNLOCK(l)      __atomic_store_n(&(l), 0, __ATOMIC_RELEASE)
+#endif
+
+/* Only the thread itself changes its statistics, so it can read them
+ * without an atomic load. */
+#ifdef STACKLET_NO_STATS
+#  define STAT_ADD(thrd, field, n)  ((void)0)
+#  define STAT_MAX(thrd, field, n)  ((void)0)
+#else
+#  define STAT_ADD(thrd, field, n)                              \
+    G_STORE((thrd)->g_stats.field, (thrd)->g_stats.field + (n))
+#  define STAT_MAX(thrd, field, n)                              \
+    do {                                                        \
+        if ((thrd)->g_stats.field < (size_t)(n))                \
+            G_STORE((thrd)->g_stats.field, (size_t)(n));        \
+    } while (0)
+#endif
+
 #ifdef DEBUG_DUMP
 #include <stdio.h>
 #endif
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define STACKLET_STREAM
+#  include <immintrin.h>
+#endif
+
 /************************************************************/
 
 struct stacklet_s {
@@ -55,16 +112,116 @@ struct stacklet_s {
     struct stacklet_s *stack_prev;
 
     stacklet_thread_handle stack_thrd;  /* the thread where the stacklet is */
+
+    /* The separate stack where the stacklet is, or NULL if it lives in
+     * the C stack of the thread.
+     */
+    struct stacklet_stack_s *stack_seg;
+
+    /* If the saved stack was packed by stacklet_pack(), the size of the
+     * packed data which follows this struct instead, otherwise 0.
+     */
+    ptrdiff_t stack_packed;
+
+    /* The shared base the packed data refers to, or NULL.
+     */
+    struct stacklet_base_s *packed_base;
+
+    /* How much of the buffer, from the start, already holds a copy of the
+     * stack as it was when it was last restored from this buffer: saving
+     * that part only needs to copy what changed since, see g_save().
+     */
+    ptrdiff_t stack_imaged;
 };
 
+/* A copy of a saved stack, which stacks with the same 'stack_stop' are
+ * packed against: the fibers which are started from the same place and
+ * wait in the same place have mostly identical stacks, then only the
+ * words which differ are stored.  The copy follows this struct.
+ */
+struct stacklet_base_s {
+    char *base_stop;
+    size_t base_size;
+    long refcount;                    /* packed stacklets, and g_bases */
+    unsigned long last_used;
+};
+
+/* A separate stack.  The structure itself is stored at the very top of
+ * the memory region, just above the area used as stack.  Each separate
+ * stack has its own chained list of stacklets with a partially unsaved
+ * stack, as stacklets started with stacklet_new() while running on it
+ * share that memory the same way they share the thread's C stack.
+ */
+struct stacklet_stack_s {
+    char *stack_base;                 /* start of the mapping (guard page) */
+    size_t stack_mapsize;             /* size of the mapping */
+    struct stacklet_s *g_stack_chain_head;
+    long refcount;                    /* unfinished run()s on this stack */
+};
+
+/* Buffers are pooled in size classes of powers of two, from
+ * STACKLET_POOL_MIN (256 bytes) to 64KB.  Bigger ones are not pooled.
+ */
+#define STACKLET_POOL_MIN      256
+#define STACKLET_POOL_CLASSES  9
+
+/* Shared bases kept by a thread to pack new stacks against.
+ */
+#define STACKLET_BASES         4
+
 struct stacklet_thread_s {
     struct stacklet_s *g_stack_chain_head;  /* NULL <=> running main */
     char *g_current_stack_stop;
     char *g_current_stack_marker;
     struct stacklet_s *g_source;
     struct stacklet_s *g_target;
+    struct stacklet_stack_s *g_current_seg; /* NULL <=> on the C stack */
+    struct stacklet_stack_s *g_new_seg;     /* to start in g_stack_entry */
+    struct stacklet_stack_s *g_dead_seg;    /* to release once we left it */
+    stacklet_run_fn g_run;
+    void *g_run_arg;
+
+    /* free buffers, chained through 'stack_prev' */
+    struct stacklet_s *g_pool[STACKLET_POOL_CLASSES];
+    size_t g_pool_limit;
+    size_t g_pool_retained;
+    size_t g_pool_hits;
+    size_t g_pool_misses;
+
+    /* buffers given to stacklets, and the limit for them (0: none) */
+    size_t g_in_use;
+    size_t g_budget;
+
+    /* the buffer the running stacklet was restored from, kept for when it
+       is suspended again, see g_allocate_source_stacklet() */
+    struct stacklet_s *g_kept;
+
+    /* the bases for stacklet_pack(), and a 'stack_stop' which was seen
+       without a good base, to get one the next time it's seen */
+    struct stacklet_base_s *g_bases[STACKLET_BASES];
+    char *g_base_pending;
+    unsigned long g_base_clock;
+
+    /* the structure is kept alive until the last stacklet is freed, so
+       that stacklet_destroy() can always update it */
+    long g_nstacklets;
+    int g_deleted;
+
+    /* what other threads posted, see stacklet_post(); once 'g_closed'
+       nothing more can be posted, and the stacklets are destroyed with
+       the lock held, as other threads may destroy them too */
+    void **g_posted;
+    int g_closed;
+    g_lock_t g_lock;
+
+#ifndef STACKLET_NO_STATS
+    struct stacklet_stats g_stats;
+#endif
 };
 
+static void *(*g_malloc)(size_t) = malloc;
+static void (*g_free)(void *) = free;
+
 #define _check(x)  do { if (!(x)) _check_failed(#x); } while (0)
 
 static void _check_failed(const char *check)
@@ -78,8 +235,212 @@ static void check_valid(struct stacklet_s *g)
     _check(g->stack_saved >= 0);
 }
 
+/* The head of the chained list of stacklets with a partially unsaved
+ * stack, for the given separate stack or for the thread's C stack.
+ */
+static struct stacklet_s **g_chain_head(struct stacklet_thread_s *thrd,
+                                        struct stacklet_stack_s *seg)
+{
+    return seg != NULL ? &seg->g_stack_chain_head : &thrd->g_stack_chain_head;
+}
+
+/* Return the size class for a buffer of 'size' bytes, which is
+ * STACKLET_POOL_CLASSES if it's too big to be pooled.
+ */
+static int g_pool_class(size_t size)
+{
+    int cls = 0;
+    size_t class_size = STACKLET_POOL_MIN;
+    while (class_size < size && cls < STACKLET_POOL_CLASSES) {
+        class_size <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+static size_t g_buffer_size(struct stacklet_s *g)
+{
+    if (g->stack_packed)
+        return sizeof(struct stacklet_s) + g->stack_packed;
+    return sizeof(struct stacklet_s) + (g->stack_stop - g->stack_start);
+}
+
+/* What g_alloc() really allocates for 'size' bytes.
+ */
+static size_t g_alloc_size(size_t size)
+{
+    int cls = g_pool_class(size);
+    if (cls < STACKLET_POOL_CLASSES)
+        return STACKLET_POOL_MIN << cls;
+    return size;
+}
+
+static struct stacklet_s *g_alloc(struct stacklet_thread_s *thrd,
+                                  size_t size)
+{
+    int cls = g_pool_class(size);
+    struct stacklet_s *g;
+    size = g_alloc_size(size);
+    if (thrd->g_budget != 0 && thrd->g_in_use + size > thrd->g_budget)
+        return NULL;
+    if (cls < STACKLET_POOL_CLASSES && thrd->g_pool[cls] != NULL) {
+        g = thrd->g_pool[cls];
+        thrd->g_pool[cls] = g->stack_prev;
+        thrd->g_pool_retained -= size;
+        thrd->g_pool_hits++;
+    }
+    else {
+        g = g_malloc(size);
+        if (g == NULL)
+            return NULL;
+        thrd->g_pool_misses++;
+        STAT_ADD(thrd, mallocs, 1);
+    }
+    thrd->g_in_use += size;
+    return g;
+}
+
+/* Give back the buffer of 'g' to the pool of the current thread, or to
+ * the allocator if the pool is full.
+ */
+static void g_pool_put(struct stacklet_thread_s *thrd, struct stacklet_s *g)
+{
+    int cls = g_pool_class(g_buffer_size(g));
+    size_t class_size = STACKLET_POOL_MIN << cls;
+    if (cls < STACKLET_POOL_CLASSES &&
+            thrd->g_pool_retained + class_size <= thrd->g_pool_limit) {
+        g->stack_prev = thrd->g_pool[cls];
+        thrd->g_pool[cls] = g;
+        thrd->g_pool_retained += class_size;
+        return;
+    }
+    g_free(g);
+}
+
+static void g_release(struct stacklet_thread_s *thrd, struct stacklet_s *g)
+{
+    thrd->g_in_use -= g_alloc_size(g_buffer_size(g));
+    g_pool_put(thrd, g);
+}
+
+/* Give back the buffer kept by g_restore_state(), if any.
+ */
+static void g_drop_kept(struct stacklet_thread_s *thrd)
+{
+    if (thrd->g_kept != NULL) {
+        g_pool_put(thrd, thrd->g_kept);
+        thrd->g_kept = NULL;
+    }
+}
+
+/* Free pooled buffers until at most 'limit' bytes are retained.
+ */
+static void g_pool_trim(struct stacklet_thread_s *thrd, size_t limit)
+{
+    int cls;
+    for (cls = STACKLET_POOL_CLASSES - 1; cls >= 0; cls--) {
+        while (thrd->g_pool_retained > limit && thrd->g_pool[cls] != NULL) {
+            struct stacklet_s *g = thrd->g_pool[cls];
+            thrd->g_pool[cls] = g->stack_prev;
+            thrd->g_pool_retained -= STACKLET_POOL_MIN << cls;
+            g_free(g);
+        }
+    }
+}
+
 /***************************************************************/
 
+/* Copies of saved stacks to the heap which are big enough use
+ * non-temporal stores: the copy is not read until the stacklet is
+ * resumed, so it shouldn't push the data of the code which runs
+ * meanwhile out of the caches.  Copies back to the stack use memcpy(),
+ * the stack is used right away.
+ */
+static size_t g_stream_threshold = STACKLET_STREAM_THRESHOLD;
+
+#ifdef STACKLET_STREAM
+static void g_stream_sse2(char *dst, const char *src, size_t n)
+{
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void g_stream_avx2(char *dst, const char *src, size_t n)
+{
+    size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    for (; n >= 128; n -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)src);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)dst, a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + 96), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, n);
+}
+
+static void (*g_stream)(char *, const char *, size_t) = NULL;
+static const char *g_stream_name = NULL;
+
+/* Pick the kernel for the CPU we run on.
+ */
+static void g_stream_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_stream = g_stream_avx2;
+        g_stream_name = "avx2";
+    }
+    else {
+        g_stream = g_stream_sse2;
+        g_stream_name = "sse2";
+    }
+}
+#endif
+
+/* Copy 'n' bytes of the stack of 'g' to its buffer.
+ */
+static void g_copy_out(struct stacklet_s *g, char *dst, const char *src,
+                       size_t n)
+{
+#ifdef STACKLET_STREAM
+    if (g_stream_threshold != 0 && n >= g_stream_threshold) {
+        g_stream(dst, src, n);
+        STAT_ADD(g->stack_thrd, streamed_bytes, n);
+        return;
+    }
+#endif
+    (void)g;
+    memcpy(dst, src, n);
+}
+
+/* The granularity at which g_save() looks for changes.
+ */
+#define STACKLET_SAVE_BLOCK  256
+
 static void g_save(struct stacklet_s* g, char* stop
 #ifdef DEBUG_DUMP
                    , int overwrite_stack_for_debug
@@ -111,7 +472,22 @@ static void g_save(struct stacklet_s* g, char* stop
     if (sz2 > sz1) {
         char *c = (char *)(g + 1);
 #if STACK_DIRECTION == 0
-        memcpy(c+sz1, g->stack_start+sz1, sz2-sz1);
+        ptrdiff_t sz = sz1;
+        if (g->stack_imaged > sz1) {
+            /* copy only the blocks which changed since it was restored */
+            ptrdiff_t end = g->stack_imaged < sz2 ? g->stack_imaged : sz2;
+            ptrdiff_t n, copied = 0;
+            for (; sz < end; sz += n) {
+                n = end - sz < STACKLET_SAVE_BLOCK ? end - sz : STACKLET_SAVE_BLOCK;
+                if (memcmp(c+sz, g->stack_start+sz, n) != 0) {
+                    memcpy(c+sz, g->stack_start+sz, n);
+                    copied += n;
+                }
+            }
+            STAT_ADD(g->stack_thrd, unchanged_bytes, (end - sz1) - copied);
+            STAT_ADD(g->stack_thrd, saved_bytes, copied - (end - sz1));
+        }
+        g_copy_out(g, c+sz, g->stack_start+sz, sz2-sz);
 #  ifdef DEBUG_DUMP
         if (overwrite_stack_for_debug)
           memset(g->stack_start+sz1, 0xdb, sz2-sz1);
@@ -120,6 +496,9 @@ static void g_save(struct stacklet_s* g, char* stop
         xxx;
 #endif
         g->stack_saved = sz2;
+        STAT_ADD(g->stack_thrd, saved_bytes, sz2 - sz1);
+        STAT_ADD(g->stack_thrd, current_saved, sz2 - sz1);
+        STAT_MAX(g->stack_thrd, peak_saved, g->stack_thrd->g_stats.current_saved);
     }
 }
 
@@ -131,31 +510,332 @@ static void g_save(struct stacklet_s* g, char* stop
 static int g_allocate_source_stacklet(void *old_stack_pointer,
                                       struct stacklet_thread_s *thrd)
 {
-    struct stacklet_s *stacklet;
+    struct stacklet_s *stacklet = thrd->g_kept;
     ptrdiff_t stack_size = (thrd->g_current_stack_stop -
                             (char *)old_stack_pointer);
+    size_t size = sizeof(struct stacklet_s) + stack_size;
 
-    thrd->g_source = malloc(sizeof(struct stacklet_s) + stack_size);
-    if (thrd->g_source == NULL)
-        return -1;
+    /* A stacklet suspended at the same place as it was resumed from can
+       take back its buffer, which mostly holds the right bytes already.
+       Anything else takes another one. */
+    if (stacklet != NULL && stacklet->stack_start == old_stack_pointer &&
+            stacklet->stack_stop == thrd->g_current_stack_stop &&
+            stacklet->stack_seg == thrd->g_current_seg &&
+            (thrd->g_budget == 0 ||
+             thrd->g_in_use + g_alloc_size(size) <= thrd->g_budget)) {
+        thrd->g_kept = NULL;
+        thrd->g_in_use += g_alloc_size(size);
+        stacklet->stack_imaged = stack_size;
+    }
+    else {
+        g_drop_kept(thrd);
+        stacklet = g_alloc(thrd, size);
+        if (stacklet == NULL) {
+            thrd->g_source = NULL;
+            return -1;
+        }
+        stacklet->stack_imaged = 0;
+    }
 
-    stacklet = thrd->g_source;
+    thrd->g_source = stacklet;
     stacklet->stack_start = old_stack_pointer;
     stacklet->stack_stop  = thrd->g_current_stack_stop;
     stacklet->stack_saved = 0;
-    stacklet->stack_prev  = thrd->g_stack_chain_head;
+    stacklet->stack_packed = 0;
+    stacklet->packed_base = NULL;
+    stacklet->stack_prev  = *g_chain_head(thrd, thrd->g_current_seg);
     stacklet->stack_thrd  = thrd;
-    thrd->g_stack_chain_head = stacklet;
+    stacklet->stack_seg   = thrd->g_current_seg;
+    *g_chain_head(thrd, thrd->g_current_seg) = stacklet;
+    thrd->g_nstacklets++;
     return 0;
 }
 
-/* Save more of the C stack away, up to 'target_stop'.
+/* Save what is left of 'target' in the C stack, and remove it from the
+ * chained list: it no longer depends on the C stack.
+ */
+static void g_detach(struct stacklet_thread_s *thrd, struct stacklet_s *target)
+{
+    struct stacklet_s **pp;
+    g_save(target, target->stack_stop
+#ifdef DEBUG_DUMP
+           , 0
+#endif
+           );
+    for (pp = &thrd->g_stack_chain_head; *pp != NULL; pp = &(*pp)->stack_prev) {
+        check_valid(*pp);
+        if (*pp == target) {
+            *pp = target->stack_prev;
+            break;
+        }
+    }
+    target->stack_prev = NULL;
+}
+
+/* Packed stacks hold one tag byte per machine word, followed by the bytes
+ * it needs.  Most of a saved stack is pointers into a few regions (the
+ * stack itself, the heap, the code) and small integers: a word whose bits
+ * above PACK_LOW_BITS were seen recently is a PACK_HIT tag naming the slot
+ * of a small table of those high parts, plus the low bytes.  When packing
+ * against a base, a PACK_SAME tag stands for a run of words equal to the
+ * base at the same addresses.  Any other word is a tag with its number of
+ * significant bytes, which follow in little endian order and update the
+ * table.  The bytes at the end which don't make a whole word are copied
+ * as they are.  'dst' can be NULL to only get the size of the packed data.
+ * 'ref', if not NULL, holds the words of the base from the word 'first'.
+ */
+#define PACK_LOW_BITS  24
+#define PACK_SLOTS     64
+#define PACK_HIT       0x80
+#define PACK_SAME      0x40
+#define PACK_MAX_SAME  0x3f
+
+typedef size_t pack_word_t;
+
+#define PACK_SLOT(high)  ((unsigned)(((high) * 0x9E3779B1u) >> 8) % PACK_SLOTS)
+
+static size_t g_pack(char *dst, const char *src, size_t len,
+                     const char *ref, size_t first)
+{
+    size_t nwords = len / sizeof(pack_word_t);
+    pack_word_t table[PACK_SLOTS] = {0};
+    unsigned char *out = (unsigned char *)dst;
+    size_t i, j, n, size = 0;
+    pack_word_t w, high;
+    unsigned slot;
+
+    for (i = 0; i < nwords; i++) {
+        if (ref != NULL && i >= first) {
+            for (j = i; j < nwords && j - i < PACK_MAX_SAME; j++) {
+                if (memcmp(src + j * sizeof(pack_word_t),
+                           ref + (j - first) * sizeof(pack_word_t),
+                           sizeof(pack_word_t)) != 0)
+                    break;
+            }
+            if (j > i) {
+                if (out != NULL)
+                    out[size] = (unsigned char)(PACK_SAME | (j - i));
+                size++;
+                i = j - 1;
+                continue;
+            }
+        }
+        memcpy(&w, src + i * sizeof(pack_word_t), sizeof(pack_word_t));
+        high = w >> PACK_LOW_BITS;
+        slot = PACK_SLOT(high);
+        if (high != 0 && table[slot] == high) {
+            if (out != NULL) {
+                out[size] = PACK_HIT | slot;
+                for (n = 0; n < PACK_LOW_BITS / 8; n++)
+                    out[size + 1 + n] = (unsigned char)(w >> (8 * n));
+            }
+            size += 1 + PACK_LOW_BITS / 8;
+            continue;
+        }
+        for (n = 0; n < sizeof(pack_word_t) && (w >> (8 * n)) != 0; n++) {
+            if (out != NULL)
+                out[size + 1 + n] = (unsigned char)(w >> (8 * n));
+        }
+        if (out != NULL)
+            out[size] = (unsigned char)n;
+        size += 1 + n;
+        if (high != 0)
+            table[slot] = high;
+    }
+    if (out != NULL)
+        memcpy(out + size, src + nwords * sizeof(pack_word_t),
+               len % sizeof(pack_word_t));
+    return size + len % sizeof(pack_word_t);
+}
+
+static void g_unpack(char *dst, const char *src, size_t len,
+                     const char *ref, size_t first)
+{
+    size_t nwords = len / sizeof(pack_word_t);
+    const unsigned char *in = (const unsigned char *)src;
+    pack_word_t table[PACK_SLOTS] = {0};
+    size_t i, n;
+    pack_word_t w, high;
+    unsigned tag;
+
+    for (i = 0; i < nwords; i++) {
+        tag = *in++;
+        w = 0;
+        if (tag & PACK_HIT) {
+            for (n = 0; n < PACK_LOW_BITS / 8; n++)
+                w |= (pack_word_t)in[n] << (8 * n);
+            in += PACK_LOW_BITS / 8;
+            w |= table[tag & ~PACK_HIT] << PACK_LOW_BITS;
+        }
+        else if (tag & PACK_SAME) {
+            n = (tag & PACK_MAX_SAME) * sizeof(pack_word_t);
+            memcpy(dst + i * sizeof(pack_word_t),
+                   ref + (i - first) * sizeof(pack_word_t), n);
+            i += (tag & PACK_MAX_SAME) - 1;
+            continue;
+        }
+        else {
+            for (n = 0; n < tag; n++)
+                w |= (pack_word_t)in[n] << (8 * n);
+            in += tag;
+            high = w >> PACK_LOW_BITS;
+            if (high != 0)
+                table[PACK_SLOT(high)] = high;
+        }
+        memcpy(dst + i * sizeof(pack_word_t), &w, sizeof(pack_word_t));
+    }
+    memcpy(dst + nwords * sizeof(pack_word_t), in, len % sizeof(pack_word_t));
+}
+
+/* The words of 'base' at the addresses of the stack of 'g', from the word
+ * '*first' of it on, or NULL if they don't overlap.
+ */
+static const char *g_base_words(struct stacklet_s *g,
+                                struct stacklet_base_s *base, size_t *first)
+{
+    char *lo;
+    if (base == NULL || base->base_stop != g->stack_stop)
+        return NULL;
+    lo = base->base_stop - base->base_size;
+    *first = 0;
+    if (lo > g->stack_start)
+        *first = (lo - g->stack_start + sizeof(pack_word_t) - 1) /
+                 sizeof(pack_word_t);
+    if (*first >= (size_t)g->stack_saved / sizeof(pack_word_t))
+        return NULL;
+    return (char *)(base + 1) +
+           (g->stack_start + *first * sizeof(pack_word_t) - lo);
+}
+
+/* Pack the saved stack of 'g' against 'base', which can be NULL.
+ */
+static size_t g_pack_stacklet(char *dst, struct stacklet_s *g,
+                              struct stacklet_base_s *base)
+{
+    size_t first = 0;
+    const char *ref = g_base_words(g, base, &first);
+    return g_pack(dst, (char *)(g+1), g->stack_saved, ref, first);
+}
+
+/* Unpack the saved stack of the packed 'g' to 'dst'.
+ */
+static void g_unpack_stacklet(char *dst, struct stacklet_s *g)
+{
+    size_t first = 0;
+    const char *ref = g_base_words(g, g->packed_base, &first);
+    g_unpack(dst, (char *)(g+1), g->stack_saved, ref, first);
+}
+
+static void g_base_decref(struct stacklet_thread_s *thrd,
+                          struct stacklet_base_s *base)
+{
+    if (--base->refcount > 0)
+        return;
+    thrd->g_in_use -= sizeof(struct stacklet_base_s) + base->base_size;
+    STAT_ADD(thrd, bases, -1);
+    STAT_ADD(thrd, base_bytes, -base->base_size);
+    g_free(base);
+}
+
+/* Make the saved stack of 'g' a new base of the thread, in place of the
+ * least recently used one if there are already STACKLET_BASES.
+ */
+static struct stacklet_base_s *g_new_base(struct stacklet_thread_s *thrd,
+                                          struct stacklet_s *g)
+{
+    struct stacklet_base_s *base;
+    size_t size = g->stack_saved;
+    int i, slot = 0;
+
+    if (thrd->g_budget != 0 &&
+            thrd->g_in_use + sizeof(struct stacklet_base_s) + size >
+            thrd->g_budget)
+        return NULL;
+    base = g_malloc(sizeof(struct stacklet_base_s) + size);
+    if (base == NULL)
+        return NULL;
+    base->base_stop = g->stack_stop;
+    base->base_size = size;
+    base->refcount = 1;
+    base->last_used = thrd->g_base_clock++;
+    memcpy(base + 1, g + 1, size);
+    thrd->g_in_use += sizeof(struct stacklet_base_s) + size;
+    STAT_ADD(thrd, bases, 1);
+    STAT_ADD(thrd, base_bytes, size);
+
+    for (i = 0; i < STACKLET_BASES; i++) {
+        if (thrd->g_bases[i] == NULL) {
+            slot = i;
+            break;
+        }
+        if (thrd->g_bases[i]->last_used < thrd->g_bases[slot]->last_used)
+            slot = i;
+    }
+    if (thrd->g_bases[slot] != NULL)
+        g_base_decref(thrd, thrd->g_bases[slot]);
+    thrd->g_bases[slot] = base;
+    return base;
+}
+
+/* Find the base to pack the saved stack of 'g' against, if any, and the
+ * size it packs to.  A stack which packs to less than half with a base is
+ * worth it, otherwise the second stack with the same 'stack_stop' which
+ * can't use any becomes a new one.
+ */
+static struct stacklet_base_s *g_find_base(struct stacklet_thread_s *thrd,
+                                           struct stacklet_s *g,
+                                           size_t *packed_size)
+{
+    struct stacklet_base_s *base = NULL, *b;
+    size_t plain = *packed_size, size;
+    int i;
+
+    for (i = 0; i < STACKLET_BASES; i++) {
+        b = thrd->g_bases[i];
+        if (b == NULL || b->base_stop != g->stack_stop)
+            continue;
+        size = g_pack_stacklet(NULL, g, b);
+        if (size < *packed_size) {
+            *packed_size = size;
+            base = b;
+        }
+    }
+    if (*packed_size > plain / 2) {
+        if (thrd->g_base_pending != g->stack_stop) {
+            thrd->g_base_pending = g->stack_stop;
+        }
+        else if ((b = g_new_base(thrd, g)) != NULL) {
+            thrd->g_base_pending = NULL;
+            *packed_size = g_pack_stacklet(NULL, g, b);
+            base = b;
+        }
+    }
+    if (base != NULL)
+        base->last_used = thrd->g_base_clock++;
+    return base;
+}
+
+#ifndef STACKLET_NO_STATS
+/* How much memory packing saves for 'g'.
+ */
+static size_t g_packed_gain(struct stacklet_s *g)
+{
+    return g_alloc_size(sizeof(struct stacklet_s) +
+                        (g->stack_stop - g->stack_start)) -
+           g_alloc_size(g_buffer_size(g));
+}
+#endif
+
+/* Save more of the C stack away, up to 'target_stop'.  Only the stacklets
+ * that live on the same stack as 'g_target' are in the way.
  */
 static void g_clear_stack(struct stacklet_s *g_target,
                           struct stacklet_thread_s *thrd)
 {
-    struct stacklet_s *current = thrd->g_stack_chain_head;
+    struct stacklet_s **head = g_chain_head(thrd, g_target->stack_seg);
+    struct stacklet_s *current = *head;
     char *target_stop = g_target->stack_stop;
+    size_t steps = 0;
     check_valid(g_target);
 
     /* save and unlink stacklets that are completely within
@@ -163,6 +843,7 @@ static void g_clear_stack(struct stacklet_s *g_target,
     while (current != NULL && current->stack_stop <= target_stop) {
         struct stacklet_s *prev = current->stack_prev;
         check_valid(current);
+        steps++;
         current->stack_prev = NULL;
         if (current != g_target) {
             /* don't bother saving away g_target, because
@@ -184,7 +865,10 @@ static void g_clear_stack(struct stacklet_s *g_target,
 #endif
                );
 
-    thrd->g_stack_chain_head = current;
+    *head = current;
+    STAT_ADD(thrd, chain_walks, 1);
+    STAT_ADD(thrd, chain_steps, steps);
+    STAT_MAX(thrd, max_chain_steps, steps);
 }
 
 /* This saves the current state in a new stacklet that gets stored in
@@ -225,6 +909,26 @@ static void *g_destroy_state(void *old_stack_pointer, void *rawthrd)
     return thrd->g_target->stack_start;
 }
 
+/* Unmap a separate stack.  Never called while running on it.
+ */
+static void g_release_stack(struct stacklet_stack_s *seg)
+{
+    _check(seg->g_stack_chain_head == NULL);
+#ifndef _WIN32
+    munmap(seg->stack_base, seg->stack_mapsize);
+#endif
+}
+
+/* A run() is finished: if it was the last one on the separate stack we
+ * are running on, that stack must be released after switching away.
+ */
+static void g_run_finished(struct stacklet_thread_s *thrd)
+{
+    struct stacklet_stack_s *seg = thrd->g_current_seg;
+    if (seg != NULL && --seg->refcount == 0)
+        thrd->g_dead_seg = seg;
+}
+
 /* Restore the C stack by copying back from the heap in 'g_target',
  * and free 'g_target'.
  */
@@ -237,14 +941,41 @@ static void *g_restore_state(void *new_stack_pointer, void *rawthrd)
     check_valid(g);
 
     _check(new_stack_pointer == g->stack_start);
+    if (g->stack_packed) {
+        g_unpack_stacklet(g->stack_start, g);
+        STAT_ADD(thrd, unpacks, 1);
+        STAT_ADD(thrd, packed_saved, -g_packed_gain(g));
+        if (g->packed_base != NULL)
+            g_base_decref(thrd, g->packed_base);
+    }
+    else {
 #if STACK_DIRECTION == 0
-    memcpy(g->stack_start, g+1, stack_saved);
+        memcpy(g->stack_start, g+1, stack_saved);
 #else
-    memcpy(g->stack_start - stack_saved, g+1, stack_saved);
+        memcpy(g->stack_start - stack_saved, g+1, stack_saved);
 #endif
+    }
     thrd->g_current_stack_stop = g->stack_stop;
+    thrd->g_current_seg = g->stack_seg;
+    STAT_ADD(thrd, restored_bytes, stack_saved);
+    STAT_ADD(thrd, current_saved, -stack_saved);
     g->stack_saved = -13;   /* debugging */
-    free(g);
+    if (g->stack_packed) {
+        g_release(thrd, g);
+    }
+    else {
+        thrd->g_in_use -= g_alloc_size(g_buffer_size(g));
+        g_drop_kept(thrd);
+        thrd->g_kept = g;
+    }
+    thrd->g_nstacklets--;
+
+    /* Now that we are running on another stack, a separate stack whose
+       last run() just finished can go away. */
+    if (thrd->g_dead_seg != NULL) {
+        g_release_stack(thrd->g_dead_seg);
+        thrd->g_dead_seg = NULL;
+    }
     return EMPTY_STACKLET_HANDLE;
 }
 
@@ -274,6 +1005,7 @@ void g_initialstub(struct stacklet_thread_s *thrd,
 
         /* Then switch to 'result'. */
         check_valid(result);
+        g_run_finished(thrd);
         thrd->g_target = result;
         _stacklet_switchstack(g_destroy_state, g_restore_state, thrd);
 
@@ -283,6 +1015,49 @@ void g_initialstub(struct stacklet_thread_s *thrd,
     /* The second time it returns. */
 }
 
+/* This saves the current state in a new stacklet that gets stored in
+ * 'g_source', and returns the top of the separate stack to start on.
+ * Nothing needs to be saved away: the separate stack doesn't overlap
+ * with any other stacklet.
+ */
+static void *g_stack_save_state(void *old_stack_pointer, void *rawthrd)
+{
+    struct stacklet_thread_s *thrd = (struct stacklet_thread_s *)rawthrd;
+    char *top = (char *)thrd->g_new_seg;
+    if (g_allocate_source_stacklet(old_stack_pointer, thrd) < 0)
+        return NULL;
+    /* keep the same alignment that slp_switch() gave to the old stack */
+    top -= ((size_t)top & 15);
+    top -= 16 - ((size_t)old_stack_pointer & 15);
+    return top;
+}
+
+/* Called by slp_switch() as the "restore_state" function, but already
+ * running on the separate stack.  It never returns: when run() finishes
+ * we switch to the stacklet it returned, like g_initialstub() does.
+ */
+static void *g_stack_entry(void *new_stack_pointer, void *rawthrd)
+{
+    struct stacklet_thread_s *thrd = (struct stacklet_thread_s *)rawthrd;
+    struct stacklet_s *result;
+
+    thrd->g_current_seg = thrd->g_new_seg;
+    thrd->g_current_seg->refcount = 1;
+    thrd->g_current_stack_stop = (char *)thrd->g_current_seg;
+    thrd->g_new_seg = NULL;
+    result = thrd->g_run(thrd->g_source, thrd->g_run_arg);
+
+    /* Then switch to 'result'. */
+    check_valid(result);
+    g_run_finished(thrd);
+    thrd->g_target = result;
+    _stacklet_switchstack(g_destroy_state, g_restore_state, thrd);
+
+    _check_failed("we should not return here");
+    abort();
+    return new_stack_pointer;
+}
+
 /************************************************************/
 
 stacklet_thread_handle stacklet_newthread(void)
@@ -290,26 +1065,205 @@ stacklet_thread_handle stacklet_newthread(void)
     struct stacklet_thread_s *thrd;
 
     thrd = malloc(sizeof(struct stacklet_thread_s));
-    if (thrd != NULL)
+    if (thrd != NULL) {
         memset(thrd, 0, sizeof(struct stacklet_thread_s));
+        thrd->g_pool_limit = STACKLET_POOL_LIMIT;
+    }
+#ifdef STACKLET_STREAM
+    if (g_stream == NULL)
+        g_stream_init();
+#endif
     return thrd;
 }
 
 void stacklet_deletethread(stacklet_thread_handle thrd)
 {
-    free(thrd);
+    int last;
+    /* other threads may be destroying stacklets if it was closed */
+    G_LOCK(thrd->g_lock);
+    _check(thrd->g_posted == NULL);
+    g_drop_kept(thrd);
+    g_pool_trim(thrd, 0);
+    stacklet_clear_bases(thrd);
+    thrd->g_closed = 1;
+    thrd->g_deleted = 1;
+    last = thrd->g_nstacklets == 0;
+    G_UNLOCK(thrd->g_lock);
+    if (last)
+        free(thrd);
+}
+
+void stacklet_closethread(stacklet_thread_handle thrd)
+{
+    G_LOCK(thrd->g_lock);
+    thrd->g_closed = 1;
+    G_UNLOCK(thrd->g_lock);
+}
+
+int stacklet_post(stacklet_thread_handle thrd, void **link)
+{
+    int posted = 0;
+    G_LOCK(thrd->g_lock);
+    if (!thrd->g_closed) {
+        *link = thrd->g_posted;
+        G_STORE_PTR(thrd->g_posted, link);
+        posted = 1;
+    }
+    G_UNLOCK(thrd->g_lock);
+    return posted;
+}
+
+void **stacklet_take_posted(stacklet_thread_handle thrd)
+{
+    void **link;
+    if (G_LOAD_PTR(thrd->g_posted) == NULL)
+        return NULL;
+    G_LOCK(thrd->g_lock);
+    link = thrd->g_posted;
+    if (link != NULL)
+        G_STORE_PTR(thrd->g_posted, (void **)*link);
+    G_UNLOCK(thrd->g_lock);
+    return link;
+}
+
+void stacklet_set_pool_limit(stacklet_thread_handle thrd, size_t limit)
+{
+    thrd->g_pool_limit = limit;
+    g_pool_trim(thrd, limit);
+}
+
+void stacklet_get_pool_info(stacklet_thread_handle thrd,
+                            struct stacklet_pool_info *info)
+{
+    info->limit = thrd->g_pool_limit;
+    info->retained = thrd->g_pool_retained;
+    info->hits = thrd->g_pool_hits;
+    info->misses = thrd->g_pool_misses;
+    info->in_use = thrd->g_in_use;
+    info->kept = thrd->g_kept != NULL ? g_alloc_size(g_buffer_size(thrd->g_kept)) : 0;
+    info->budget = thrd->g_budget;
+}
+
+void stacklet_set_budget(stacklet_thread_handle thrd, size_t budget)
+{
+    thrd->g_budget = budget;
+}
+
+void stacklet_get_stats(stacklet_thread_handle thrd,
+                        struct stacklet_stats *stats)
+{
+#ifdef STACKLET_NO_STATS
+    memset(stats, 0, sizeof(struct stacklet_stats));
+#else
+    /* it may be another thread's, which updates them meanwhile */
+    const size_t *src = (const size_t *)&thrd->g_stats;
+    size_t *dst = (size_t *)stats;
+    size_t i;
+    for (i = 0; i < sizeof(struct stacklet_stats) / sizeof(size_t); i++)
+        dst[i] = G_LOAD(src[i]);
+#endif
+}
+
+void stacklet_set_allocator(void *(*alloc)(size_t), void (*release)(void *))
+{
+    g_malloc = alloc;
+    g_free = release;
+}
+
+void stacklet_set_stream_threshold(size_t threshold)
+{
+    g_stream_threshold = threshold;
+}
+
+size_t stacklet_get_stream_threshold(void)
+{
+    return g_stream_threshold;
+}
+
+const char *stacklet_stream_kernel(void)
+{
+#ifdef STACKLET_STREAM
+    if (g_stream == NULL)
+        g_stream_init();
+    return g_stream_name;
+#else
+    return NULL;
+#endif
 }
 
 stacklet_handle stacklet_new(stacklet_thread_handle thrd,
                              stacklet_run_fn run, void *run_arg)
 {
     long stackmarker;
+    struct stacklet_stack_s *seg = thrd->g_current_seg;
     _check((char *)NULL < (char *)&stackmarker);
     if (thrd->g_current_stack_stop <= (char *)&stackmarker)
         thrd->g_current_stack_stop = ((char *)&stackmarker) + 1;
 
+    /* the new run() shares the separate stack we may be running on */
+    if (seg != NULL)
+        seg->refcount++;
     thrd->g_current_stack_marker = (char *)&stackmarker;
     g_initialstub(thrd, run, run_arg);
+    if (thrd->g_source == NULL && seg != NULL)
+        seg->refcount--;
+    return thrd->g_source;
+}
+
+stacklet_stack_handle stacklet_newstack(size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    return NULL;
+#else
+    struct stacklet_stack_s *seg;
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapsize;
+    char *base;
+
+    /* one guard page at the bottom, the stack, and the header at the top */
+    size = (size + sizeof(struct stacklet_stack_s) + pagesize - 1) &
+           ~(pagesize - 1);
+    mapsize = size + pagesize;
+    base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, pagesize, PROT_NONE) != 0) {
+        munmap(base, mapsize);
+        return NULL;
+    }
+
+    seg = (struct stacklet_stack_s *)(base + mapsize) - 1;
+    seg->stack_base = base;
+    seg->stack_mapsize = mapsize;
+    seg->g_stack_chain_head = NULL;
+    seg->refcount = 0;
+    return seg;
+#endif
+}
+
+void stacklet_deletestack(stacklet_stack_handle stack)
+{
+    _check(stack->refcount == 0);
+    g_release_stack(stack);
+}
+
+stacklet_handle stacklet_new_stack(stacklet_thread_handle thrd,
+                                   stacklet_stack_handle stack,
+                                   stacklet_run_fn run, void *run_arg)
+{
+    long stackmarker;
+    _check(stack->refcount == 0);
+    if (thrd->g_current_stack_stop <= (char *)&stackmarker)
+        thrd->g_current_stack_stop = ((char *)&stackmarker) + 1;
+
+    thrd->g_new_seg = stack;
+    thrd->g_run = run;
+    thrd->g_run_arg = run_arg;
+    /* This returns only when we are switched back to, or on failure */
+    _stacklet_switchstack(g_stack_save_state, g_stack_entry, thrd);
+    thrd->g_new_seg = NULL;
     return thrd->g_source;
 }
 
@@ -328,16 +1282,18 @@ stacklet_handle stacklet_switch(stacklet_handle target)
 
 void stacklet_destroy(stacklet_handle target)
 {
+    stacklet_thread_handle thrd = target->stack_thrd;
+    struct stacklet_stack_s *seg = target->stack_seg;
+    int closed = thrd->g_closed, last;
     check_valid(target);
-    if (target->stack_prev != NULL) {
-        /* 'target' appears to be in the chained list 'unsaved_stack',
-           so remove it from there.  Note that if 'thrd' was already
-           deleted, it means that we left the thread and all stacklets
-           still in the thread should be fully copied away from the
-           stack --- so should have stack_prev == NULL.  In this case
-           we don't even read 'stack_thrd', already deallocated. */
-        stacklet_thread_handle thrd = target->stack_thrd;
-        struct stacklet_s **pp = &thrd->g_stack_chain_head;
+    if (closed)
+        G_LOCK(thrd->g_lock);
+    if (target->stack_prev != NULL || seg != NULL) {
+        /* 'target' may be in one of the chained lists 'unsaved_stack',
+           so remove it from there.  'thrd' is not deallocated before
+           all of its stacklets are, even if it was already deleted,
+           and a separate stack is not released before its stacklets. */
+        struct stacklet_s **pp = g_chain_head(thrd, seg);
         for (; *pp != NULL; pp = &(*pp)->stack_prev) {
             check_valid(*pp);
             if (*pp == target) {
@@ -346,8 +1302,184 @@ void stacklet_destroy(stacklet_handle target)
             }
         }
     }
+    STAT_ADD(thrd, current_saved, -target->stack_saved);
+    if (target->stack_packed)
+        STAT_ADD(thrd, packed_saved, -g_packed_gain(target));
+    if (target->packed_base != NULL)
+        g_base_decref(thrd, target->packed_base);
+    thrd->g_in_use -= g_alloc_size(g_buffer_size(target));
     target->stack_saved = -11;   /* debugging */
-    free(target);
+    /* not g_release(): we may be in another thread */
+    g_free(target);
+
+    last = --thrd->g_nstacklets == 0 && thrd->g_deleted;
+    if (closed)
+        G_UNLOCK(thrd->g_lock);
+    if (last)
+        free(thrd);
+
+    /* the run() that 'target' was suspended in will never finish */
+    if (seg != NULL && --seg->refcount == 0)
+        g_release_stack(seg);
+}
+
+stacklet_handle stacklet_clone(stacklet_handle target)
+{
+    stacklet_thread_handle thrd = target->stack_thrd;
+    struct stacklet_s *g;
+    check_valid(target);
+    if (target->stack_seg != NULL)
+        return NULL;
+
+    g = g_alloc(thrd, g_buffer_size(target));
+    if (g == NULL)
+        return NULL;
+
+    /* the copy must not depend on the C stack */
+    g_detach(thrd, target);
+
+    memcpy(g, target, g_buffer_size(target));
+    thrd->g_nstacklets++;
+    STAT_ADD(thrd, saved_bytes, g->stack_saved);
+    STAT_ADD(thrd, current_saved, g->stack_saved);
+    STAT_MAX(thrd, peak_saved, thrd->g_stats.current_saved);
+    if (g->stack_packed)
+        STAT_ADD(thrd, packed_saved, g_packed_gain(g));
+    if (g->packed_base != NULL)
+        g->packed_base->refcount++;
+    return g;
+}
+
+stacklet_handle stacklet_pack(stacklet_handle target)
+{
+    stacklet_thread_handle thrd = target->stack_thrd;
+    struct stacklet_s *g;
+    struct stacklet_base_s *base;
+    size_t size;
+    check_valid(target);
+    if (target->stack_seg != NULL || target->stack_packed)
+        return NULL;
+
+    g_detach(thrd, target);
+    size = g_pack_stacklet(NULL, target, NULL);
+    base = g_find_base(thrd, target, &size);
+    size += sizeof(struct stacklet_s);
+    if (size == sizeof(struct stacklet_s) ||
+            g_alloc_size(size) >= g_alloc_size(g_buffer_size(target)))
+        return NULL;
+    g = g_alloc(thrd, size);
+    if (g == NULL)
+        return NULL;
+
+    *g = *target;
+    g->stack_packed = size - sizeof(struct stacklet_s);
+    g->packed_base = base;
+    if (base != NULL)
+        base->refcount++;
+    g_pack_stacklet((char *)(g+1), target, base);
+    g_release(thrd, target);
+    STAT_ADD(thrd, packs, 1);
+    STAT_ADD(thrd, packed_saved, g_packed_gain(g));
+    return g;
+}
+
+stacklet_handle stacklet_unpack(stacklet_handle target)
+{
+    stacklet_thread_handle thrd = target->stack_thrd;
+    struct stacklet_s *g;
+    check_valid(target);
+    if (!target->stack_packed)
+        return target;
+
+    g = g_alloc(thrd, sizeof(struct stacklet_s) + target->stack_saved);
+    if (g == NULL)
+        return NULL;
+
+    *g = *target;
+    g->stack_packed = 0;
+    g->packed_base = NULL;
+    g_unpack_stacklet((char *)(g+1), target);
+    STAT_ADD(thrd, unpacks, 1);
+    STAT_ADD(thrd, packed_saved, -g_packed_gain(target));
+    if (target->packed_base != NULL)
+        g_base_decref(thrd, target->packed_base);
+    g_release(thrd, target);
+    return g;
+}
+
+void stacklet_clear_bases(stacklet_thread_handle thrd)
+{
+    int i;
+    for (i = 0; i < STACKLET_BASES; i++) {
+        if (thrd->g_bases[i] != NULL)
+            g_base_decref(thrd, thrd->g_bases[i]);
+        thrd->g_bases[i] = NULL;
+    }
+    thrd->g_base_pending = NULL;
+}
+
+int stacklet_is_packed(stacklet_handle target)
+{
+    return target->stack_packed != 0;
+}
+
+int stacklet_on_separate_stack(stacklet_handle target)
+{
+    return target->stack_seg != NULL;
+}
+
+size_t stacklet_stack_extent(stacklet_handle target)
+{
+    check_valid(target);
+    return target->stack_stop - target->stack_start;
+}
+
+size_t stacklet_buffer_size(stacklet_handle target)
+{
+    check_valid(target);
+    return g_alloc_size(g_buffer_size(target));
+}
+
+size_t stacklet_switch_cost(stacklet_handle target)
+{
+    /* walks the same stacklets as g_clear_stack() */
+    long stackmarker;
+    struct stacklet_thread_s *thrd = target->stack_thrd;
+    struct stacklet_s *g;
+    char *target_stop = target->stack_stop;
+    char *stop, *saved;
+    size_t cost = target->stack_saved;
+    check_valid(target);
+
+    if (target->stack_seg == thrd->g_current_seg) {
+        stop = thrd->g_current_stack_stop;
+        if (stop > target_stop)
+            stop = target_stop;
+        if ((char *)&stackmarker < stop)
+            cost += stop - (char *)&stackmarker;
+    }
+    for (g = *g_chain_head(thrd, target->stack_seg); g != NULL;
+         g = g->stack_prev) {
+        stop = g->stack_stop < target_stop ? g->stack_stop : target_stop;
+        saved = g->stack_start + g->stack_saved;
+        if (g != target && saved < stop)
+            cost += stop - saved;
+        if (g->stack_stop > target_stop)
+            break;
+    }
+    return cost;
+}
+
+stacklet_handle _stacklet_switch_to_copy(stacklet_handle target)
+{
+    stacklet_handle copy = stacklet_clone(target);
+    stacklet_handle result;
+    if (copy == NULL)
+        return NULL;
+    result = stacklet_switch(copy);
+    if (result == NULL)
+        stacklet_destroy(copy);
+    return result;
 }
 
 char **_stacklet_translate_pointer(stacklet_handle context, char **ptr)
@@ -357,6 +1489,7 @@ char **_stacklet_translate_pointer(stacklet_handle context, char **ptr)
   if (context == NULL)
     return ptr;
   check_valid(context);
+  _check(!context->stack_packed);
   delta = p - context->stack_start;
   if (((unsigned long)delta) < ((unsigned long)context->stack_saved)) {
       /* a pointer to a saved away word */
@@ -25,6 +25,111 @@ stacklet_thread_handle stacklet_newthread(void);
 void stacklet_deletethread(stacklet_thread_handle thrd);
 
 
+/* Memory for the saved stacks.  Each thread keeps a pool of freed
+ * buffers, in power of two size classes, so that switching doesn't need
+ * to call the allocator every time.  The pool retains at most 'limit'
+ * bytes (STACKLET_POOL_LIMIT by default); 0 disables it.
+ */
+#define STACKLET_POOL_LIMIT  (1024 * 1024)
+
+struct stacklet_pool_info {
+    size_t limit;       /* max bytes retained by the pool */
+    size_t retained;    /* bytes currently retained by the pool */
+    size_t hits;        /* buffers taken from the pool */
+    size_t misses;      /* buffers obtained from the allocator */
+    size_t in_use;      /* bytes of the buffers of suspended stacklets */
+    size_t budget;      /* max for 'in_use', 0 if there is none */
+    size_t kept;        /* bytes of the buffer the running stacklet was
+                           restored from, kept to save it again */
+};
+
+void stacklet_set_pool_limit(stacklet_thread_handle thrd, size_t limit);
+void stacklet_get_pool_info(stacklet_thread_handle thrd,
+                            struct stacklet_pool_info *info);
+
+/* Limit the bytes of the buffers of the suspended stacklets of a thread
+ * ('in_use' above) to 'budget', 0 to remove the limit.  Switches and
+ * clones which would need more fail as if out of memory.
+ */
+void stacklet_set_budget(stacklet_thread_handle thrd, size_t budget);
+
+/* Only the thread a stacklet belongs to may destroy it, or use it in any
+ * other way.  Another thread which has to get rid of one posts 'link', a
+ * pointer in some object of its own which goes with the stacklet, to the
+ * stacklet's thread with stacklet_post().  That thread gets it back from
+ * stacklet_take_posted(), one at a time, and destroys the stacklet.
+ * stacklet_post() returns 0 and posts nothing once the thread called
+ * stacklet_closethread(), which it does before taking what was posted one
+ * last time and calling stacklet_deletethread(): from then on any thread
+ * can call stacklet_destroy() on its stacklets.
+ */
+int stacklet_post(stacklet_thread_handle thrd, void **link);
+void **stacklet_take_posted(stacklet_thread_handle thrd);
+void stacklet_closethread(stacklet_thread_handle thrd);
+
+/* Statistics, kept per thread unless compiled with STACKLET_NO_STATS (in
+ * which case they are all zero).
+ */
+struct stacklet_stats {
+    size_t saved_bytes;         /* bytes copied away from the stack */
+    size_t restored_bytes;      /* bytes copied back to the stack */
+    size_t current_saved;       /* bytes currently saved away */
+    size_t peak_saved;          /* maximum of 'current_saved' */
+    size_t chain_walks;         /* walks of the list of unsaved stacklets */
+    size_t chain_steps;         /* stacklets visited during those walks */
+    size_t max_chain_steps;     /* longest walk */
+    size_t mallocs;             /* buffers obtained from the allocator */
+    size_t packs;               /* stacklets packed */
+    size_t unpacks;             /* packed stacklets restored or unpacked */
+    size_t packed_saved;        /* bytes currently saved by packing */
+    size_t bases;               /* bases stacks are packed against */
+    size_t base_bytes;          /* bytes of those */
+    size_t unchanged_bytes;     /* not copied again when saving */
+    size_t streamed_bytes;      /* saved with non-temporal stores */
+};
+
+void stacklet_get_stats(stacklet_thread_handle thrd,
+                        struct stacklet_stats *stats);
+
+/* Replace malloc() and free() as the allocator of the saved stacks.  Must
+ * be called before any stacklet is created.  The functions may be called
+ * from any thread.
+ */
+void stacklet_set_allocator(void *(*alloc)(size_t), void (*release)(void *));
+
+/* Stacks can be saved with non-temporal stores, which leave the CPU
+ * caches to the code that runs meanwhile, when at least 'threshold'
+ * bytes are copied at once; 0, the default, never does it: the stacklet
+ * is then restored from memory instead of the cache, which only pays
+ * off on some machines.  This is process-wide, and only done where there
+ * is a kernel for it (x86-64): stacklet_stream_kernel() returns the name
+ * of the one picked for the CPU, or NULL.
+ */
+#define STACKLET_STREAM_THRESHOLD  0
+
+void stacklet_set_stream_threshold(size_t threshold);
+size_t stacklet_get_stream_threshold(void);
+const char *stacklet_stream_kernel(void);
+
+
+/* Separate stacks.  A stacklet started with stacklet_new_stack() runs on
+ * its own memory region instead of on the thread's C stack, with an
+ * inaccessible guard page below it.  Switching to or from such a
+ * stacklet doesn't need to copy its stack away, only the registers are
+ * saved.  Returns NULL if the stack could not be allocated or if
+ * separate stacks are not supported on this platform.
+ */
+typedef struct stacklet_stack_s *stacklet_stack_handle;
+
+stacklet_stack_handle stacklet_newstack(size_t size);
+
+/* Delete a stack which was never passed to stacklet_new_stack().  Once
+ * a stacklet has been started on it, the stack is released automatically
+ * when all stacklets running on it are finished or destroyed.
+ */
+void stacklet_deletestack(stacklet_stack_handle stack);
+
+
 /* The "run" function of a stacklet.  The first argument is the handle
  * of the stack from where we come.  When such a function returns, it
  * must return a (non-empty) stacklet_handle that tells where to go next.
@@ -37,6 +142,13 @@ typedef stacklet_handle (*stacklet_run_fn)(stacklet_handle, void *);
 stacklet_handle stacklet_new(stacklet_thread_handle thrd,
                              stacklet_run_fn run, void *run_arg);
 
+/* Same as stacklet_new(), but 'run' is called on the given separate stack,
+ * which is consumed.  On failure (NULL) the stack is left untouched.
+ */
+stacklet_handle stacklet_new_stack(stacklet_thread_handle thrd,
+                                   stacklet_stack_handle stack,
+                                   stacklet_run_fn run, void *run_arg);
+
 /* Switch to the target handle, resuming its stack.  This returns:
  *  - if we come back from another call to stacklet_switch(), the source handle
  *  - if we come back from a run() that finishes, EMPTY_STACKLET_HANDLE
@@ -51,7 +163,62 @@ stacklet_handle stacklet_switch(stacklet_handle target);
  */
 void stacklet_destroy(stacklet_handle target);
 
-/* stacklet_handle _stacklet_switch_to_copy(stacklet_handle) --- later */
+/* Return a copy of the suspended stacklet 'target', which stays valid:
+ * each of them can be resumed once.  Both resume with the same C stack
+ * at the same addresses, so whatever it points to must be valid for both
+ * of them.  Returns NULL if out of memory, or if 'target' runs on a
+ * separate stack, which can't be shared.
+ */
+stacklet_handle stacklet_clone(stacklet_handle target);
+
+/* Pack the saved stack of the suspended stacklet 'target' to take less
+ * memory, which is mostly worth it for stacklets that stay suspended for
+ * long: it's saved completely first, and unpacked when it's resumed.
+ * Returns the packed stacklet, which replaces 'target', or NULL if it
+ * can't be packed (it runs on a separate stack or is already packed),
+ * packing doesn't save memory, or out of memory; 'target' stays valid
+ * then.
+ */
+stacklet_handle stacklet_pack(stacklet_handle target);
+
+/* Stacklets with the same 'stack_stop' are packed against a copy of one
+ * of them, a base kept by the thread, and only store how they differ.
+ * Forget the bases, which are freed with the last stacklet using them.
+ */
+void stacklet_clear_bases(stacklet_thread_handle thrd);
+
+/* Undo stacklet_pack().  Returns the unpacked stacklet, which replaces
+ * 'target' (it's 'target' itself if it wasn't packed), or NULL if out
+ * of memory.
+ */
+stacklet_handle stacklet_unpack(stacklet_handle target);
+
+int stacklet_is_packed(stacklet_handle target);
+
+/* Whether 'target' runs on a separate stack.
+ */
+int stacklet_on_separate_stack(stacklet_handle target);
+
+/* Size of the C stack of the suspended stacklet 'target', from where it
+ * started to where it was suspended, saved away or not.
+ */
+size_t stacklet_stack_extent(stacklet_handle target);
+
+/* Bytes of memory taken by the buffer of the suspended stacklet 'target'.
+ */
+size_t stacklet_buffer_size(stacklet_handle target);
+
+/* An estimate of the bytes stacklet_switch(target) would copy if it was
+ * called from here: the saved part of 'target' to restore, and the parts
+ * of the running stacklet and of the suspended ones which are in its way
+ * and would have to be saved away first.
+ */
+size_t stacklet_switch_cost(stacklet_handle target);
+
+/* Switch to a copy of the target handle, leaving the target itself valid.
+ * Same return values as stacklet_switch().
+ */
+stacklet_handle _stacklet_switch_to_copy(stacklet_handle target);
 
 /* Hack: translate a pointer into the stack of a stacklet into a pointer
  * to where it is really stored so far.  Only to access word-sized data.
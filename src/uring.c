@@ -0,0 +1,341 @@
+
+/*
+ * io_uring support for Scheduler. Operations are queued on the submission
+ * ring while Fibers run and go to the kernel all at once when the Scheduler
+ * polls, completions make the waiting Fibers ready. liburing is not needed,
+ * the rings are set up with the raw system calls.
+ */
+
+#if defined(__linux__) && !defined(FIBERS_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FIBERS_IO_URING
+#endif
+#endif
+
+#ifdef FIBERS_IO_URING
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 256
+
+struct _scheduler_ring {
+    int fd;
+    unsigned int features;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    Py_ssize_t ops;         /* queued or in flight, not reaped yet */
+};
+
+static int waiter_wake(FiberWaiter *w, int status);
+static void waiter_release(FiberWaiter *w);
+
+/* whether io_uring can be used, -1 until probed */
+static int uring_supported = -1;
+
+
+static int
+uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static void
+uring_free(SchedulerRing *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    close(ring->fd);
+    PyMem_Free(ring);
+}
+
+
+/* Set up a ring, on error NULL is returned with errno set */
+static SchedulerRing *
+uring_new(unsigned int entries)
+{
+    struct io_uring_params p;
+    SchedulerRing *ring;
+    void *ptr;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    ring = PyMem_Calloc(1, sizeof(SchedulerRing));
+    if (!ring) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->features = p.features;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_len = ring->cq_len = Py_MAX(ring->sq_len, ring->cq_len);
+    }
+    ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        goto error;
+    }
+    ring->sq_ptr = ptr;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ptr;
+    } else {
+        ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED) {
+            goto error;
+        }
+        ring->cq_ptr = ptr;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        goto error;
+    }
+    ring->sqes = ptr;
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->sq_mask = *(unsigned int *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return ring;
+
+error:
+    fd = errno;
+    uring_free(ring);
+    errno = fd;
+    return NULL;
+}
+
+
+/*
+ * Check once whether io_uring can be used: it may be missing, disabled with
+ * sysctl or blocked by seccomp, and all the needed operations must exist
+ * (Linux >= 5.6).
+ */
+static int
+uring_probe(void)
+{
+    static const int ops[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_RECV, IORING_OP_SEND,
+                              IORING_OP_ACCEPT, IORING_OP_FSYNC, IORING_OP_ASYNC_CANCEL};
+    struct io_uring_probe *probe;
+    SchedulerRing *ring;
+    size_t i;
+    int ok;
+
+    if (uring_supported >= 0) {
+        return uring_supported;
+    }
+    /* threads may probe at the same time without the GIL, the result is only
+     * stored once it's known */
+    if (!(ring = uring_new(2))) {
+        uring_supported = 0;
+        return 0;
+    }
+    ok = 0;
+    probe = PyMem_Calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ok = (ring->features & IORING_FEAT_NODROP) != 0;
+        for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ok = 0;
+            }
+        }
+    }
+    PyMem_Free(probe);
+    uring_free(ring);
+    uring_supported = ok;
+    return ok;
+}
+
+
+static INLINE unsigned int
+uring_pending(SchedulerRing *ring)
+{
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+
+static INLINE Bool
+uring_completed(SchedulerRing *ring)
+{
+    return *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Submit the queued operations and, unless timeout is 0, wait for at least
+ * one completion (forever if timeout is negative).
+ */
+static int
+uring_submit(SchedulerRing *ring, double timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned int flags = 0, min_complete = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    int r;
+
+    if (timeout != 0 && !uring_completed(ring)) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+        if (timeout > 0) {
+            ts.tv_sec = (long long)timeout;
+            ts.tv_nsec = (long long)((timeout - (double)ts.tv_sec) * 1e9);
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+    if (!min_complete && !uring_pending(ring)) {
+        return 0;
+    }
+
+    if (min_complete) {
+        Py_BEGIN_ALLOW_THREADS
+        r = uring_enter(ring->fd, uring_pending(ring), min_complete, flags, argp, argsz);
+        Py_END_ALLOW_THREADS
+    } else {
+        r = uring_enter(ring->fd, uring_pending(ring), 0, 0, NULL, 0);
+    }
+    if (r < 0) {
+        switch (errno) {
+            case EINTR:
+                return PyErr_CheckSignals();
+            case ETIME:
+            case EAGAIN:
+            case EBUSY:
+                /* timed out, or completions must be reaped first */
+                return 0;
+            default:
+                PyErr_SetFromErrno(PyExc_OSError);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Queue an operation, the waiter is woken up with the result in 'res' */
+static int
+uring_prep(SchedulerRing *ring, int opcode, int fd, const void *addr, unsigned int len, uint64_t off, uint32_t op_flags, FiberWaiter *w)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    if (uring_pending(ring) == ring->sq_entries) {
+        if (uring_submit(ring, 0) < 0) {
+            return -1;
+        }
+        if (uring_pending(ring) == ring->sq_entries) {
+            errno = EBUSY;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+
+    tail = *ring->sq_tail;
+    index = tail & ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->rw_flags = op_flags;
+    sqe->user_data = (uint64_t)(uintptr_t)w;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->ops++;
+    if (w) {
+        w->refs++;
+    }
+    return 0;
+}
+
+
+/* Ask the kernel to cancel the operation the waiter is blocked on, if it can */
+static void
+uring_cancel(SchedulerRing *ring, FiberWaiter *w)
+{
+    PyObject *exc_type, *exc_value, *exc_tb;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (uring_prep(ring, IORING_OP_ASYNC_CANCEL, -1, w, 0, 0, 0, NULL) < 0) {
+        /* it will complete eventually */
+        PyErr_Clear();
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+
+/* Make the Fibers whose operations completed ready */
+static int
+uring_reap(SchedulerRing *ring)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    FiberWaiter *w;
+    int r = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        w = (FiberWaiter *)(uintptr_t)cqe->user_data;
+        if (w) {
+            w->res = cqe->res;
+            if (w->close_res && w->res >= 0 && w->status == WAITER_CANCELLED) {
+                /* accepted after the Fiber stopped waiting */
+                close(w->res);
+            }
+            r |= waiter_wake(w, WAITER_DONE);
+            waiter_release(w);
+        }
+        ring->ops--;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return r;
+}
+
+#endif
@@ -0,0 +1,361 @@
+
+import gc
+import threading
+import unittest
+import weakref
+
+import fibers
+from fibers import Fiber
+import pytest
+
+
+pytestmark = pytest.mark.skipif(not hasattr(fibers, 'Channel'), reason='Channel is not available')
+
+
+class ChannelTests(unittest.TestCase):
+
+    def setUp(self):
+        self.sched = fibers.Scheduler()
+
+    def test_unbuffered(self):
+        ch = fibers.Channel()
+        lst = []
+
+        def producer():
+            for i in range(5):
+                ch.send(i)
+                lst.append(('sent', i))
+
+        def consumer():
+            for _ in range(5):
+                lst.append(('recv', ch.recv()))
+        self.sched.spawn(consumer)
+        self.sched.spawn(producer)
+        self.sched.run()
+        assert [x for op, x in lst if op == 'recv'] == list(range(5))
+        # a send doesn't complete before the value is received
+        for i in range(5):
+            assert lst.index(('recv', i)) < lst.index(('sent', i))
+
+    def test_handoff(self):
+        ch = fibers.Channel()
+        lst = []
+
+        def consumer():
+            lst.append(ch.recv())
+
+        def producer():
+            ch.send('x')
+            # the receiver ran first
+            lst.append('after send')
+        self.sched.spawn(consumer)
+        self.sched.spawn(producer)
+        self.sched.run()
+        assert lst == ['x', 'after send']
+
+    def test_buffered(self):
+        ch = fibers.Channel(3)
+        assert ch.capacity == 3
+        lst = []
+
+        def producer():
+            for i in range(3):
+                ch.send(i)
+            lst.append('buffered')
+            ch.send(3)
+            lst.append('sent')
+
+        def consumer():
+            for _ in range(4):
+                lst.append(ch.recv())
+        self.sched.spawn(producer)
+        self.sched.spawn(consumer)
+        self.sched.run()
+        assert lst == ['buffered', 0, 1, 2, 3, 'sent']
+
+    def test_buffered_outside_scheduler(self):
+        ch = fibers.Channel(2)
+        ch.send(1)
+        ch.send(2)
+        assert len(ch) == 2
+        assert ch.recv() == 1
+        assert ch.recv() == 2
+        assert len(ch) == 0
+
+    def test_would_block_outside_scheduler(self):
+        ch = fibers.Channel()
+        with pytest.raises(fibers.error):
+            ch.send(1)
+        with pytest.raises(fibers.error):
+            ch.recv()
+
+    def test_send_to_waiting_from_main(self):
+        ch = fibers.Channel()
+        lst = []
+
+        def consumer():
+            lst.append(ch.recv())
+        self.sched.spawn(consumer)
+        self.sched.run()
+        assert lst == []
+        # the receiver is made ready, it doesn't run yet
+        ch.send(42)
+        assert lst == []
+        self.sched.run()
+        assert lst == [42]
+
+    def test_close(self):
+        ch = fibers.Channel(2)
+        ch.send(1)
+        ch.close()
+        assert ch.closed
+        with pytest.raises(fibers.ChannelClosed):
+            ch.send(2)
+        # buffered values can still be received
+        assert ch.recv() == 1
+        with pytest.raises(fibers.ChannelClosed):
+            ch.recv()
+        ch.close()
+
+    def test_close_wakes_blocked(self):
+        ch1 = fibers.Channel()
+        ch2 = fibers.Channel()
+        errors = []
+
+        def receiver():
+            try:
+                ch1.recv()
+            except fibers.ChannelClosed as e:
+                errors.append(e)
+
+        def sender():
+            try:
+                ch2.send(1)
+            except fibers.ChannelClosed as e:
+                errors.append(e)
+        self.sched.spawn(receiver)
+        self.sched.spawn(receiver)
+        self.sched.spawn(sender)
+        self.sched.run()
+        assert errors == []
+        ch1.close()
+        ch2.close()
+        self.sched.run()
+        assert len(errors) == 3
+
+    def test_iterate(self):
+        ch = fibers.Channel()
+        lst = []
+
+        def producer():
+            for i in range(5):
+                ch.send(i)
+            ch.close()
+
+        def consumer():
+            for x in ch:
+                lst.append(x)
+        self.sched.spawn(consumer)
+        self.sched.spawn(producer)
+        self.sched.run()
+        assert lst == list(range(5))
+
+    def test_send_many_recv_many(self):
+        ch = fibers.Channel(10)
+        batches = []
+
+        def producer():
+            ch.send_many(range(25))
+            ch.close()
+
+        def consumer():
+            while True:
+                try:
+                    batches.append(ch.recv_many(4))
+                except fibers.ChannelClosed:
+                    break
+        self.sched.spawn(producer)
+        self.sched.spawn(consumer)
+        self.sched.run()
+        assert all(1 <= len(b) <= 4 for b in batches)
+        assert sum(batches, []) == list(range(25))
+
+    def test_recv_many_returns_available(self):
+        ch = fibers.Channel(10)
+        ch.send_many([1, 2, 3])
+        assert ch.recv_many(10) == [1, 2, 3]
+        with pytest.raises(ValueError):
+            ch.recv_many(0)
+
+    def test_recv_many_unbuffered(self):
+        ch = fibers.Channel()
+        result = []
+
+        def sender(i):
+            ch.send(i)
+
+        def receiver():
+            result.append(ch.recv_many(10))
+        for i in range(3):
+            self.sched.spawn(sender, i)
+        self.sched.spawn(receiver)
+        self.sched.run()
+        assert result == [[0, 1, 2]]
+
+    def test_blocked_sender_fills_buffer(self):
+        ch = fibers.Channel(1)
+        lst = []
+
+        def producer():
+            for i in range(3):
+                ch.send(i)
+            lst.append('done')
+        self.sched.spawn(producer)
+        self.sched.run()
+        assert lst == []
+        assert ch.recv() == 0
+        assert len(ch) == 1
+        self.sched.run()
+        assert ch.recv() == 1
+        assert ch.recv() == 2
+        self.sched.run()
+        assert lst == ['done']
+
+    def test_select_recv(self):
+        ch1 = fibers.Channel()
+        ch2 = fibers.Channel()
+        result = []
+
+        def selector():
+            result.append(fibers.select([ch1, ch2]))
+
+        def sender():
+            ch2.send('b')
+        self.sched.spawn(selector)
+        self.sched.spawn(sender)
+        self.sched.run()
+        assert result == [(1, 'b')]
+        # no entries are left behind on the other channel
+        self.sched.spawn(lambda: ch1.send('a'))
+        self.sched.spawn(lambda: result.append(ch1.recv()))
+        self.sched.run()
+        assert result[1] == 'a'
+
+    def test_select_send(self):
+        ch1 = fibers.Channel()
+        ch2 = fibers.Channel()
+        result = []
+
+        def selector():
+            result.append(fibers.select([ch1, (ch2, 'x')]))
+
+        def receiver():
+            result.append(ch2.recv())
+        self.sched.spawn(selector)
+        self.sched.spawn(receiver)
+        self.sched.run()
+        assert sorted(result, key=str) == [(1, None), 'x']
+
+    def test_select_ready(self):
+        ch1 = fibers.Channel(1)
+        ch2 = fibers.Channel(1)
+        ch2.send('b')
+        assert fibers.select([ch1, ch2]) == (1, 'b')
+        assert fibers.select([ch2, (ch1, 'a')]) == (1, None)
+        assert ch1.recv() == 'a'
+
+    def test_select_closed(self):
+        ch = fibers.Channel()
+        ch.close()
+        with pytest.raises(fibers.ChannelClosed):
+            fibers.select([ch])
+
+    def test_select_invalid(self):
+        with pytest.raises(ValueError):
+            fibers.select([])
+        with pytest.raises(TypeError):
+            fibers.select([1])
+
+    def test_throw_into_blocked(self):
+        ch = fibers.Channel()
+        lst = []
+
+        def receiver():
+            try:
+                ch.recv()
+            except KeyError:
+                lst.append('thrown')
+        g = self.sched.spawn(receiver)
+        self.sched.run()
+        g.throw(KeyError)
+        assert lst == ['thrown']
+        # the receiver is no longer waiting
+        with pytest.raises(fibers.error):
+            ch.send(1)
+
+    def test_pipeline(self):
+        n = 10000
+        stage1 = fibers.Channel(16)
+        stage2 = fibers.Channel()
+        total = []
+
+        def source():
+            stage1.send_many(range(n))
+            stage1.close()
+
+        def double():
+            for x in stage1:
+                stage2.send(x * 2)
+            stage2.close()
+
+        def sink():
+            total.append(sum(stage2))
+        for f in (sink, double, source):
+            self.sched.spawn(f)
+        self.sched.run()
+        assert total == [n * (n - 1)]
+
+    def test_dealloc(self):
+        ch = fibers.Channel(4)
+        item = Fiber()
+        ch.send_many([item, ch])
+        r1 = weakref.ref(ch)
+        r2 = weakref.ref(item)
+        del ch, item
+        gc.collect()
+        assert r1() is None
+        assert r2() is None
+
+    def test_other_thread(self):
+        ch = fibers.Channel()
+        lst = []
+        errors = []
+
+        def other_thread():
+            for op in (lambda: ch.send('x'), ch.recv, ch.close):
+                try:
+                    op()
+                except fibers.error as e:
+                    errors.append(str(e))
+
+        def consumer():
+            try:
+                ch.recv()
+            except fibers.ChannelClosed:
+                lst.append('closed')
+
+        def producer():
+            # the consumer is blocked, it can't be woken from another thread
+            t = threading.Thread(target=other_thread)
+            t.start()
+            t.join()
+            ch.close()
+        self.sched.spawn(consumer)
+        self.sched.spawn(producer)
+        self.sched.run()
+        assert errors == ['cannot use a Channel on a different thread'] * 3
+        assert lst == ['closed']
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
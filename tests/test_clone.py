@@ -0,0 +1,272 @@
+
+import gc
+import sys
+import time
+import unittest
+import weakref
+
+import fibers
+from fibers import Fiber, current
+import pytest
+
+
+is_pypy = hasattr(sys, 'pypy_version_info')
+
+needs_clone = pytest.mark.skipif(is_pypy or sys.version_info[:2] != (3, 11),
+                                 reason='started Fibers can only be cloned on CPython 3.11')
+
+
+def counter(back):
+    i = 0
+    while True:
+        i += 1
+        back = back.switch(i)
+
+
+def queens(n, choose):
+    cols = ()
+    for row in range(n):
+        col = choose(n)
+        for r, c in enumerate(cols):
+            if c == col or abs(c - col) == row - r:
+                return None
+        cols += (col,)
+    return cols
+
+
+class CloneTests(unittest.TestCase):
+
+    def test_not_started(self):
+        g = Fiber(target=lambda x: x * 2, args=(21,))
+        c = g.clone()
+        assert c is not g
+        assert c.parent is g.parent
+        assert c.switch() == 42
+        assert g.switch() == 42
+
+    def test_invalid(self):
+        with pytest.raises(fibers.error):
+            current().clone()
+
+        def f():
+            current().clone()
+        with pytest.raises(fibers.error):
+            Fiber(f).switch()
+        g = Fiber(lambda: None)
+        g.switch()
+        with pytest.raises(fibers.error):
+            g.clone()
+
+    @needs_clone
+    def test_suspended(self):
+        main = current()
+        g = Fiber(counter, args=(main,))
+        assert g.switch() == 1
+        c = g.clone()
+        assert c.switch(main) == 2
+        assert c.switch(main) == 3
+        assert g.switch(main) == 2
+        assert c.switch(main) == 4
+        assert g.is_alive() and c.is_alive()
+
+    @needs_clone
+    def test_end_independently(self):
+        main = current()
+
+        def f(n):
+            x = main.switch()
+            return n + x
+        g = Fiber(f, args=(1,))
+        g.switch()
+        c = g.clone()
+        assert c.switch(10) == 11
+        assert not c.is_alive()
+        assert g.is_alive()
+        assert g.switch(20) == 21
+        assert not g.is_alive()
+
+    @needs_clone
+    def test_packed(self):
+        main = current()
+        fibers.set_stack_compression(0.001)
+        try:
+            g = Fiber(counter, args=(main,))
+            g.switch()
+            time.sleep(0.01)
+            assert fibers.compress_stacks() == 1
+            c = g.clone()
+        finally:
+            fibers.set_stack_compression(0)
+        assert c.switch(main) == 2
+        assert g.switch(main) == 2
+
+    @needs_clone
+    def test_clone_of_clone(self):
+        main = current()
+        g = Fiber(counter, args=(main,))
+        g.switch()
+        clones = [g]
+        for _ in range(5):
+            clones.append(clones[-1].clone())
+            clones[-1].switch(main)
+        assert [c.switch(main) for c in clones] == [2, 3, 4, 5, 6, 7]
+
+    @needs_clone
+    def test_for_loops_are_independent(self):
+        main = current()
+
+        def f():
+            seen = []
+            for i in range(5):
+                seen.append(main.switch(i))
+            return seen
+        g = Fiber(f)
+        assert g.switch() == 0
+        c = g.clone()
+        assert c.switch('c') == 1
+        assert c.switch('c') == 2
+        assert g.switch('g') == 1
+        # objects are shared, not copied
+        assert c.switch('c') == 3
+        assert g.switch('g') == 2
+
+    @needs_clone
+    def test_recursion(self):
+        main = current()
+
+        def f(depth):
+            if depth:
+                return f(depth - 1) + 1
+            return main.switch()
+        g = Fiber(f, args=(100,))
+        g.switch()
+        c = g.clone()
+        assert c.switch(1) == 101
+        assert g.switch(2) == 102
+
+    @needs_clone
+    def test_throw(self):
+        main = current()
+
+        def f():
+            try:
+                main.switch()
+            except KeyError:
+                return 'caught'
+            return 'switched'
+        g = Fiber(f)
+        g.switch()
+        c = g.clone()
+        assert c.throw(KeyError) == 'caught'
+        assert g.switch() == 'switched'
+
+    @needs_clone
+    def test_switch_between_clones(self):
+        main = current()
+
+        def f():
+            v = main.switch()
+            while True:
+                v = main.switch(v) if not isinstance(v, Fiber) else v.switch('hello')
+        g = Fiber(f)
+        g.switch()
+        c = g.clone()
+        assert c.switch(g) == 'hello'
+        assert g.switch(42) == 42
+
+    @needs_clone
+    def test_subclass(self):
+        class MyFiber(Fiber):
+            pass
+        g = MyFiber(counter, args=(current(),))
+        g.attr = 42
+        g.switch()
+        c = g.clone()
+        assert type(c) is MyFiber
+        assert c.attr == 42
+        assert c.__dict__ is not g.__dict__
+
+    @needs_clone
+    def test_dropped_clones_release_frames(self):
+        main = current()
+
+        class Obj(object):
+            pass
+
+        def f():
+            obj = Obj()
+            main.switch(obj)
+            return obj
+        g = Fiber(f)
+        ref = weakref.ref(g.switch())
+        clones = [g.clone() for _ in range(10)]
+        clones[0].switch()
+        del clones
+        gc.collect()
+        assert ref() is not None
+        assert g.switch() is ref()
+        del g
+        gc.collect()
+        assert ref() is None
+
+    @needs_clone
+    def test_restrictions(self):
+        main = current()
+
+        def in_generator():
+            def gen():
+                yield main.switch()
+            for _ in gen():
+                pass
+
+        def through_c():
+            list(map(lambda _: main.switch(), [1]))
+
+        def with_kwargs(x):
+            main.switch()
+
+        class Callable(object):
+            def __call__(self):
+                main.switch()
+
+        def scheduled():
+            sched.park()
+
+        for g in (Fiber(in_generator), Fiber(through_c), Fiber(with_kwargs, kwargs={'x': 1}),
+                  Fiber(Callable()), Fiber(with_kwargs, args=(1,), stack_size=256 * 1024)):
+            g.switch()
+            with pytest.raises(fibers.error):
+                g.clone()
+            g.switch()
+            assert not g.is_alive()
+
+        def clone_parked():
+            with pytest.raises(fibers.error):
+                g.clone()
+            sched.unpark(g)
+        sched = fibers.Scheduler()
+        g = sched.spawn(scheduled)
+        sched.spawn(clone_parked)
+        sched.run()
+        assert not g.is_alive()
+
+    @needs_clone
+    def test_backtracking(self):
+        main = current()
+        solutions = []
+
+        def explore(fiber, options):
+            for i in range(options):
+                g = fiber.clone() if i < options - 1 else fiber
+                result = g.switch(i)
+                if g.is_alive():
+                    explore(g, result)
+                elif result is not None:
+                    solutions.append(result)
+        g = Fiber(queens, args=(6, main.switch))
+        explore(g, g.switch())
+        assert sorted(solutions) == [(1, 3, 5, 0, 2, 4), (2, 5, 1, 4, 0, 3), (3, 0, 4, 1, 5, 2), (4, 2, 0, 5, 3, 1)]
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -5,8 +5,11 @@ import threading
 import unittest
 
 import os
+import subprocess
 import sys
+import sysconfig
 import traceback
+import weakref
 
 import fibers
 from fibers import Fiber, current
@@ -167,6 +170,25 @@ class FiberTests(unittest.TestCase):
             th.join()
         assert len(success) == len(ths)
 
+    def test_current_per_thread(self):
+        seen = []
+
+        def in_thread():
+            main = current()
+            seen.append((main, main.parent))
+
+        def f():
+            t = threading.Thread(target=in_thread)
+            t.start()
+            t.join()
+            seen.append(current())
+        g = Fiber(f)
+        g.switch()
+        assert seen[0][0] is not g
+        assert seen[0][1] is None
+        assert seen[1] is g
+        assert current() is not g
+
     def test_thread_bug(self):
         def runner(x):
             g = Fiber(lambda: time.sleep(x))
@@ -178,6 +200,35 @@ class FiberTests(unittest.TestCase):
         t1.join()
         t2.join()
 
+    def test_switch_values_per_thread(self):
+        # without the GIL, fibers on all threads switch at the same time
+        results = {}
+
+        def echo(main):
+            value = main.switch()
+            while True:
+                value = main.switch(value)
+
+        def runner(n):
+            g = Fiber(echo, args=(current(),))
+            g.switch()
+            results[n] = all(g.switch((n, i)) == (n, i) for i in range(10000))
+        ths = [threading.Thread(target=runner, args=(n,)) for n in range(8)]
+        for th in ths:
+            th.start()
+        for th in ths:
+            th.join()
+        assert results == dict.fromkeys(range(8), True)
+
+    @pytest.mark.skipif(not sysconfig.get_config_var('Py_GIL_DISABLED'), reason='needs a free-threaded build')
+    def test_gil_enabled(self):
+        # the extension only runs without the GIL if built with FIBERS_GIL_NOT_USED
+        env = dict(os.environ)
+        env.pop('PYTHON_GIL', None)
+        out = subprocess.check_output([sys.executable, '-W', 'ignore', '-c',
+                                       'import fibers, sys; print(sys._is_gil_enabled())'], env=env)
+        assert out.strip() == (b'False' if os.environ.get('FIBERS_GIL_NOT_USED') else b'True')
+
     def test_switch_after_thread_of_prev_fiber_exited(self):
         def thread1():
             def fiber1():
@@ -222,6 +273,43 @@ class FiberTests(unittest.TestCase):
         done_event.set()
         thread.join()
 
+    def test_drop_from_another_thread(self):
+        data = {}
+        created_event = threading.Event()
+        dropped_event = threading.Event()
+
+        def suspend(depth):
+            if depth:
+                return suspend(depth - 1)
+            current().parent.switch()
+
+        def foo():
+            fs = [Fiber(suspend, (n % 4,)) for n in range(20)]
+            for f in fs:
+                f.switch()
+            in_use = fibers.stack_pool_info()['in_use']
+            data['fs'] = fs
+            del fs, f
+            created_event.set()
+            dropped_event.wait()
+            # their stacks are released by the next switch of this thread
+            dropped = fibers.stack_pool_info()['in_use']
+            Fiber(lambda: None).switch()
+            data['in_use'] = (in_use, dropped, fibers.stack_pool_info()['in_use'])
+
+        thread = threading.Thread(target=foo)
+        thread.start()
+        created_event.wait()
+        refs = [weakref.ref(f) for f in data['fs']]
+        del data['fs']
+        assert all(r() is None for r in refs)
+        dropped_event.set()
+        thread.join()
+        before, dropped, after = data['in_use']
+        assert before > 0
+        assert dropped == before
+        assert after == 0
+
     def test_threaded_reparent(self):
         data = {}
         created_event = threading.Event()
@@ -355,6 +443,47 @@ class FiberTests(unittest.TestCase):
         with pytest.raises(TypeError):
             copy.deepcopy(Fiber())
 
+    def test_arguments(self):
+        main = current()
+        f = lambda *args, **kwargs: (args, kwargs)
+        assert Fiber(f).switch() == ((), {})
+        assert Fiber(f, (1,), {'a': 2}, main).switch() == ((1,), {'a': 2})
+        assert Fiber(target=f, kwargs={'a': 2}, args=(1,), parent=main).switch() == ((1,), {'a': 2})
+        assert Fiber(f, kwargs={'a': 2}).parent is main
+        assert Fiber().switch() is None
+        with pytest.raises(TypeError):
+            Fiber(f, (), {}, main, 0, 1)
+        with pytest.raises(TypeError):
+            Fiber(f, target=f)
+        with pytest.raises(TypeError):
+            Fiber(f, foo=1)
+        with pytest.raises(TypeError):
+            Fiber(f, parent=42)
+        with pytest.raises(TypeError):
+            Fiber(f, stack_size=1.5)
+        with pytest.raises(TypeError):
+            Fiber(42)
+        with pytest.raises(TypeError):
+            Fiber(f, [])
+        with pytest.raises(TypeError):
+            Fiber(f, (), [])
+        with pytest.raises(ValueError):
+            Fiber(f, stack_size=1)
+
+    def test_subclass_arguments(self):
+        class MyFiber(Fiber):
+            def __init__(self, value):
+                Fiber.__init__(self, target=lambda: value)
+        g = MyFiber(42)
+        assert type(g) is MyFiber
+        assert g.switch() == 42
+
+        class Other(Fiber):
+            pass
+        g = Other(target=lambda: 1)
+        assert type(g) is Other
+        assert g.switch() == 1
+
     def test_finished_parent(self):
         def f():
             return 42
@@ -365,6 +494,87 @@ class FiberTests(unittest.TestCase):
             Fiber(parent=g)
 
 
+class ResetTests(unittest.TestCase):
+
+    def test_reset(self):
+        g = Fiber(lambda: 1)
+        assert g.switch() == 1
+        assert not g.is_alive()
+        g.reset(lambda a, b=0: a + b, (1,), {'b': 2})
+        assert g.is_alive()
+        assert g.switch() == 3
+        g.reset()
+        assert g.switch() is None
+        assert not g.is_alive()
+
+    def test_keeps_parent_and_attributes(self):
+        main = current()
+
+        def loop():
+            value = main.switch()
+            while True:
+                value = main.switch(value)
+        parent = Fiber(loop)
+        parent.switch()
+        g = Fiber(lambda: 1, parent=parent)
+        g.attr = 42
+        assert g.switch() == 1
+        g.reset(lambda: current().attr)
+        assert g.parent is parent
+        assert g.switch() == 42
+
+    def test_not_ended(self):
+        main = current()
+        g = Fiber(lambda: main.switch())
+        with pytest.raises(fibers.error):
+            g.reset(lambda: None)
+        g.switch()
+        with pytest.raises(fibers.error):
+            g.reset(lambda: None)
+        with pytest.raises(fibers.error):
+            main.reset(lambda: None)
+
+        def f():
+            current().reset(lambda: None)
+        with pytest.raises(fibers.error):
+            Fiber(f).switch()
+
+    def test_invalid_arguments(self):
+        g = Fiber()
+        g.switch()
+        with pytest.raises(TypeError):
+            g.reset(42)
+        with pytest.raises(TypeError):
+            g.reset(lambda: None, [])
+        with pytest.raises(TypeError):
+            g.reset(lambda: None, (), [])
+        assert not g.is_alive()
+        g.reset(lambda: 1)
+        assert g.switch() == 1
+
+    @pytest.mark.skipif(not hasattr(fibers, 'Scheduler'), reason='Scheduler is not available')
+    def test_scheduler(self):
+        sched = fibers.Scheduler()
+        lst = []
+        g = sched.spawn(lst.append, 1)
+        sched.run()
+        g.reset(lst.append, (2,))
+        sched.unpark(g)
+        sched.run()
+        assert lst == [1, 2]
+
+    @pytest.mark.skipif(sys.platform == 'win32', reason='separate stacks are not supported on Windows')
+    def test_stack_size(self):
+        def depth(n):
+            return depth(n - 1) + 1 if n else 0
+        # before 3.11 each Python call nests C frames too
+        g = Fiber(depth, (100,), stack_size=512 * 1024)
+        assert g.switch() == 100
+        for n in (200, 300):
+            g.reset(depth, (n,))
+            assert g.switch() == n
+
+
 if __name__ == '__main__':
     unittest.main(verbosity=2)
 
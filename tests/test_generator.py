@@ -66,6 +66,120 @@ class GeneratorTests(unittest.TestCase):
         assert seen == 3 * [0, 0, 1, 1, 2, 2, 3, 3, 4, 4]
 
 
+@unittest.skipIf(not hasattr(fibers, 'Generator'), 'Generator is not available')
+class NativeGeneratorTests(unittest.TestCase):
+    def test_iterate(self):
+        def g(n):
+            for i in range(n):
+                fibers.yield_(i)
+        gen = fibers.Generator(g, (5,))
+        assert iter(gen) is gen
+        assert list(gen) == [0, 1, 2, 3, 4]
+        assert not gen.is_alive()
+        assert list(gen) == []
+        self.assertRaises(StopIteration, next, gen)
+
+    def test_return_value(self):
+        def g():
+            fibers.yield_(1)
+            return 42
+        gen = fibers.Generator(g)
+        assert next(gen) == 1
+        with self.assertRaises(StopIteration) as cm:
+            next(gen)
+        assert cm.exception.value == 42
+
+    def test_send(self):
+        def g():
+            value = fibers.yield_()
+            while True:
+                value = fibers.yield_(value * 2)
+        gen = fibers.Generator(g)
+        self.assertRaises(TypeError, gen.send, 1)
+        assert gen.send(None) is None
+        assert gen.send(3) == 6
+        assert gen.send(5) == 10
+
+    def test_yield_from_child(self):
+        seen = []
+
+        def child(n):
+            for i in range(n):
+                fibers.yield_(i * 10)
+            seen.append('child')
+
+        def g():
+            fibers.yield_('a')
+            f = Fiber(child, (3,))
+            f.switch()
+            fibers.yield_('b')
+        gen = fibers.Generator(g)
+        assert list(gen) == ['a', 0, 10, 20, 'b']
+        assert seen == ['child']
+
+    def test_nested_generators(self):
+        def inner():
+            fibers.yield_(1)
+            fibers.yield_(2)
+
+        def outer():
+            for value in fibers.Generator(inner):
+                fibers.yield_(value * 10)
+        assert list(fibers.Generator(outer)) == [10, 20]
+
+    def test_consumers(self):
+        def g():
+            for i in range(4):
+                fibers.yield_(i)
+        gen = fibers.Generator(g)
+        lst = [next(gen)]
+        f = Fiber(lambda: lst.append(next(gen)))
+        f.switch()
+        lst.append(next(gen))
+        assert lst == [0, 1, 2]
+
+    def test_yield_outside_generator(self):
+        self.assertRaises(fibers.error, fibers.yield_, 1)
+        f = Fiber(fibers.yield_, (1,))
+        self.assertRaises(fibers.error, f.switch)
+        self.assertRaises(TypeError, fibers.yield_, 1, 2)
+
+    def test_already_executing(self):
+        errors = []
+
+        def g():
+            try:
+                next(gen)
+            except ValueError as e:
+                errors.append(e)
+            fibers.yield_(1)
+        gen = fibers.Generator(g)
+        assert list(gen) == [1]
+        assert len(errors) == 1
+
+    def test_exception(self):
+        class SomeError(Exception):
+            pass
+
+        def g():
+            fibers.yield_(1)
+            raise SomeError
+        gen = fibers.Generator(g)
+        assert next(gen) == 1
+        self.assertRaises(SomeError, next, gen)
+        self.assertRaises(StopIteration, next, gen)
+
+    def test_subclass(self):
+        class MyGenerator(fibers.Generator):
+            def __init__(self, n):
+                fibers.Generator.__init__(self, self.produce, (n,))
+
+            def produce(self, n):
+                for i in range(n):
+                    fibers.yield_(i)
+        assert list(MyGenerator(3)) == [0, 1, 2]
+
+
 if __name__ == '__main__':
     unittest.main(verbosity=2)
 
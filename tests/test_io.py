@@ -0,0 +1,408 @@
+
+import os
+import socket
+import sys
+import tempfile
+import time
+import unittest
+
+import fibers
+import pytest
+
+
+pytestmark = pytest.mark.skipif(not hasattr(fibers, 'Scheduler'), reason='Scheduler is not available')
+
+needs_epoll = pytest.mark.skipif(not sys.platform.startswith('linux'), reason='waiting for fds needs epoll')
+
+
+def has_io_uring():
+    try:
+        return fibers.Scheduler(io_uring=True).io_uring
+    except (AttributeError, fibers.error):
+        return False
+
+
+class SleepTests(unittest.TestCase):
+
+    def test_sleep(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f(name, t):
+            sched.sleep(t)
+            lst.append(name)
+        sched.spawn(f, 'b', 0.02)
+        sched.spawn(f, 'a', 0.01)
+        sched.spawn(f, 'c', 0.03)
+        t0 = time.monotonic()
+        sched.run()
+        assert time.monotonic() - t0 >= 0.03
+        assert lst == ['a', 'b', 'c']
+
+    def test_sleep_zero(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f(name):
+            sched.sleep(0)
+            lst.append(name)
+        for name in 'abc':
+            sched.spawn(f, name)
+        sched.run()
+        assert lst == ['a', 'b', 'c']
+
+    def test_sleep_runs_others(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def sleeper():
+            sched.sleep(0.01)
+            lst.append('slept')
+
+        def busy():
+            for i in range(3):
+                lst.append(i)
+                sched.yield_()
+        sched.spawn(sleeper)
+        sched.spawn(busy)
+        sched.run()
+        assert lst == [0, 1, 2, 'slept']
+
+    def test_sleep_not_in_scheduler(self):
+        sched = fibers.Scheduler()
+        with pytest.raises(fibers.error):
+            sched.sleep(0)
+
+    def test_throw_into_sleeping(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f():
+            try:
+                sched.sleep(10)
+            except KeyError:
+                lst.append('thrown')
+        g = sched.spawn(f)
+        sched.spawn(lambda: g.throw(KeyError))
+        t0 = time.monotonic()
+        sched.run()
+        assert time.monotonic() - t0 < 1
+        assert lst == ['thrown']
+
+
+@needs_epoll
+class IOTests(unittest.TestCase):
+
+    def setUp(self):
+        self.sched = fibers.Scheduler()
+        self.a, self.b = socket.socketpair()
+        self.a.setblocking(False)
+        self.b.setblocking(False)
+
+    def tearDown(self):
+        self.a.close()
+        self.b.close()
+
+    def test_readable(self):
+        lst = []
+
+        def reader():
+            assert self.sched.wait_readable(self.a) is True
+            lst.append(self.a.recv(10))
+
+        def writer():
+            self.sched.sleep(0.01)
+            lst.append('send')
+            self.b.send(b'hello')
+        self.sched.spawn(reader)
+        self.sched.spawn(writer)
+        self.sched.run()
+        assert lst == ['send', b'hello']
+
+    def test_writable(self):
+        result = []
+        self.sched.spawn(lambda: result.append(self.sched.wait_writable(self.a.fileno())))
+        self.sched.run()
+        assert result == [True]
+
+    def test_timeout(self):
+        result = []
+        self.sched.spawn(lambda: result.append(self.sched.wait_readable(self.a, timeout=0.01)))
+        self.sched.run()
+        assert result == [False]
+        # the fd can be waited for again
+        self.b.send(b'x')
+        self.sched.spawn(lambda: result.append(self.sched.wait_readable(self.a, 1)))
+        self.sched.run()
+        assert result == [False, True]
+
+    def test_read_and_write_waiters(self):
+        lst = []
+
+        def reader():
+            self.sched.wait_readable(self.a)
+            lst.append('readable')
+
+        def writer():
+            self.sched.wait_writable(self.a)
+            lst.append('writable')
+            self.b.send(b'x')
+        self.sched.spawn(reader)
+        self.sched.spawn(writer)
+        self.sched.run()
+        assert lst == ['writable', 'readable']
+
+    def test_already_waiting(self):
+        errors = []
+
+        def reader():
+            try:
+                self.sched.wait_readable(self.a, timeout=0.01)
+            except fibers.error as e:
+                errors.append(e)
+        self.sched.spawn(reader)
+        self.sched.spawn(reader)
+        self.sched.run()
+        assert len(errors) == 1
+
+    def test_invalid_fd(self):
+        def f():
+            self.sched.wait_readable(-1)
+        self.sched.spawn(f)
+        with pytest.raises(ValueError):
+            self.sched.run()
+
+    def test_not_in_scheduler(self):
+        with pytest.raises(fibers.error):
+            self.sched.wait_readable(self.a)
+
+    def test_busy_fibers_dont_starve_io(self):
+        lst = []
+        self.b.send(b'x')
+
+        def reader():
+            self.sched.wait_readable(self.a)
+            lst.append('readable')
+
+        def busy():
+            while not lst:
+                self.sched.yield_()
+        self.sched.spawn(reader)
+        self.sched.spawn(busy)
+        self.sched.run()
+        assert lst == ['readable']
+
+    def test_echo_many(self):
+        n = 200
+        pairs = [socket.socketpair() for _ in range(n)]
+        results = []
+
+        def echo(sock):
+            self.sched.wait_readable(sock)
+            data = sock.recv(100)
+            self.sched.wait_writable(sock)
+            sock.send(data)
+
+        def client(sock, i):
+            self.sched.wait_writable(sock)
+            sock.send(b'%d' % i)
+            self.sched.wait_readable(sock)
+            results.append(int(sock.recv(100)))
+        try:
+            for i, (a, b) in enumerate(pairs):
+                a.setblocking(False)
+                b.setblocking(False)
+                self.sched.spawn(echo, a)
+                self.sched.spawn(client, b, i)
+            self.sched.run()
+        finally:
+            for a, b in pairs:
+                a.close()
+                b.close()
+        assert sorted(results) == list(range(n))
+
+
+@needs_epoll
+class OpsTests(unittest.TestCase):
+    io_uring = False
+
+    def setUp(self):
+        self.sched = fibers.Scheduler(io_uring=self.io_uring)
+        assert self.sched.io_uring == self.io_uring
+
+    def run_fibers(self, *funcs):
+        results = []
+        for func in funcs:
+            self.sched.spawn(lambda f=func: results.append(f()))
+        self.sched.run()
+        return results
+
+    def test_recv_send(self):
+        a, b = socket.socketpair()
+        a.setblocking(False)
+        b.setblocking(False)
+        with a, b:
+            results = self.run_fibers(lambda: self.sched.recv(a, 100), lambda: self.sched.send(b, b'hello'))
+        assert results == [5, b'hello']
+
+    def test_accept(self):
+        server = socket.socket()
+        server.bind(('127.0.0.1', 0))
+        server.listen(10)
+        server.setblocking(False)
+        client = socket.socket()
+
+        def connect():
+            client.connect(server.getsockname())
+            return 'connected'
+        with server, client:
+            results = self.run_fibers(lambda: self.sched.accept(server), connect)
+            fd = results[1]
+            assert not os.get_blocking(fd)
+            with socket.socket(fileno=fd) as conn:
+                conn.sendall(b'x')
+                assert client.recv(1) == b'x'
+        assert results[0] == 'connected'
+
+    def test_accept_blocking(self):
+        # only the fiber waits for the connection, not the whole thread
+        server = socket.socket()
+        server.bind(('127.0.0.1', 0))
+        server.listen(10)
+        client = socket.socket()
+        lst = []
+
+        def accept():
+            fd = self.sched.accept(server)
+            os.close(fd)
+            lst.append('accepted')
+
+        def connect():
+            lst.append('connecting')
+            client.connect(server.getsockname())
+        with server, client:
+            self.run_fibers(accept, connect)
+        assert lst == ['connecting', 'accepted']
+
+    def test_file(self):
+        with tempfile.TemporaryFile() as f:
+            def op():
+                assert self.sched.write(f, b'hello world') == 11
+                self.sched.fsync(f)
+                return self.sched.read(f, 5, offset=6), self.sched.read(f, 100, 0)
+            assert self.run_fibers(op) == [(b'world', b'hello world')]
+
+    def test_pipe(self):
+        r, w = os.pipe()
+        os.set_blocking(r, False)
+        try:
+            results = self.run_fibers(lambda: self.sched.read(r, 10), lambda: self.sched.write(w, bytearray(b'abc')))
+        finally:
+            os.close(r)
+            os.close(w)
+        assert results == [3, b'abc']
+
+    def test_error(self):
+        r, w = os.pipe()
+        os.close(w)
+        try:
+            def op():
+                with pytest.raises(OSError):
+                    self.sched.write(r, b'x')
+                return 'raised'
+            assert self.run_fibers(op) == ['raised']
+        finally:
+            os.close(r)
+
+    def test_not_in_scheduler(self):
+        with pytest.raises(fibers.error):
+            self.sched.read(0, 1)
+
+    def test_throw_into_blocked(self):
+        a, b = socket.socketpair()
+        a.setblocking(False)
+        lst = []
+
+        def reader():
+            try:
+                self.sched.recv(a, 10)
+            except KeyError:
+                lst.append('thrown')
+        with a, b:
+            g = self.sched.spawn(reader)
+            self.sched.spawn(lambda: g.throw(KeyError))
+            self.sched.run()
+        assert lst == ['thrown']
+
+    def test_echo_many(self):
+        n = 300
+        pairs = [socket.socketpair() for _ in range(n)]
+
+        def echo(sock):
+            self.sched.send(sock, self.sched.recv(sock, 100))
+
+        def client(sock, i):
+            self.sched.send(sock, b'%d' % i)
+            return int(self.sched.recv(sock, 100))
+        try:
+            results = []
+            for i, (a, b) in enumerate(pairs):
+                a.setblocking(False)
+                b.setblocking(False)
+                self.sched.spawn(echo, a)
+                self.sched.spawn(lambda b=b, i=i: results.append(client(b, i)))
+            self.sched.run()
+        finally:
+            for a, b in pairs:
+                a.close()
+                b.close()
+        assert sorted(results) == list(range(n))
+
+
+@pytest.mark.skipif(not has_io_uring(), reason='io_uring is not available')
+class IOUringOpsTests(OpsTests):
+    io_uring = True
+
+    @pytest.mark.skipif(not os.path.isdir('/proc/self/fd'), reason='needs /proc/self/fd')
+    def test_throw_into_accept(self):
+        # a connection accepted after the fiber stopped waiting is closed
+        server = socket.socket()
+        server.bind(('127.0.0.1', 0))
+        server.listen(20)
+        clients = [socket.socket() for i in range(20)]
+        lst = []
+
+        def accept():
+            try:
+                os.close(self.sched.accept(server))
+                lst.append('accepted')
+            except KeyError:
+                lst.append('thrown')
+
+        def throw(g, n):
+            # before or after the accept completed
+            for i in range(n):
+                self.sched.yield_()
+            if g.is_alive():
+                g.throw(KeyError)
+        try:
+            for c in clients:
+                c.connect(server.getsockname())
+            # the scheduler has its own fds once used
+            self.run_fibers(accept)
+            nfds = len(os.listdir('/proc/self/fd'))
+            for i in range(len(clients) - 1):
+                g = self.sched.spawn(accept)
+                self.sched.spawn(throw, g, i % 4)
+            self.sched.run()
+            assert len(os.listdir('/proc/self/fd')) <= nfds
+        finally:
+            server.close()
+            for c in clients:
+                c.close()
+        assert 'thrown' in lst
+        assert len(lst) == len(clients)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -1,6 +1,8 @@
 
 import gc
+import itertools
 import threading
+import tracemalloc
 import unittest
 import weakref
 
@@ -79,6 +81,34 @@ class ArgRefcountTests(unittest.TestCase):
             assert g() is None
 
 
+class SwitchAllocationTests(unittest.TestCase):
+
+    def test_switch_does_not_allocate(self):
+        # frame objects used to be created on every switch
+        if is_pypy or not hasattr(tracemalloc, 'reset_peak'):
+            return
+        main = current()
+
+        def f():
+            while True:
+                main.switch()
+        g = Fiber(f)
+        g.switch()
+        repeat = itertools.repeat
+
+        def peak_growth(n):
+            tracemalloc.reset_peak()
+            before = tracemalloc.get_traced_memory()[0]
+            for _ in repeat(None, n):
+                g.switch()
+            return tracemalloc.get_traced_memory()[1] - before
+        tracemalloc.start()
+        try:
+            peak_growth(100)
+            assert peak_growth(1000) == peak_growth(0)
+        finally:
+            tracemalloc.stop()
+
 if __name__ == '__main__':
     unittest.main(verbosity=2)
 
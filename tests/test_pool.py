@@ -0,0 +1,174 @@
+
+import gc
+import threading
+import unittest
+import weakref
+
+import fibers
+from fibers import Fiber, current
+import pytest
+
+
+pytestmark = pytest.mark.skipif(not hasattr(fibers, 'FiberPool'), reason='FiberPool is not available')
+
+
+class SomeError(Exception):
+    pass
+
+
+class FiberPoolTests(unittest.TestCase):
+
+    def test_submit_run(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 4)
+        lst = []
+        for i in range(20):
+            pool.submit(lst.append, i)
+        pool.submit(lambda a, b=None: lst.append((a, b)), 1, b=2)
+        assert pool.workers == 4
+        assert pool.pending == 21
+        sched.run()
+        assert lst == list(range(20)) + [(1, 2)]
+        assert pool.pending == 0
+        assert pool.workers == pool.idle == 4
+
+    def test_workers_are_reused(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 2)
+        seen = set()
+        for _ in range(3):
+            for _ in range(10):
+                pool.submit(lambda: seen.add(current()))
+            sched.run()
+        assert len(seen) == 2
+
+    def test_defaults(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched)
+        assert pool.size == 16
+        assert pool.scheduler is sched
+        assert pool.workers == pool.idle == pool.pending == 0
+        with pytest.raises(ValueError):
+            fibers.FiberPool(sched, 0)
+        with pytest.raises(TypeError):
+            fibers.FiberPool(None)
+        with pytest.raises(TypeError):
+            pool.submit(42)
+        with pytest.raises(TypeError):
+            pool.submit()
+
+    def test_blocking_tasks(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 3)
+        ch = fibers.Channel()
+        lst = []
+
+        def consumer():
+            for value in ch:
+                lst.append(value)
+        for _ in range(3):
+            pool.submit(consumer)
+        # all the workers are busy, this one waits for one of them
+        pool.submit(ch.close)
+        sched.spawn(ch.send_many, range(10))
+        sched.run()
+        assert sorted(lst) == list(range(10))
+        assert pool.workers == 3
+
+    def test_other_fibers_run_between_tasks(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 1)
+        lst = []
+        for i in range(3):
+            pool.submit(lst.append, i)
+
+        def other():
+            for i in range(3):
+                lst.append('x')
+                sched.yield_()
+        sched.spawn(other)
+        sched.run()
+        assert lst == [0, 'x', 1, 'x', 2, 'x']
+
+    def test_submit_from_task(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 2)
+        lst = []
+
+        def task(n):
+            lst.append(n)
+            if n:
+                pool.submit(task, n - 1)
+        pool.submit(task, 5)
+        sched.run()
+        assert lst == [5, 4, 3, 2, 1, 0]
+
+    def test_error(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 1)
+        lst = []
+
+        def fail():
+            raise SomeError
+        pool.submit(fail)
+        pool.submit(lst.append, 1)
+        with pytest.raises(SomeError):
+            sched.run()
+        assert pool.workers == 1
+        # the task left behind gets a new worker
+        sched.run()
+        assert lst == [1]
+        assert pool.workers == pool.idle == 1
+
+    def test_close(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 2)
+        lst = []
+        pool.submit(lst.append, 1)
+        sched.run()
+        assert pool.idle == 1
+        pool.submit(lst.append, 2)
+        pool.close()
+        with pytest.raises(fibers.error):
+            pool.submit(lst.append, 3)
+        sched.run()
+        assert lst == [1, 2]
+        assert pool.workers == pool.idle == 0
+
+    def test_other_thread(self):
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched)
+        errors = []
+
+        def run():
+            try:
+                pool.submit(lambda: None)
+            except fibers.error as e:
+                errors.append(e)
+        t = threading.Thread(target=run)
+        t.start()
+        t.join()
+        assert len(errors) == 1
+        assert pool.pending == 0
+
+    def test_closed_pool_is_released(self):
+        class Obj(object):
+            pass
+        sched = fibers.Scheduler()
+        pool = fibers.FiberPool(sched, 4)
+        obj = Obj()
+        for _ in range(4):
+            pool.submit(lambda obj: None, obj)
+        sched.run()
+        assert pool.idle == 4
+        pool.submit(lambda obj: None, obj)
+        pool.close()
+        sched.run()
+        refs = [weakref.ref(pool), weakref.ref(obj)]
+        del pool, obj
+        gc.collect()
+        assert [ref() for ref in refs] == [None, None]
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,322 @@
+
+import gc
+import threading
+import unittest
+import weakref
+
+import fibers
+from fibers import Fiber, current
+import pytest
+
+
+pytestmark = pytest.mark.skipif(not hasattr(fibers, 'Scheduler'), reason='Scheduler is not available')
+needs_stats = pytest.mark.skipif(not hasattr(fibers, 'stats'), reason='statistics are not available')
+
+
+class SchedulerTests(unittest.TestCase):
+
+    def test_spawn_run(self):
+        sched = fibers.Scheduler()
+        lst = []
+        sched.spawn(lst.append, 1)
+        sched.spawn(lambda a, b=None: lst.append((a, b)), 2, b=3)
+        assert sched.ready == 2
+        sched.run()
+        assert lst == [1, (2, 3)]
+        assert sched.ready == 0
+
+    def test_spawn_returns_fiber(self):
+        sched = fibers.Scheduler()
+        f = sched.spawn(lambda: None)
+        assert isinstance(f, Fiber)
+        assert f.is_alive()
+        sched.run()
+        assert not f.is_alive()
+
+    def test_yield_round_robin(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f(name):
+            for i in range(3):
+                lst.append((name, i))
+                sched.yield_()
+        for name in 'abc':
+            sched.spawn(f, name)
+        sched.run()
+        assert lst == [(name, i) for i in range(3) for name in 'abc']
+
+    def test_yield_alone(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f():
+            for i in range(3):
+                sched.yield_()
+                lst.append(i)
+        sched.spawn(f)
+        sched.run()
+        assert lst == [0, 1, 2]
+
+    def test_spawn_from_fiber(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def child(i):
+            lst.append(i)
+
+        def parent():
+            for i in range(3):
+                sched.spawn(child, i)
+            lst.append('parent')
+        sched.spawn(parent)
+        sched.run()
+        assert lst == ['parent', 0, 1, 2]
+
+    def test_ended_fibers_return_to_hub(self):
+        sched = fibers.Scheduler()
+        gs = [sched.spawn(lambda: None) for _ in range(3)]
+        # the parent is reset to the fiber which calls run()
+        h = Fiber(sched.run)
+        h.switch()
+        assert all(g.parent is h for g in gs)
+        assert not h.is_alive()
+
+    def test_park_unpark(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def waiter():
+            lst.append('park')
+            sched.park()
+            lst.append('unparked')
+
+        def waker(g):
+            lst.append('wake')
+            sched.unpark(g)
+        g = sched.spawn(waiter)
+        sched.spawn(waker, g)
+        sched.run()
+        assert lst == ['park', 'wake', 'unparked']
+
+    def test_park_forever(self):
+        sched = fibers.Scheduler()
+
+        def f():
+            sched.park()
+        g = sched.spawn(f)
+        sched.run()
+        assert g.is_alive()
+        assert sched.ready == 0
+        # the scheduler can be run again
+        sched.unpark(g)
+        sched.run()
+        assert not g.is_alive()
+
+    def test_unpark_twice(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f():
+            sched.park()
+            lst.append(1)
+        g = sched.spawn(f)
+        sched.run()
+        sched.unpark(g)
+        sched.unpark(g)
+        assert sched.ready == 1
+        sched.run()
+        assert lst == [1]
+
+    def test_unpark_self(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f():
+            sched.unpark(current())
+            sched.park()
+            lst.append(1)
+        sched.spawn(f)
+        sched.run()
+        assert lst == [1]
+
+    def test_unpark_fiber(self):
+        sched = fibers.Scheduler()
+        lst = []
+        g = Fiber(lst.append, args=(1,))
+        sched.unpark(g)
+        sched.run()
+        assert lst == [1]
+
+    def test_unpark_separate_stack(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f():
+            for i in range(3):
+                lst.append(i)
+                sched.yield_()
+        sched.unpark(Fiber(f, stack_size=256 * 1024))
+        sched.spawn(f)
+        sched.run()
+        assert lst == [0, 0, 1, 1, 2, 2]
+
+    def test_unpark_ended(self):
+        sched = fibers.Scheduler()
+        g = Fiber(lambda: None)
+        g.switch()
+        with pytest.raises(fibers.error):
+            sched.unpark(g)
+
+    def test_unpark_other_scheduler(self):
+        s1 = fibers.Scheduler()
+        s2 = fibers.Scheduler()
+        g = s1.spawn(lambda: None)
+        with pytest.raises(fibers.error):
+            s2.unpark(g)
+
+    def test_exception_propagates(self):
+        sched = fibers.Scheduler()
+        lst = []
+
+        def f():
+            raise KeyError('boom')
+        sched.spawn(f)
+        sched.spawn(lst.append, 1)
+        with pytest.raises(KeyError):
+            sched.run()
+        assert sched.ready == 1
+        sched.run()
+        assert lst == [1]
+
+    def test_not_in_scheduler(self):
+        sched = fibers.Scheduler()
+        with pytest.raises(fibers.error):
+            sched.yield_()
+        with pytest.raises(fibers.error):
+            sched.park()
+
+    def test_other_scheduler(self):
+        s1 = fibers.Scheduler()
+        s2 = fibers.Scheduler()
+        errors = []
+
+        def f():
+            try:
+                s2.yield_()
+            except fibers.error as e:
+                errors.append(e)
+        s1.spawn(f)
+        s1.run()
+        assert len(errors) == 1
+
+    def test_run_twice(self):
+        sched = fibers.Scheduler()
+        errors = []
+
+        def f():
+            try:
+                sched.run()
+            except fibers.error as e:
+                errors.append(e)
+        sched.spawn(f)
+        sched.run()
+        assert len(errors) == 1
+
+    def test_different_thread(self):
+        sched = fibers.Scheduler()
+        errors = []
+
+        def runner():
+            try:
+                sched.run()
+            except fibers.error as e:
+                errors.append(e)
+            try:
+                sched.unpark(Fiber(lambda: None))
+            except fibers.error as e:
+                errors.append(e)
+        t = threading.Thread(target=runner)
+        t.start()
+        t.join()
+        assert len(errors) == 2
+
+    def test_many_fibers(self):
+        sched = fibers.Scheduler()
+        count = [0]
+
+        def f():
+            for _ in range(10):
+                count[0] += 1
+                sched.yield_()
+        for _ in range(1000):
+            sched.spawn(f)
+        sched.run()
+        assert count[0] == 10000
+
+    def test_dealloc(self):
+        sched = fibers.Scheduler()
+
+        def f():
+            sched.park()
+        g = sched.spawn(f)
+        sched.spawn(lambda: None)
+        r1 = weakref.ref(sched)
+        r2 = weakref.ref(g)
+        del sched, g
+        gc.collect()
+        assert r1() is None
+        assert r2() is None
+
+
+def nest(depth, func):
+    # call through C code, so that the C stack grows too
+    if depth == 0:
+        return func()
+    return list(map(nest, [depth - 1], [func]))
+
+
+class StackOrderTests(unittest.TestCase):
+
+    def run_mixed(self, stack_order):
+        sched = fibers.Scheduler(stack_order=stack_order)
+        log = []
+
+        def f(name):
+            for i in range(50):
+                log.append((name, i))
+                sched.yield_()
+        # half of them on the C stack, half on their own stack
+        for name in range(4):
+            stack_size = 256 * 1024 if name % 2 else 0
+            sched.unpark(Fiber(nest, (20, lambda name=name: f(name)), stack_size=stack_size))
+        sched.run()
+        return log
+
+    def test_default(self):
+        assert fibers.Scheduler().stack_order is False
+        assert fibers.Scheduler(stack_order=True).stack_order is True
+
+    def test_all_run(self):
+        log = self.run_mixed(True)
+        assert len(log) == 200
+        for name in range(4):
+            steps = [i for i, (n, step) in enumerate(log) if n == name]
+            assert [log[i][1] for i in steps] == list(range(50))
+            # the first ready Fiber is taken at least every 8 picks
+            assert max(b - a for a, b in zip(steps, steps[1:])) <= 16
+
+    @needs_stats
+    def test_less_copied(self):
+        copied = []
+        for stack_order in (False, True):
+            before = fibers.stats()['thread']
+            self.run_mixed(stack_order)
+            after = fibers.stats()['thread']
+            copied.append(after['saved_bytes'] + after['restored_bytes'] -
+                          before['saved_bytes'] - before['restored_bytes'])
+        assert copied[1] < copied[0] * 0.8
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
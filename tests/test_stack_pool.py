@@ -0,0 +1,467 @@
+
+import gc
+import sys
+import threading
+import time
+import tracemalloc
+import unittest
+
+import fibers
+from fibers import Fiber, current
+import pytest
+
+
+is_pypy = hasattr(sys, 'pypy_version_info')
+
+needs_stats = pytest.mark.skipif(not hasattr(fibers, 'stats'), reason='statistics are not available')
+
+
+class SomeError(Exception):
+    pass
+
+
+def ping_pong(n):
+    def f():
+        main = current().parent
+        while True:
+            # at another depth every other time, so that the buffer it was
+            # resumed from can't be used again and one comes from the pool
+            main.switch()
+            list(map(main.switch, [None]))
+    g = Fiber(f)
+    for i in range(n):
+        g.switch()
+    return g
+
+
+@pytest.mark.skipif(is_pypy, reason='stacks are managed by PyPy')
+class StackPoolTests(unittest.TestCase):
+
+    def tearDown(self):
+        fibers.set_stack_pool_limit(1024 * 1024)
+
+    def test_default_limit(self):
+        assert fibers.stack_pool_info()['limit'] == 1024 * 1024
+
+    def test_reuse(self):
+        ping_pong(10)
+        misses = fibers.stack_pool_info()['misses']
+        hits = fibers.stack_pool_info()['hits']
+        ping_pong(1000)
+        info = fibers.stack_pool_info()
+        assert info['hits'] - hits >= 990
+        assert info['misses'] - misses < 10
+        assert info['retained'] <= info['limit']
+
+    def test_disabled(self):
+        fibers.set_stack_pool_limit(0)
+        info = fibers.stack_pool_info()
+        assert info['limit'] == 0
+        assert info['retained'] == 0
+        misses = info['misses']
+        ping_pong(100)
+        info = fibers.stack_pool_info()
+        assert info['misses'] - misses >= 100
+        assert info['retained'] == 0
+
+    def test_invalid_limit(self):
+        with pytest.raises(ValueError):
+            fibers.set_stack_pool_limit(-1)
+
+
+def nest(n):
+    if n == 0:
+        return current().parent.switch()
+    return list(map(nest, [n - 1]))
+
+
+@pytest.mark.skipif(is_pypy, reason='stacks are managed by PyPy')
+class StackMemoryTests(unittest.TestCase):
+
+    def tearDown(self):
+        fibers.set_stack_budget(0)
+
+    def test_in_use(self):
+        before = fibers.stack_pool_info()
+        assert before['budget'] == 0
+        g = Fiber(nest, args=(30,))
+        g.switch()
+        assert fibers.stack_pool_info()['in_use'] - before['in_use'] > 10000
+        g.switch()
+        assert fibers.stack_pool_info()['in_use'] == before['in_use']
+
+    def test_sizeof(self):
+        g = Fiber(nest, args=(30,))
+        empty = sys.getsizeof(g)
+        g.switch()
+        assert sys.getsizeof(g) - empty > 10000
+        g.switch()
+        assert sys.getsizeof(g) == empty
+
+    def test_tracemalloc(self):
+        domain = tracemalloc.DomainFilter(True, fibers.TRACEMALLOC_DOMAIN)
+        # pooled buffers stay allocated, only count new ones
+        fibers.set_stack_pool_limit(0)
+        tracemalloc.start()
+        try:
+            gs = [Fiber(nest, args=(30,)) for i in range(10)]
+            for g in gs:
+                g.switch()
+            traced = tracemalloc.take_snapshot().filter_traces([domain])
+            assert sum(t.size for t in traced.traces) > 10 * 10000
+            for g in gs:
+                g.switch()
+            traced = tracemalloc.take_snapshot().filter_traces([domain])
+            assert sum(t.size for t in traced.traces) < 10000
+        finally:
+            tracemalloc.stop()
+            fibers.set_stack_pool_limit(1024 * 1024)
+
+    def test_budget(self):
+        gs = [Fiber(nest, args=(30,)) for i in range(3)]
+        for g in gs:
+            g.switch()
+        in_use = fibers.stack_pool_info()['in_use']
+        fibers.set_stack_budget(in_use)
+        assert fibers.stack_pool_info()['budget'] == in_use
+        g = Fiber(nest, args=(30,))
+        # starting it needs room for the stack of main
+        with pytest.raises(MemoryError):
+            g.switch()
+        assert g.is_alive()
+        assert fibers.stack_pool_info()['in_use'] == in_use
+        fibers.set_stack_budget(0)
+        for f in gs:
+            f.switch()
+        g.switch()
+        g.switch()
+        assert not g.is_alive()
+        with pytest.raises(ValueError):
+            fibers.set_stack_budget(-1)
+
+    def test_budget_in_fiber(self):
+        errors = []
+
+        def deep(n):
+            if n == 0:
+                try:
+                    current().parent.switch()
+                except MemoryError as e:
+                    errors.append(e)
+                return
+            return list(map(deep, [n - 1]))
+
+        def f():
+            current().parent.switch()
+            deep(300)
+        main = current()
+        g = Fiber(f)
+        g.switch()
+        # room for the stack of main, but not for a deep one of g
+        main_stack = main.stack_stats['max_stack_bytes']
+        fibers.set_stack_budget(fibers.stack_pool_info()['in_use'] + 2 * main_stack + 4096)
+        g.switch()
+        # our stack was not saved, we kept going
+        assert len(errors) == 1
+        assert not g.is_alive()
+
+    @needs_stats
+    def test_depth_of_creator(self):
+        def copied(depth):
+            if depth:
+                return list(map(copied, [depth - 1]))[0]
+            stats = fibers.stats()['thread']
+            ping_pong(100)
+            after = fibers.stats()['thread']
+            return after['saved_bytes'] + after['restored_bytes'] - stats['saved_bytes'] - stats['restored_bytes']
+        # the stack of a fiber starts where it was first switched to, the
+        # frames of the code which started it are not copied with its own
+        assert copied(200) < copied(0) * 1.1
+
+    def test_budget_resume(self):
+        g = Fiber(nest, args=(30,))
+        g.switch()
+        fibers.set_stack_budget(fibers.stack_pool_info()['in_use'])
+        # resuming needs room for the stack of main
+        with pytest.raises(MemoryError):
+            g.switch(42)
+        assert current().parent is None
+        fibers.set_stack_budget(0)
+        g.switch()
+        assert not g.is_alive()
+
+
+def value_at(n):
+    if n == 0:
+        return current().parent.switch() * 2
+    return value_at(n - 1)
+
+
+def counter(n):
+    # the C stack below the switch changes on every step
+    if n == 0:
+        main = current().parent
+        i = 0
+        while True:
+            i = main.switch(i) + 1
+    return list(map(counter, [n - 1]))
+
+
+@pytest.mark.skipif(is_pypy, reason='stacks are managed by PyPy')
+class KeptBufferTests(unittest.TestCase):
+
+    def test_kept(self):
+        g = Fiber(counter, args=(30,))
+        assert g.switch() == 0
+        # main was resumed from a buffer, which it keeps
+        assert fibers.stack_pool_info()['kept'] > 0
+        in_use = fibers.stack_pool_info()['in_use']
+        assert [g.switch(i) for i in range(100)] == list(range(1, 101))
+        assert fibers.stack_pool_info()['in_use'] == in_use
+
+    def test_other_depth(self):
+        g = Fiber(counter, args=(30,))
+        g.switch()
+        # main is suspended deeper than it was resumed
+        assert list(map(g.switch, [41])) == [42]
+        assert g.switch(1) == 2
+
+    @needs_stats
+    def test_unchanged_not_copied(self):
+        g = Fiber(counter, args=(30,))
+        g.switch()
+        stats = fibers.stats()['thread']
+        for i in range(100):
+            g.switch(i)
+        after = fibers.stats()['thread']
+        unchanged = after['unchanged_bytes'] - stats['unchanged_bytes']
+        saved = after['saved_bytes'] - stats['saved_bytes']
+        assert unchanged > 100 * 10000
+        assert saved < unchanged / 10
+
+
+@pytest.mark.skipif(is_pypy, reason='stacks are managed by PyPy')
+class StackStreamTests(unittest.TestCase):
+
+    def tearDown(self):
+        fibers.set_stack_stream_threshold(0)
+
+    def test_info(self):
+        info = fibers.stack_copy_info()
+        assert info['stream_threshold'] == 0
+        assert info['stream_kernel'] in (None, 'sse2', 'avx2')
+        fibers.set_stack_stream_threshold(4096)
+        assert fibers.stack_copy_info()['stream_threshold'] == 4096
+        with pytest.raises(ValueError):
+            fibers.set_stack_stream_threshold(-1)
+
+    def test_streamed(self):
+        main = current()
+
+        def f(depth):
+            if depth:
+                return f(depth - 1) + 1
+            for i in range(100):
+                # not suspended where it was resumed, so it's saved again
+                if i % 2:
+                    main.switch(i)
+                else:
+                    list(map(main.switch, [i]))
+            return 0
+        fibers.set_stack_stream_threshold(1)
+        stats = fibers.stats()['thread'] if hasattr(fibers, 'stats') else None
+        gs = [Fiber(f, args=(depth,)) for depth in (100, 10)]
+        for i in range(100):
+            for g in gs:
+                assert g.switch() == i
+        assert [g.switch() for g in gs] == [100, 10]
+        if stats is not None and fibers.stack_copy_info()['stream_kernel']:
+            after = fibers.stats()['thread']
+            streamed = after['streamed_bytes'] - stats['streamed_bytes']
+            # all but the blocks which changed in the buffers taken back
+            assert 0 < streamed <= after['saved_bytes'] - stats['saved_bytes']
+            assert streamed > (after['saved_bytes'] - stats['saved_bytes']) / 2
+
+
+@pytest.mark.skipif(is_pypy, reason='stacks are managed by PyPy')
+class StackCompressionTests(unittest.TestCase):
+
+    def tearDown(self):
+        fibers.set_stack_compression(0)
+
+    @needs_stats
+    def test_pack_and_resume(self):
+        # not packed by the switches which start the others
+        fibers.set_stack_compression(60)
+        gs = [Fiber(value_at, args=(30,)) for i in range(10)]
+        for g in gs:
+            g.switch()
+        fibers.set_stack_compression(0.001)
+        in_use = fibers.stack_pool_info()['in_use']
+        sizes = [sys.getsizeof(g) for g in gs]
+        stats = fibers.stats()['thread']
+        time.sleep(0.01)
+        assert fibers.compress_stacks() == 10
+        assert fibers.stack_pool_info()['in_use'] < in_use
+        assert all(sys.getsizeof(g) < size for g, size in zip(gs, sizes))
+        packed = fibers.stats()['thread']
+        assert packed['packed_stacks'] - stats['packed_stacks'] == 10
+        assert packed['packed_saved_bytes'] > stats['packed_saved_bytes']
+        assert [g.switch(i) for i, g in enumerate(gs)] == [i * 2 for i in range(10)]
+        assert not any(g.is_alive() for g in gs)
+        resumed = fibers.stats()['thread']
+        assert resumed['unpacked_stacks'] - packed['unpacked_stacks'] == 10
+        assert resumed['packed_saved_bytes'] == stats['packed_saved_bytes']
+
+    @needs_stats
+    def test_shared_base(self):
+        fibers.set_stack_compression(60)
+        # the stacks of other tests' fibers, if any
+        baseline = fibers.stack_pool_info()['in_use']
+        # started and suspended in the same place, their stacks are alike
+        gs = [Fiber(nest, args=(30,)) for i in range(20)]
+        for g in gs:
+            g.switch()
+        fibers.set_stack_compression(0.001)
+        in_use = fibers.stack_pool_info()['in_use'] - baseline
+        stats = fibers.stats()['thread']
+        time.sleep(0.01)
+        assert fibers.compress_stacks() == 20
+        packed = fibers.stats()['thread']
+        assert packed['stack_bases'] - stats['stack_bases'] >= 1
+        assert packed['stack_base_bytes'] > stats['stack_base_bytes']
+        # much less than packing them one by one, which halves them at best.
+        # Buffers are counted in powers of two, and before 3.11 the stacks hold
+        # more words which differ, so the packed ones may take 8KiB each
+        assert fibers.stack_pool_info()['in_use'] - baseline < in_use / 3
+        for g in gs:
+            g.switch()
+        assert not any(g.is_alive() for g in gs)
+        fibers.set_stack_compression(0)
+        assert fibers.stats()['thread']['stack_bases'] == 0
+
+    @needs_stats
+    def test_shared_base_thread(self):
+        bases = fibers.stats()['process']['stack_bases']
+
+        def run():
+            fibers.set_stack_compression(0.001)
+            gs = [Fiber(nest, args=(30,)) for i in range(5)]
+            for g in gs:
+                g.switch()
+            time.sleep(0.01)
+            fibers.compress_stacks()
+            assert fibers.stats()['thread']['stack_bases'] >= 1
+            for g in gs:
+                g.switch()
+        t = threading.Thread(target=run)
+        t.start()
+        t.join()
+        gc.collect()
+        # the thread kept the last reference to the bases
+        assert fibers.stats()['process']['stack_bases'] == bases
+
+    @needs_stats
+    def test_packed_on_switch(self):
+        fibers.set_stack_compression(0.001)
+        g = Fiber(value_at, args=(30,))
+        g.switch()
+        packs = fibers.stats()['thread']['packed_stacks']
+        time.sleep(0.01)
+        # any later switch packs it
+        Fiber(lambda: None).switch()
+        assert fibers.stats()['thread']['packed_stacks'] > packs
+        assert fibers.compress_stacks() == 0
+        assert g.switch(21) == 42
+
+    def test_not_idle_long_enough(self):
+        fibers.set_stack_compression(60)
+        g = Fiber(value_at, args=(30,))
+        g.switch()
+        assert fibers.compress_stacks() == 0
+        g.switch(1)
+
+    def test_disabled(self):
+        g = Fiber(value_at, args=(30,))
+        g.switch()
+        time.sleep(0.01)
+        assert fibers.compress_stacks() == 0
+        fibers.set_stack_compression(0.001)
+        fibers.set_stack_compression(0)
+        time.sleep(0.01)
+        assert fibers.compress_stacks() == 0
+        g.switch(1)
+        with pytest.raises(ValueError):
+            fibers.set_stack_compression(-1)
+
+    @needs_stats
+    def test_scheduler(self):
+        fibers.set_stack_compression(0.001)
+        sched = fibers.Scheduler()
+        ch = fibers.Channel()
+        lst = []
+
+        def consumer():
+            lst.append(ch.recv())
+        for _ in range(5):
+            sched.spawn(consumer)
+        packs = fibers.stats()['thread']['packed_stacks']
+
+        def producer():
+            sched.sleep(0.02)
+            for i in range(5):
+                ch.send(i)
+        sched.spawn(producer)
+        sched.run()
+        # the parked consumers were packed while waiting for the timer
+        assert fibers.stats()['thread']['packed_stacks'] - packs >= 5
+        assert sorted(lst) == list(range(5))
+
+
+@pytest.mark.skipif(is_pypy or sys.version_info < (3, 11), reason='needs the data stack of CPython 3.11+')
+class DataStackPoolTests(unittest.TestCase):
+
+    def test_reuse(self):
+        def f(depth):
+            if depth:
+                return f(depth - 1) + 1
+            return 0
+        # deep enough for more chunks than the first one
+        for depth in (0, 1, 500, 0):
+            for _ in range(100):
+                assert Fiber(f, args=(depth,)).switch() == depth
+            assert 0 < fibers.stack_pool_info()['datastack_chunks'] <= 16
+
+    def test_many_alive(self):
+        main = current()
+
+        def f(i):
+            return main.switch(i) + i
+        gs = [Fiber(f, args=(i,)) for i in range(50)]
+        assert [g.switch() for g in gs] == list(range(50))
+        assert [g.switch(1) for g in gs] == list(range(1, 51))
+        assert fibers.stack_pool_info()['datastack_chunks'] == 16
+
+    def test_errors(self):
+        def f():
+            raise SomeError
+        for _ in range(100):
+            with pytest.raises(SomeError):
+                Fiber(f).switch()
+        assert fibers.stack_pool_info()['datastack_chunks'] > 0
+
+    def test_per_thread(self):
+        result = []
+
+        def run():
+            result.append(fibers.stack_pool_info()['datastack_chunks'])
+            Fiber(lambda: None).switch()
+            result.append(fibers.stack_pool_info()['datastack_chunks'])
+        t = threading.Thread(target=run)
+        t.start()
+        t.join()
+        assert result == [0, 1]
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,179 @@
+
+import gc
+import sys
+import unittest
+import weakref
+
+from fibers import Fiber, current
+import pytest
+
+
+STACK_SIZE = 256 * 1024
+
+
+class StackSizeTests(unittest.TestCase):
+
+    def test_simple(self):
+        lst = []
+
+        def f():
+            lst.append(1)
+            current().parent.switch()
+            lst.append(3)
+        g = Fiber(f, stack_size=STACK_SIZE)
+        lst.append(0)
+        g.switch()
+        lst.append(2)
+        g.switch()
+        lst.append(4)
+        assert lst == list(range(5))
+        assert not g.is_alive()
+
+    def test_return_value(self):
+        g = Fiber(lambda x: x * 2, args=(21,), stack_size=STACK_SIZE)
+        assert g.switch() == 42
+
+    def test_invalid_stack_size(self):
+        with pytest.raises(ValueError):
+            Fiber(lambda: None, stack_size=-1)
+        with pytest.raises(ValueError):
+            Fiber(lambda: None, stack_size=1024)
+
+    def test_ping_pong(self):
+        def f(n):
+            main = current().parent
+            for i in range(n):
+                assert main.switch(i) == i
+            return 'done'
+        g1 = Fiber(f, args=(100,), stack_size=STACK_SIZE)
+        res = g1.switch()
+        while g1.is_alive():
+            res = g1.switch(res)
+        assert res == 'done'
+
+    def test_between_separate_stacks(self):
+        lst = []
+
+        def f1():
+            lst.append(1)
+            g2.switch()
+            lst.append(3)
+            g2.switch()
+
+        def f2():
+            lst.append(2)
+            g1.switch()
+            lst.append(4)
+        g1 = Fiber(f1, stack_size=STACK_SIZE)
+        g2 = Fiber(f2, stack_size=STACK_SIZE)
+        g1.switch()
+        assert lst == [1, 2, 3, 4]
+
+    def test_mixed_with_copied_stacks(self):
+        lst = []
+
+        def copied(n):
+            lst.append(('copied', n))
+            current().parent.switch()
+            lst.append(('copied', n))
+
+        def separate():
+            # fibers started from a separate stack share it
+            gs = [Fiber(copied, args=(i,)) for i in range(3)]
+            for g in gs:
+                g.switch()
+            main.switch()
+            for g in gs:
+                g.switch()
+            return 'ok'
+        main = current()
+        g = Fiber(separate, stack_size=STACK_SIZE)
+        g.switch()
+        assert lst == [('copied', 0), ('copied', 1), ('copied', 2)]
+        assert g.switch() == 'ok'
+        assert lst[3:] == [('copied', 0), ('copied', 1), ('copied', 2)]
+
+    def test_resume_from_other_stack(self):
+        main = current()
+        lst = []
+
+        def copied(n):
+            lst.append(n)
+            main.switch()
+            lst.append(n)
+            main.switch()
+
+        def separate():
+            gs.extend(Fiber(copied, args=(i,)) for i in range(3))
+            main.switch()
+        gs = []
+        g = Fiber(separate, stack_size=STACK_SIZE)
+        g.switch()
+        for _ in range(2):
+            for h in gs:
+                h.switch()
+        assert lst == [0, 1, 2, 0, 1, 2]
+        g.switch()
+        assert not g.is_alive()
+        for h in gs:
+            h.switch()
+        assert not any(h.is_alive() for h in gs)
+
+    def test_deep_recursion(self):
+        def recurse(n):
+            if n == 0:
+                return current().parent.switch()
+            # go through C code so the C stack grows too
+            return sum(map(recurse, [n - 1])) + 1
+
+        g = Fiber(recurse, args=(300,), stack_size=4 * 1024 * 1024)
+        g.switch()
+        assert g.switch(0) == 300
+
+    def test_throw(self):
+        def f():
+            try:
+                current().parent.switch()
+            except ValueError:
+                return 'caught'
+        g = Fiber(f, stack_size=STACK_SIZE)
+        g.switch()
+        assert g.throw(ValueError) == 'caught'
+
+    def test_exception_propagates(self):
+        def f():
+            raise KeyError('boom')
+        g = Fiber(f, stack_size=STACK_SIZE)
+        with pytest.raises(KeyError):
+            g.switch()
+
+    def test_many_fibers(self):
+        def f(i):
+            current().parent.switch()
+            return i
+        gs = [Fiber(f, args=(i,), stack_size=STACK_SIZE) for i in range(200)]
+        for g in gs:
+            g.switch()
+        assert [g.switch() for g in gs] == list(range(200))
+
+    def test_dealloc_suspended(self):
+        def f():
+            current().parent.switch()
+        g = Fiber(f, stack_size=STACK_SIZE)
+        g.switch()
+        assert g.is_alive()
+        r = weakref.ref(g)
+        del g
+        gc.collect()
+        assert r() is None
+
+    def test_dealloc_not_started(self):
+        g = Fiber(lambda: None, stack_size=STACK_SIZE)
+        r = weakref.ref(g)
+        del g
+        gc.collect()
+        assert r() is None
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,168 @@
+
+import sys
+import threading
+import unittest
+
+import fibers
+from fibers import Fiber, current
+import pytest
+
+
+@pytest.mark.skipif(not hasattr(fibers, 'stats'), reason='statistics are not available')
+class StatsTests(unittest.TestCase):
+
+    def test_keys(self):
+        stats = fibers.stats()
+        assert set(stats) == {'thread', 'process'}
+        assert set(stats['thread']) == set(stats['process'])
+        for key in ('created', 'finished', 'switches', 'saved_bytes', 'restored_bytes',
+                    'saved_stack_bytes', 'peak_saved_stack_bytes', 'chain_walks',
+                    'chain_steps', 'max_chain_steps', 'mallocs'):
+            assert key in stats['thread']
+
+    def test_counters(self):
+        def f():
+            current().parent.switch()
+        before = fibers.stats()['thread']
+        gs = [Fiber(f) for i in range(10)]
+        for g in gs:
+            g.switch()
+        suspended = fibers.stats()['thread']
+        for g in gs:
+            g.switch()
+        after = fibers.stats()['thread']
+        assert after['created'] - before['created'] == 10
+        assert after['finished'] - before['finished'] == 10
+        assert after['switches'] - before['switches'] == 30
+        assert after['saved_bytes'] > before['saved_bytes']
+        assert after['chain_walks'] > before['chain_walks']
+        assert suspended['saved_stack_bytes'] > before['saved_stack_bytes']
+        assert after['peak_saved_stack_bytes'] >= suspended['saved_stack_bytes']
+
+    def test_saved_restored(self):
+        def nest(n):
+            if n == 0:
+                return current().parent.switch()
+            return list(map(nest, [n - 1]))
+        before = fibers.stats()['thread']
+        g = Fiber(nest, args=(50,))
+        g.switch()
+        g.switch()
+        after = fibers.stats()['thread']
+        assert after['saved_bytes'] - before['saved_bytes'] > 10000
+        assert after['restored_bytes'] - before['restored_bytes'] > 10000
+        assert after['saved_stack_bytes'] == before['saved_stack_bytes']
+
+    def test_process(self):
+        def worker():
+            for i in range(5):
+                Fiber(lambda: None).switch()
+        before = fibers.stats()['process']
+        t = threading.Thread(target=worker)
+        t.start()
+        t.join()
+        after = fibers.stats()
+        assert after['process']['created'] - before['created'] >= 5
+        assert after['process']['finished'] - before['finished'] >= 5
+        assert after['process']['created'] >= after['thread']['created']
+
+    def test_process_while_switching(self):
+        # other threads keep switching while their counters are read
+        stop = threading.Event()
+
+        def worker():
+            while not stop.is_set():
+                Fiber(lambda: None).switch()
+        ths = [threading.Thread(target=worker) for i in range(4)]
+        for t in ths:
+            t.start()
+        try:
+            last = fibers.stats()['process']['created']
+            for i in range(50):
+                created = fibers.stats()['process']['created']
+                assert created >= last
+                last = created
+        finally:
+            stop.set()
+            for t in ths:
+                t.join()
+
+    def test_stack_histogram(self):
+        def nest(n):
+            if n == 0:
+                return current().parent.switch()
+            return list(map(nest, [n - 1]))
+        hist = fibers.stack_histogram()
+        assert len(hist) == 12
+        assert [limit for limit, _ in hist] == [1024 << i for i in range(11)] + [None]
+        before = dict(hist)
+        g = Fiber(nest, args=(50,))
+        g.switch()
+        g.switch()
+        Fiber(lambda: None).switch()
+        after = dict(fibers.stack_histogram())
+        # the one which never switched away didn't grow its stack
+        assert after[1024] - before[1024] == 1
+        bucket = next(limit for limit, _ in hist if limit is None or limit > g.stack_stats['max_stack_bytes'])
+        assert after[bucket] - before[bucket] == 1
+        assert sum(after.values()) - sum(before.values()) == 2
+
+
+def nest(n):
+    if n == 0:
+        return current().parent.switch()
+    return list(map(nest, [n - 1]))
+
+
+@pytest.mark.skipif(not hasattr(Fiber, 'stack_stats'), reason='stack statistics are not available')
+class StackStatsTests(unittest.TestCase):
+
+    def test_not_started(self):
+        assert Fiber().stack_stats == {'max_stack_bytes': 0, 'max_recursion_depth': 0}
+
+    def test_high_water_marks(self):
+        g = Fiber(nest, args=(10,))
+        g.switch()
+        shallow = g.stack_stats
+        assert shallow['max_stack_bytes'] > 0
+        assert shallow['max_recursion_depth'] > 10
+        g.switch()
+        assert g.stack_stats == shallow
+        g = Fiber(nest, args=(50,))
+        g.switch()
+        deep = g.stack_stats
+        assert deep['max_stack_bytes'] > shallow['max_stack_bytes']
+        # before 3.9 the call from map() counts as a level of its own
+        levels = 80 if sys.version_info < (3, 9) else 40
+        assert deep['max_recursion_depth'] - shallow['max_recursion_depth'] == levels
+        # high-water marks, a shallower switch doesn't lower them
+        g.switch()
+        g.reset(nest, (10,))
+        assert g.stack_stats['max_stack_bytes'] == 0
+        g.switch()
+        assert g.stack_stats['max_recursion_depth'] == shallow['max_recursion_depth']
+        assert 0 < g.stack_stats['max_stack_bytes'] < deep['max_stack_bytes']
+        g.switch()
+
+    def test_main(self):
+        def f():
+            nest(20)
+        main = current()
+        g = Fiber(f)
+        g.switch()
+        assert main.stack_stats['max_recursion_depth'] > 0
+        g.switch()
+
+    def test_separate_stack(self):
+        size = 256 * 1024
+        try:
+            g = Fiber(nest, args=(50,), stack_size=size)
+        except (ValueError, fibers.error):
+            self.skipTest('separate stacks are not supported')
+        g.switch()
+        assert 0 < g.stack_stats['max_stack_bytes'] < size
+        g.switch()
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,117 @@
+
+import importlib
+import sys
+import textwrap
+import threading
+import unittest
+
+import fibers
+import pytest
+
+try:
+    import _interpreters as interpreters
+except ImportError:
+    try:
+        import _xxsubinterpreters as interpreters
+    except ImportError:
+        interpreters = None
+
+
+pytestmark = pytest.mark.skipif(interpreters is None or fibers.Fiber.__module__ != 'fibers._cfibers',
+                                reason='needs subinterpreters and the C extension')
+
+
+PING_PONG = '''
+import fibers
+
+main = fibers.current()
+
+def echo():
+    value = main.switch()
+    while True:
+        value = main.switch(value)
+
+g = fibers.Fiber(echo)
+g.switch()
+for i in range(%(n)d):
+    assert g.switch(i) == i
+
+sched = fibers.Scheduler()
+ch = fibers.Channel()
+received = []
+sched.spawn(lambda: ch.send_many(range(100)) or ch.close())
+sched.spawn(lambda: received.extend(ch))
+sched.run()
+assert received == list(range(100))
+'''
+
+
+def run_in_interpreter(code):
+    # isolated interpreters, with their own GIL, where supported
+    interp = interpreters.create()
+    try:
+        code = 'import sys; sys.path[:] = %r\n' % (sys.path,) + textwrap.dedent(code)
+        # raises on errors before 3.13, where the error is returned
+        error = interpreters.run_string(interp, code)
+        if error is not None:
+            raise RuntimeError('%s: %s' % (error.type.__name__, error.msg))
+    finally:
+        interpreters.destroy(interp)
+
+
+class SubinterpreterTests(unittest.TestCase):
+
+    def test_import(self):
+        run_in_interpreter('''
+            import fibers
+            assert fibers.Fiber.__module__ == 'fibers._cfibers'
+            assert fibers.current().parent is None
+        ''')
+
+    def test_switch(self):
+        run_in_interpreter(PING_PONG % {'n': 1000})
+
+    def test_concurrent(self):
+        errors = []
+
+        def run():
+            try:
+                run_in_interpreter(PING_PONG % {'n': 10000})
+            except Exception as e:
+                errors.append(e)
+        threads = [threading.Thread(target=run) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert errors == []
+        # and the main interpreter is unaffected
+        g = fibers.Fiber(lambda: 42)
+        assert g.switch() == 42
+
+    def test_errors_are_per_interpreter(self):
+        run_in_interpreter('''
+            import fibers
+            try:
+                fibers.current().switch()
+            except fibers.error:
+                pass
+            else:
+                raise AssertionError('fibers.error not raised')
+        ''')
+
+    def test_reimport_shares_types(self):
+        module = sys.modules.pop('fibers._cfibers')
+        try:
+            again = importlib.import_module('fibers._cfibers')
+            assert again is not module
+            assert again.Fiber is module.Fiber
+            assert again.error is module.error
+            g = again.Fiber(lambda: None, parent=module.current())
+            g.switch()
+        finally:
+            sys.modules['fibers._cfibers'] = module
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)